@@ -0,0 +1,574 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+
+#include "analysis.h"
+
+namespace chip8 {
+
+constexpr char kAnalysisMagic[4] = {'C', '8', 'A', 'N'};
+
+// Value of I at a block entry that differs between the paths leading to it
+constexpr uint16_t kUnknownI = 0xFFFF;
+
+template <typename T>
+static void Put(std::vector<uint8_t>& data, T value) {
+  for (size_t i = 0; i < sizeof(T); ++i)
+    data.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+template <typename T>
+static bool Get(const std::vector<uint8_t>& data, size_t& position, T& value) {
+  if (data.size() - position < sizeof(T))
+    return false;
+  value = 0;
+  for (size_t i = 0; i < sizeof(T); ++i)
+    value |= static_cast<T>(data[position++]) << (8 * i);
+  return true;
+}
+
+uint8_t Analysis::GetFlags(uint16_t address) const {
+  const size_t offset = address - kProgramOffset;
+  if (address < kProgramOffset || offset >= flags.size())
+    return 0;
+  return flags[offset];
+}
+
+const BasicBlock* Analysis::FindBlock(uint16_t address) const {
+  auto it = std::lower_bound(
+      blocks.begin(), blocks.end(), address,
+      [](const BasicBlock& block, uint16_t a) { return block.address < a; });
+  if (it == blocks.end() || it->address != address)
+    return nullptr;
+  return &*it;
+}
+
+bool Analysis::self_modifying() const {
+  return std::any_of(stores.begin(), stores.end(),
+                     [](const Store& store) { return store.modifies_code; });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::string Disassemble(const Instruction& instruction) {
+  const unsigned x = instruction.x;
+  const unsigned y = instruction.y;
+  const unsigned kk = instruction.kk;
+  const unsigned nnn = instruction.nnn;
+  char s[32];
+
+  switch (instruction.op) {
+    case Opcode::k00E0: return "CLS";
+    case Opcode::k00EE: return "RET";
+    case Opcode::k1nnn:
+      std::snprintf(s, sizeof(s), "JP 0x%03X", nnn);
+      break;
+    case Opcode::k2nnn:
+      std::snprintf(s, sizeof(s), "CALL 0x%03X", nnn);
+      break;
+    case Opcode::k3xkk:
+      std::snprintf(s, sizeof(s), "SE V%X, 0x%02X", x, kk);
+      break;
+    case Opcode::k4xkk:
+      std::snprintf(s, sizeof(s), "SNE V%X, 0x%02X", x, kk);
+      break;
+    case Opcode::k5xy0:
+      std::snprintf(s, sizeof(s), "SE V%X, V%X", x, y);
+      break;
+    case Opcode::k6xkk:
+      std::snprintf(s, sizeof(s), "LD V%X, 0x%02X", x, kk);
+      break;
+    case Opcode::k7xkk:
+      std::snprintf(s, sizeof(s), "ADD V%X, 0x%02X", x, kk);
+      break;
+    case Opcode::k8xy0:
+      std::snprintf(s, sizeof(s), "LD V%X, V%X", x, y);
+      break;
+    case Opcode::k8xy1:
+      std::snprintf(s, sizeof(s), "OR V%X, V%X", x, y);
+      break;
+    case Opcode::k8xy2:
+      std::snprintf(s, sizeof(s), "AND V%X, V%X", x, y);
+      break;
+    case Opcode::k8xy3:
+      std::snprintf(s, sizeof(s), "XOR V%X, V%X", x, y);
+      break;
+    case Opcode::k8xy4:
+      std::snprintf(s, sizeof(s), "ADD V%X, V%X", x, y);
+      break;
+    case Opcode::k8xy5:
+      std::snprintf(s, sizeof(s), "SUB V%X, V%X", x, y);
+      break;
+    case Opcode::k8xy6:
+      std::snprintf(s, sizeof(s), "SHR V%X, V%X", x, y);
+      break;
+    case Opcode::k8xy7:
+      std::snprintf(s, sizeof(s), "SUBN V%X, V%X", x, y);
+      break;
+    case Opcode::k8xyE:
+      std::snprintf(s, sizeof(s), "SHL V%X, V%X", x, y);
+      break;
+    case Opcode::k9xy0:
+      std::snprintf(s, sizeof(s), "SNE V%X, V%X", x, y);
+      break;
+    case Opcode::kAnnn:
+      std::snprintf(s, sizeof(s), "LD I, 0x%03X", nnn);
+      break;
+    case Opcode::kBnnn:
+      std::snprintf(s, sizeof(s), "JP V0, 0x%03X", nnn);
+      break;
+    case Opcode::kCxkk:
+      std::snprintf(s, sizeof(s), "RND V%X, 0x%02X", x, kk);
+      break;
+    case Opcode::kDxyn:
+      std::snprintf(s, sizeof(s), "DRW V%X, V%X, %u", x, y,
+                    static_cast<unsigned>(instruction.n));
+      break;
+    case Opcode::kEx9E:
+      std::snprintf(s, sizeof(s), "SKP V%X", x);
+      break;
+    case Opcode::kExA1:
+      std::snprintf(s, sizeof(s), "SKNP V%X", x);
+      break;
+    case Opcode::kFx07:
+      std::snprintf(s, sizeof(s), "LD V%X, DT", x);
+      break;
+    case Opcode::kFx0A:
+      std::snprintf(s, sizeof(s), "LD V%X, K", x);
+      break;
+    case Opcode::kFx15:
+      std::snprintf(s, sizeof(s), "LD DT, V%X", x);
+      break;
+    case Opcode::kFx18:
+      std::snprintf(s, sizeof(s), "LD ST, V%X", x);
+      break;
+    case Opcode::kFx1E:
+      std::snprintf(s, sizeof(s), "ADD I, V%X", x);
+      break;
+    case Opcode::kFx29:
+      std::snprintf(s, sizeof(s), "LD F, V%X", x);
+      break;
+    case Opcode::kFx33:
+      std::snprintf(s, sizeof(s), "LD B, V%X", x);
+      break;
+    case Opcode::kFx55:
+      std::snprintf(s, sizeof(s), "LD [I], V%X", x);
+      break;
+    case Opcode::kFx65:
+      std::snprintf(s, sizeof(s), "LD V%X, [I]", x);
+      break;
+    case Opcode::k00Cn:
+      std::snprintf(s, sizeof(s), "SCD %u",
+                    static_cast<unsigned>(instruction.n));
+      break;
+    case Opcode::k00FB: return "SCR";
+    case Opcode::k00FC: return "SCL";
+    case Opcode::k00FD: return "EXIT";
+    case Opcode::k00FE: return "LOW";
+    case Opcode::k00FF: return "HIGH";
+    case Opcode::kFx30:
+      std::snprintf(s, sizeof(s), "LD HF, V%X", x);
+      break;
+    case Opcode::kFx75:
+      std::snprintf(s, sizeof(s), "LD R, V%X", x);
+      break;
+    case Opcode::kFx85:
+      std::snprintf(s, sizeof(s), "LD V%X, R", x);
+      break;
+    case Opcode::k00Dn:
+      std::snprintf(s, sizeof(s), "SCU %u",
+                    static_cast<unsigned>(instruction.n));
+      break;
+    case Opcode::k5xy2:
+      std::snprintf(s, sizeof(s), "LD [I], V%X-V%X", x, y);
+      break;
+    case Opcode::k5xy3:
+      std::snprintf(s, sizeof(s), "LD V%X-V%X, [I]", x, y);
+      break;
+    case Opcode::kF000: return "LD I, LONG";  // followed by the address
+    case Opcode::kFx01:
+      std::snprintf(s, sizeof(s), "PLANE %X", x);
+      break;
+    default:
+      std::snprintf(s, sizeof(s), "DW 0x%04X",
+                    static_cast<unsigned>(instruction.code));
+      break;
+  }
+
+  return s;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Analyze(const std::vector<uint8_t>& program, Analysis& analysis) {
+  analysis = Analysis();
+  analysis.program_hash = HashProgram(program);
+  analysis.flags.assign(program.size(), 0);
+
+  // Whether a whole instruction at the address is part of the program
+  auto contains = [&](uint32_t address) {
+    return address >= kProgramOffset &&
+           address - kProgramOffset + 2 <= program.size();
+  };
+  auto mark = [&](uint32_t address, uint32_t length, uint8_t flag) {
+    for (uint32_t j = 0; j < length; ++j) {
+      const uint32_t offset =
+          ((address + j) & kXoChipAddressMask) - kProgramOffset;
+      if (offset < program.size())
+        analysis.flags[offset] |= flag;
+    }
+  };
+
+  std::map<uint16_t, uint16_t> entries;  // value of I at each block entry
+  std::map<uint16_t, BasicBlock> blocks;
+  std::map<uint16_t, CallSite> calls;
+  std::map<uint16_t, Store> stores;
+  std::vector<uint16_t> pending;
+
+  // A block is scanned again once I turns out to differ between paths, so
+  // each block is scanned at most twice
+  auto reach = [&](uint16_t address, uint16_t i) {
+    if (!contains(address))
+      return;
+    auto it = entries.find(address);
+    if (it == entries.end()) {
+      entries[address] = i;
+      pending.push_back(address);
+    } else if (it->second != i && it->second != kUnknownI) {
+      it->second = kUnknownI;
+      pending.push_back(address);
+    }
+  };
+
+  auto store = [&](uint16_t address, uint16_t i, uint8_t length) {
+    Store s;
+    s.address = address;
+    s.length = length;
+    s.known = i != kUnknownI;
+    s.target = s.known ? i : 0;
+
+    // Reached again with a different I
+    auto it = stores.find(address);
+    if (it != stores.end() && (!it->second.known || it->second.target != i)) {
+      s.known = false;
+      s.target = 0;
+    }
+    stores[address] = s;
+  };
+
+  reach(kProgramOffset, 0);  // I is cleared by a reset
+
+  while (!pending.empty()) {
+    uint16_t address = pending.back();
+    pending.pop_back();
+    uint16_t i = entries[address];
+
+    BasicBlock block;
+    block.address = address;
+    bool call = false;
+
+    for (;;) {
+      const size_t offset = address - kProgramOffset;
+      const auto instruction = Decode(program[offset] << 8 |
+                                      program[offset + 1]);
+      analysis.flags[offset] |= kFlagCode;
+      analysis.flags[offset + 1] |= kFlagOperand;
+      ++block.length;
+      const uint16_t next = address + 2;
+      // Where a skip lands, past the instruction that follows
+      auto skip = [&]() -> uint16_t {
+        if (!contains(next))
+          return next + 2;
+        const size_t at = next - kProgramOffset;
+        return next + GetInstructionSize(program[at] << 8 | program[at + 1]);
+      };
+      const uint8_t count = instruction.x <= instruction.y ?
+          instruction.y - instruction.x + 1 : instruction.x - instruction.y + 1;
+
+      switch (instruction.op) {
+        case Opcode::kAnnn:
+          i = instruction.nnn;
+          break;
+        case Opcode::kF000:
+          if (contains(next)) {
+            mark(next, 2, kFlagOperand);
+            i = program[next - kProgramOffset] << 8 |
+                program[next - kProgramOffset + 1];
+          } else {
+            i = kUnknownI;
+          }
+          break;
+        case Opcode::kFx1E:
+        case Opcode::kFx29:
+        case Opcode::kFx30:
+          i = kUnknownI;
+          break;
+        case Opcode::kDxyn:
+          // Dxy0 draws 16 rows of two bytes. Either takes twice as much
+          // with both planes selected, which is not tracked.
+          if (i != kUnknownI)
+            mark(i, instruction.n ? instruction.n : 32, kFlagSprite);
+          break;
+        case Opcode::kFx65:
+          if (i != kUnknownI)
+            mark(i, instruction.x + 1, kFlagData);
+          break;
+        case Opcode::k5xy3:
+          if (i != kUnknownI)
+            mark(i, count, kFlagData);
+          break;
+        case Opcode::k5xy2:
+          store(address, i, count);
+          break;
+        case Opcode::kFx33:
+          store(address, i, 3);
+          break;
+        case Opcode::kFx55:
+          store(address, i, instruction.x + 1);
+          break;
+        default:
+          break;
+      }
+
+      if (IsBlockEnd(instruction.op)) {
+        switch (instruction.op) {
+          case Opcode::k1nnn:
+            block.successors = {instruction.nnn};
+            break;
+          case Opcode::k2nnn:
+            block.successors = {instruction.nnn, next};
+            calls[address] = {address, instruction.nnn};
+            call = true;
+            break;
+          case Opcode::k3xkk:
+          case Opcode::k4xkk:
+          case Opcode::k5xy0:
+          case Opcode::k9xy0:
+          case Opcode::kEx9E:
+          case Opcode::kExA1:
+            block.successors = {next, skip()};
+            break;
+          case Opcode::kF000:
+            block.successors = {static_cast<uint16_t>(next + 2)};
+            break;
+          case Opcode::kFx0A:
+            // Resumed from the instruction itself while waiting for a key
+            block.successors = {address, next};
+            break;
+          case Opcode::kFx18:
+          case Opcode::kFx33:
+          case Opcode::kFx55:
+          case Opcode::k5xy2:
+            block.successors = {next};
+            break;
+          case Opcode::kBnnn:
+            analysis.indirect_jumps = true;
+            break;
+          default:
+            break;
+        }
+        break;
+      }
+
+      address = next;
+      if (block.length == kMaxBlockLength || !contains(address)) {
+        block.successors = {address};
+        break;
+      }
+    }
+
+    // A subroutine may leave anything in I when it returns
+    for (size_t j = 0; j < block.successors.size(); ++j)
+      reach(block.successors[j], call && j == 1 ? kUnknownI : i);
+    blocks[block.address] = std::move(block);
+  }
+
+  for (const auto& it : blocks) {
+    mark(it.first, 1, kFlagEntry);
+    analysis.blocks.push_back(it.second);
+  }
+  for (const auto& it : calls) {
+    mark(it.second.target, 1, kFlagSubroutine);
+    analysis.calls.push_back(it.second);
+  }
+  for (const auto& it : stores) {
+    if (it.second.known)
+      mark(it.second.target, it.second.length, kFlagWritten);
+  }
+
+  // Stores through an unknown I may write anywhere
+  for (auto it : stores) {
+    auto& s = it.second;
+    s.modifies_code = !s.known;
+    for (uint32_t j = 0; s.known && j < s.length; ++j) {
+      if (analysis.GetFlags((s.target + j) & kXoChipAddressMask) &
+          (kFlagCode | kFlagOperand)) {
+        s.modifies_code = true;
+      }
+    }
+    analysis.stores.push_back(s);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool ReadAnalysis(const std::string& path, Analysis& analysis) {
+  std::ifstream is(path, std::ios::binary);
+  if (!is)
+    return false;
+
+  const std::vector<uint8_t> data{std::istreambuf_iterator<char>(is),
+                                  std::istreambuf_iterator<char>()};
+  if (data.size() < sizeof(kAnalysisMagic) ||
+      !std::equal(kAnalysisMagic, kAnalysisMagic + sizeof(kAnalysisMagic),
+                  data.begin())) {
+    return false;
+  }
+
+  size_t position = sizeof(kAnalysisMagic);
+  uint32_t version = 0;
+  uint8_t indirect_jumps = 0;
+  uint32_t count = 0;
+  analysis = Analysis();
+  if (!Get(data, position, version) || version != kAnalysisVersion ||
+      !Get(data, position, analysis.program_hash) ||
+      !Get(data, position, indirect_jumps) ||
+      !Get(data, position, count)) {
+    return false;
+  }
+  analysis.indirect_jumps = indirect_jumps != 0;
+
+  for (uint32_t j = 0; j < count; ++j) {
+    BasicBlock block;
+    uint8_t successors = 0;
+    if (!Get(data, position, block.address) ||
+        !Get(data, position, block.length) ||
+        !Get(data, position, successors)) {
+      return false;
+    }
+    block.successors.resize(successors);
+    for (auto& successor : block.successors) {
+      if (!Get(data, position, successor))
+        return false;
+    }
+    analysis.blocks.push_back(block);
+  }
+
+  if (!Get(data, position, count))
+    return false;
+  for (uint32_t j = 0; j < count; ++j) {
+    CallSite call;
+    if (!Get(data, position, call.address) ||
+        !Get(data, position, call.target)) {
+      return false;
+    }
+    analysis.calls.push_back(call);
+  }
+
+  if (!Get(data, position, count))
+    return false;
+  for (uint32_t j = 0; j < count; ++j) {
+    Store store;
+    uint8_t flags = 0;
+    if (!Get(data, position, store.address) ||
+        !Get(data, position, store.target) ||
+        !Get(data, position, store.length) ||
+        !Get(data, position, flags)) {
+      return false;
+    }
+    store.known = (flags & 0x01) != 0;
+    store.modifies_code = (flags & 0x02) != 0;
+    analysis.stores.push_back(store);
+  }
+
+  if (!Get(data, position, count) || data.size() - position != count)
+    return false;
+  analysis.flags.assign(data.begin() + position, data.end());
+
+  return true;
+}
+
+bool WriteAnalysis(const std::string& path, const Analysis& analysis) {
+  std::vector<uint8_t> data(kAnalysisMagic,
+                            kAnalysisMagic + sizeof(kAnalysisMagic));
+  Put(data, kAnalysisVersion);
+  Put(data, analysis.program_hash);
+  Put(data, static_cast<uint8_t>(analysis.indirect_jumps));
+
+  Put(data, static_cast<uint32_t>(analysis.blocks.size()));
+  for (const auto& block : analysis.blocks) {
+    Put(data, block.address);
+    Put(data, block.length);
+    Put(data, static_cast<uint8_t>(block.successors.size()));
+    for (const auto successor : block.successors)
+      Put(data, successor);
+  }
+
+  Put(data, static_cast<uint32_t>(analysis.calls.size()));
+  for (const auto& call : analysis.calls) {
+    Put(data, call.address);
+    Put(data, call.target);
+  }
+
+  Put(data, static_cast<uint32_t>(analysis.stores.size()));
+  for (const auto& store : analysis.stores) {
+    Put(data, store.address);
+    Put(data, store.target);
+    Put(data, store.length);
+    Put(data, static_cast<uint8_t>((store.known ? 0x01 : 0x00) |
+                                   (store.modifies_code ? 0x02 : 0x00)));
+  }
+
+  Put(data, static_cast<uint32_t>(analysis.flags.size()));
+  data.insert(data.end(), analysis.flags.begin(), analysis.flags.end());
+
+  std::ofstream os(path, std::ios::binary);
+  os.write(reinterpret_cast<const char*>(data.data()), data.size());
+  return static_cast<bool>(os);
+}
+
+bool AnalyzeCached(const std::vector<uint8_t>& program,
+                   const std::string& directory, Analysis& analysis) {
+  char name[32];
+  const uint64_t hash = HashProgram(program);
+  std::snprintf(name, sizeof(name), "%016llx.c8a",
+                static_cast<unsigned long long>(hash));
+  const std::string path = directory.empty() ? name : directory + "/" + name;
+
+  if (ReadAnalysis(path, analysis) && analysis.program_hash == hash &&
+      analysis.flags.size() == program.size()) {
+    return true;
+  }
+
+  Analyze(program, analysis);
+  WriteAnalysis(path, analysis);
+  return false;
+}
+
+}  // namespace chip8
@@ -0,0 +1,102 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+
+namespace chip8 {
+
+constexpr uint32_t kAnalysisVersion = 2;
+
+// What is known about each byte of a program
+enum AddressFlags : uint8_t {
+  kFlagCode = 0x01,        // first byte of an instruction that is reached
+  kFlagOperand = 0x02,     // second byte of one
+  kFlagEntry = 0x04,       // starts a basic block
+  kFlagSubroutine = 0x08,  // called by 2nnn
+  kFlagSprite = 0x10,      // drawn by Dxyn
+  kFlagData = 0x20,        // loaded by Fx65 or 5xy3
+  kFlagWritten = 0x40,     // stored to by Fx33, Fx55 or 5xy2
+};
+
+struct BasicBlock {
+  uint16_t address = 0;
+  uint16_t length = 0;  // in instructions
+  // Where control continues, as far as it is known ahead of time. Returns
+  // and indirect jumps are only resolved at run time.
+  std::vector<uint16_t> successors;
+};
+
+struct CallSite {
+  uint16_t address = 0;  // of the 2nnn instruction
+  uint16_t target = 0;
+};
+
+// Fx33, Fx55 or 5xy2
+struct Store {
+  uint16_t address = 0;  // of the instruction
+  uint16_t target = 0;   // where I points, if known
+  uint8_t length = 0;    // bytes written
+  bool known = false;    // whether I holds the same value on every path
+  bool modifies_code = false;  // may overwrite an instruction that is reached
+};
+
+// Control flow and data use of a program, found by following every path from
+// the program offset. Sprites and data are found by tracking I from Annn to
+// the instructions that use it, so tables indexed at run time may be missed.
+struct Analysis {
+  uint64_t program_hash = 0;  // HashProgram() of the analyzed program
+  std::vector<BasicBlock> blocks;  // sorted by address
+  std::vector<CallSite> calls;     // sorted by address
+  std::vector<Store> stores;       // sorted by address
+  std::vector<uint8_t> flags;      // AddressFlags, one per program byte
+  bool indirect_jumps = false;     // whether Bnnn is reached
+
+  uint8_t GetFlags(uint16_t address) const;
+  const BasicBlock* FindBlock(uint16_t address) const;
+  bool self_modifying() const;  // whether any store may modify code
+};
+
+// Cowgod's syntax, e.g. "DRW V1, V2, 5"
+std::string Disassemble(const Instruction& instruction);
+
+void Analyze(const std::vector<uint8_t>& program, Analysis& analysis);
+
+// Files start with a fixed header that includes the program hash, followed by
+// the analysis in little endian
+bool ReadAnalysis(const std::string& path, Analysis& analysis);
+bool WriteAnalysis(const std::string& path, const Analysis& analysis);
+
+// Reads the analysis of a program from `directory`, where it is stored under
+// the program hash, or analyzes the program and stores it there. Returns
+// false if the analysis was not cached yet.
+bool AnalyzeCached(const std::vector<uint8_t>& program,
+                   const std::string& directory, Analysis& analysis);
+
+}  // namespace chip8
@@ -0,0 +1,179 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "aot.h"
+
+namespace chip8 {
+
+// Filled during static initialization, so it must be constructed on first use
+static std::vector<const AotProgram*>& Programs() {
+  static std::vector<const AotProgram*> programs;
+  return programs;
+}
+
+Aot::Aot(Emulator& emulator)
+    : emulator_(emulator), blocks_(emulator.memory.size()) {
+}
+
+void Aot::Register(const AotProgram& program) {
+  Programs().push_back(&program);
+}
+
+const AotProgram* Aot::Find(uint64_t hash) {
+  for (const auto program : Programs()) {
+    if (program->hash == hash)
+      return program;
+  }
+  return nullptr;
+}
+
+void Aot::Call(Emulator& emulator, const Instruction& instruction) {
+  emulator.instruction_ = instruction;
+  emulator.Execute();
+}
+
+uint16_t Aot::Skip(const Emulator& emulator, uint16_t address) {
+  const auto& memory = emulator.memory;
+  const uint16_t mask = emulator.address_mask_;
+  return address + GetInstructionSize(memory[address & mask] << 8 |
+                                          memory[(address + 1) & mask],
+                                      emulator.dispatch_->extension);
+}
+
+// Size of a block in bytes, or 0 if it does not fit into the program. Blocks
+// are recompiled with every extension, so neither can they be used if any of
+// their instructions decodes otherwise with `extension`.
+static size_t GetBlockSize(const std::vector<uint8_t>& program, size_t offset,
+                           uint16_t length, Extension extension) {
+  size_t size = 0;
+  for (uint16_t j = 0; j < length; ++j) {
+    const size_t at = offset + size;
+    if (at + 2 > program.size())
+      return 0;
+    const uint16_t code = program[at] << 8 | program[at + 1];
+    if (Decode(code, extension).op != Decode(code).op)
+      return 0;
+    size += GetInstructionSize(code);
+  }
+  return offset + size <= program.size() ? size : 0;
+}
+
+bool Aot::available() {
+  if (!attached_)
+    Attach();
+  return program_ != nullptr;
+}
+
+const Emulator* Aot::owner() const {
+  return &emulator_;
+}
+
+uint32_t Aot::Run(uint32_t cycles) {
+  if (!available())
+    return emulator_.RunThreaded(cycles);
+
+  auto& processor = emulator_.processor;
+  uint32_t cycle = 0;
+  emulator_.idle_.valid = false;
+
+  while (cycle < cycles) {
+    const uint16_t address = processor.pc & emulator_.address_mask_;
+    // A copy, as the block may invalidate itself by writing to memory
+    const auto block = blocks_[address];
+
+    if (block.code && cycles - cycle >= block.length) {
+      block.code(processor, emulator_);
+      cycle += block.length;
+    } else {
+      // The trampoline: code that was not found ahead of time, has been
+      // modified, or does not fit into the remaining budget
+      emulator_.Cycle();
+      ++cycle;
+      ++interpreted_;
+    }
+
+    // Only block ends can stop execution
+    if (emulator_.stop_ != StopReason::kBudget && emulator_.EndsRun(cycle))
+      break;
+
+    if (processor.pc <= address && !--emulator_.idle_countdown_)
+      cycle += emulator_.SkipIdle(cycle, cycles);
+  }
+
+  return cycle;
+}
+
+void Aot::Invalidate(uint16_t address, size_t length) {
+  if (!attached_)
+    return;
+
+  for (size_t j = 0; j < length + kMaxBlockLength * 2; ++j) {
+    blocks_[(address + length - 1 - j) & emulator_.address_mask_] = Block();
+  }
+}
+
+void Aot::Flush() {
+  blocks_.assign(emulator_.memory.size(), Block());
+  program_ = nullptr;
+  attached_ = false;
+}
+
+uint64_t Aot::interpreted() const {
+  return interpreted_;
+}
+
+void Aot::Attach() {
+  const auto& program = emulator_.program_;
+  program_ = Find(HashProgram(program));
+  attached_ = true;
+
+  if (!program_)
+    return;
+
+  // Only blocks whose code is still the same as in the program can be used,
+  // in case memory was written before the first run, e.g. by a loaded state
+  const auto& memory = emulator_.memory;
+  for (size_t j = 0; j < program_->block_count; ++j) {
+    const auto& block = program_->blocks[j];
+    if (block.address < kProgramOffset)
+      continue;
+    const size_t offset = block.address - kProgramOffset;
+    const size_t size = GetBlockSize(program, offset, block.length,
+                                     emulator_.dispatch_->extension);
+    if (!size ||
+        std::memcmp(&memory[block.address], &program[offset], size) != 0) {
+      continue;
+    }
+    blocks_[block.address].code = block.code;
+    blocks_[block.address].length = block.length;
+    emulator_.MarkDecoded(block.address);
+    emulator_.MarkDecoded(static_cast<uint32_t>(block.address + size - 1));
+  }
+}
+
+}  // namespace chip8
@@ -0,0 +1,130 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "chip8.h"
+
+namespace chip8 {
+
+// Native code for a basic block. Executes all of its instructions and leaves
+// the program counter at the next one.
+typedef void (*aot_code_t)(Processor& processor, Emulator& emulator);
+
+struct AotBlock {
+  uint16_t address;
+  uint16_t length;  // number of instructions
+  aot_code_t code;
+};
+
+// A program recompiled ahead of time by chip8-recompile
+struct AotProgram {
+  uint64_t hash;  // HashProgram() of the program it was compiled from
+  const AotBlock* blocks;
+  size_t block_count;
+};
+
+// Runs programs that were recompiled to C++ and linked into the executable.
+// Blocks are looked up by the program counter, so indirect jumps and returns
+// reach recompiled code whenever they land on a block entry. Anything else,
+// including code that the program has overwritten, is stepped through the
+// interpreter. Without a recompiled program, the threaded executor is used.
+class Aot {
+public:
+  explicit Aot(Emulator& emulator);
+
+  Aot(const Aot&) = delete;
+  Aot& operator=(const Aot&) = delete;
+
+  // Generated code registers its program at startup. The program must
+  // outlive every emulator that runs it.
+  static void Register(const AotProgram& program);
+  static const AotProgram* Find(uint64_t hash);
+
+  // Called by generated code for the instructions it does not translate
+  static void Call(Emulator& emulator, const Instruction& instruction);
+  // Called by generated code to skip the instruction at `address`, which is
+  // read from memory, as the program may have replaced it
+  static uint16_t Skip(const Emulator& emulator, uint16_t address);
+  // Quirks of the emulator's current profile, which generated code branches
+  // on, as it runs with every profile
+  static bool ShiftsVy(const Emulator& emulator);
+  static bool JumpsVx(const Emulator& emulator);
+  // The byte that RND masks, drawn as the handler does
+  static uint8_t Random(Emulator& emulator);
+
+  // Whether a recompiled program matches the loaded one
+  bool available();
+  const Emulator* owner() const;
+
+  // Returns the number of instructions executed
+  uint32_t Run(uint32_t cycles);
+
+  void Invalidate(uint16_t address, size_t length);
+  void Flush();  // must be called when the loaded program changes
+
+  uint64_t interpreted() const;  // instructions stepped outside of blocks
+
+private:
+  struct Block {
+    aot_code_t code = nullptr;
+    uint16_t length = 0;
+  };
+
+  void Attach();
+
+  Emulator& emulator_;
+  std::vector<Block> blocks_;  // one per byte of the emulator's memory
+  const AotProgram* program_ = nullptr;
+  bool attached_ = false;
+  uint64_t interpreted_ = 0;
+};
+
+inline bool Aot::ShiftsVy(const Emulator& emulator) {
+  return emulator.dispatch_->shift_vy;
+}
+
+inline bool Aot::JumpsVx(const Emulator& emulator) {
+  return emulator.dispatch_->jump_vx;
+}
+
+inline uint8_t Aot::Random(Emulator& emulator) {
+  ++emulator.side_effects_;
+  return emulator.random_source_ ?
+      emulator.random_source_() :
+      static_cast<uint8_t>(emulator.random_.Next() >> 24);
+}
+
+// Registers a program when the generated translation unit is initialized
+struct AotRegistration {
+  explicit AotRegistration(const AotProgram& program) {
+    Aot::Register(program);
+  }
+};
+
+}  // namespace chip8
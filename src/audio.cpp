@@ -0,0 +1,206 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+
+#include "audio.h"
+
+namespace chip8 {
+
+constexpr uint32_t kPhaseShift = 24;  // 32-bit phase to wavetable index
+
+static_assert(kWavetableSize == 1u << (32 - kPhaseShift),
+              "Wavetable size must match the phase");
+
+Audio::Audio(uint32_t sample_rate, uint16_t frequency, int16_t amplitude)
+    : sample_rate_(sample_rate),
+      step_(static_cast<uint32_t>((static_cast<uint64_t>(frequency) << 32) /
+                                  sample_rate)) {
+  // Triangle wave that starts at zero, so that starting a tone does not click
+  for (size_t i = 0; i < kWavetableSize; ++i) {
+    const int32_t quarter = kWavetableSize / 4;
+    const int32_t x = static_cast<int32_t>(i);
+    int32_t value;
+    if (x < quarter) {
+      value = x;
+    } else if (x < 3 * quarter) {
+      value = 2 * quarter - x;
+    } else {
+      value = x - 4 * quarter;
+    }
+    wavetable_[i] = static_cast<int16_t>(value * amplitude / quarter);
+  }
+}
+
+uint32_t Audio::sample_rate() const {
+  return sample_rate_;
+}
+
+bool Audio::Push(const Emulator& emulator) {
+  const auto& writes = emulator.sound_writes();
+  Frame frame;
+  frame.sound_timer = emulator.processor.st;
+  frame.writes = static_cast<uint8_t>(writes.size());
+  frame.cycles = std::max<uint32_t>(1, emulator.cycles_per_frame());
+  std::copy(writes.begin(), writes.end(), frame.write.begin());
+  return frames_.Push(frame);
+}
+
+bool Audio::Push(uint8_t sound_timer) {
+  Frame frame;
+  frame.sound_timer = sound_timer;
+  return frames_.Push(frame);
+}
+
+void Audio::Render(int16_t* samples, size_t count) {
+  while (count) {
+    if (sample_ == frame_samples_)
+      NextFrame();
+
+    // Up to where the tone next starts or stops, or the end of the frame
+    uint32_t end = frame_samples_;
+    for (; next_write_ < frame_.writes; ++next_write_) {
+      const auto& write = frame_.write[next_write_];
+      end = Offset(write);
+      if (end > sample_)
+        break;
+      sound_timer_ = write.value;
+      end = frame_samples_;
+    }
+
+    const size_t n = std::min<size_t>(count, end - sample_);
+    if (sound_timer_) {
+      for (size_t i = 0; i < n; ++i) {
+        samples[i] = wavetable_[phase_ >> kPhaseShift];
+        phase_ += step_;
+      }
+    } else {
+      std::fill_n(samples, n, 0);
+      phase_ = 0;
+    }
+
+    samples += n;
+    count -= n;
+    sample_ += static_cast<uint32_t>(n);
+  }
+}
+
+uint64_t Audio::underruns() const {
+  return underruns_.load(std::memory_order_relaxed);
+}
+
+uint64_t Audio::skipped() const {
+  return skipped_.load(std::memory_order_relaxed);
+}
+
+void Audio::NextFrame() {
+  // When the emulator gets ahead of the device, older frames are dropped
+  while (frames_.size() > kMaxAudioLatency) {
+    frames_.Pop(frame_);
+    skipped_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // The timer counts down between frames, and is only written by Fx18 within
+  // a frame, which starts where the previous one left off. When the emulator
+  // falls behind, it goes on counting down as it would have.
+  sound_timer_ = frame_.sound_timer > 0 ? frame_.sound_timer - 1 : 0;
+  if (frames_.Pop(frame_)) {
+    if (!frame_.writes)
+      sound_timer_ = frame_.sound_timer;
+  } else {
+    if (sound_timer_)
+      underruns_.fetch_add(1, std::memory_order_relaxed);
+    frame_ = Frame();
+    frame_.sound_timer = sound_timer_;
+  }
+  next_write_ = 0;
+
+  // Frames alternate between 735 samples and one more or less at rates that
+  // are not a multiple of 60, so that they add up to the rate every second
+  remainder_ += sample_rate_;
+  frame_samples_ = remainder_ / kTimerRate;
+  remainder_ %= kTimerRate;
+  sample_ = 0;
+}
+
+uint32_t Audio::Offset(const SoundWrite& write) const {
+  const uint64_t offset =
+      static_cast<uint64_t>(write.cycle) * frame_samples_ / frame_.cycles;
+  return static_cast<uint32_t>(std::min<uint64_t>(offset, frame_samples_));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+static void Put(std::ofstream& os, T value) {
+  for (size_t i = 0; i < sizeof(T); ++i)
+    os.put(static_cast<char>(value >> (8 * i)));
+}
+
+WavWriter::~WavWriter() {
+  Close();
+}
+
+bool WavWriter::Open(const std::string& path, uint32_t sample_rate) {
+  Close();
+  os_.open(path, std::ios::binary);
+  data_size_ = 0;
+
+  os_.write("RIFF", 4);
+  Put<uint32_t>(os_, 0);  // filled in by Close()
+  os_.write("WAVEfmt ", 8);
+  Put<uint32_t>(os_, 16);
+  Put<uint16_t>(os_, 1);  // PCM
+  Put<uint16_t>(os_, 1);  // mono
+  Put<uint32_t>(os_, sample_rate);
+  Put<uint32_t>(os_, sample_rate * sizeof(int16_t));
+  Put<uint16_t>(os_, sizeof(int16_t));
+  Put<uint16_t>(os_, 16);
+  os_.write("data", 4);
+  Put<uint32_t>(os_, 0);  // filled in by Close()
+
+  return static_cast<bool>(os_);
+}
+
+bool WavWriter::Write(const int16_t* samples, size_t count) {
+  for (size_t i = 0; i < count; ++i)
+    Put(os_, static_cast<uint16_t>(samples[i]));
+  data_size_ += static_cast<uint32_t>(count * sizeof(int16_t));
+  return static_cast<bool>(os_);
+}
+
+bool WavWriter::Close() {
+  if (!os_.is_open())
+    return false;
+
+  os_.seekp(4);
+  Put<uint32_t>(os_, 36 + data_size_);
+  os_.seekp(40);
+  Put<uint32_t>(os_, data_size_);
+  const bool written = static_cast<bool>(os_);
+  os_.close();
+  return written;
+}
+
+}  // namespace chip8
@@ -0,0 +1,113 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#include "chip8.h"
+#include "lockfree.h"
+
+namespace chip8 {
+
+constexpr uint32_t kSampleRate = 44100;
+constexpr uint32_t kTimerRate = 60;  // sound timer ticks per second
+constexpr uint16_t kToneFrequency = 1700;
+constexpr int16_t kToneAmplitude = 8000;
+constexpr size_t kWavetableSize = 256;
+constexpr uint32_t kMaxAudioLatency = 4;  // frames of sound timer values
+
+// Synthesizes the buzzer. The emulation thread pushes the sound timer once per
+// frame, along with the cycles at which Fx18 started or stopped the tone, and
+// the audio thread renders samples from a precomputed wavetable, gating the
+// tone at the sample nearest to each of them.
+class Audio {
+public:
+  explicit Audio(uint32_t sample_rate = kSampleRate,
+                 uint16_t frequency = kToneFrequency,
+                 int16_t amplitude = kToneAmplitude);
+
+  uint32_t sample_rate() const;
+
+  // Must be called once per frame, after the frame has run and before the
+  // timers are counted down. Returns false if the audio thread is not reading.
+  bool Push(const Emulator& emulator);
+  bool Push(uint8_t sound_timer);  // for the whole frame
+
+  // Fills `count` samples. Never allocates, locks or waits, so it can be
+  // called from an audio callback.
+  void Render(int16_t* samples, size_t count);
+
+  // Frames that had to sound before they arrived. Silence is the same
+  // whether the emulator is running or not, so it is never late.
+  uint64_t underruns() const;
+  uint64_t skipped() const;  // frames dropped to keep latency low
+
+private:
+  struct Frame {
+    uint8_t sound_timer = 0;  // at the end of the frame
+    uint8_t writes = 0;
+    uint32_t cycles = 1;  // per frame, to place the writes
+    std::array<SoundWrite, kMaxSoundWrites> write;
+  };
+
+  void NextFrame();
+  uint32_t Offset(const SoundWrite& write) const;  // in samples
+
+  std::array<int16_t, kWavetableSize> wavetable_;
+  SpscQueue<Frame, 64> frames_;
+
+  uint32_t sample_rate_;
+  uint32_t phase_ = 0;  // position in the wavetable, as a 32-bit fraction
+  uint32_t step_;
+  uint32_t remainder_ = 0;      // of samples per frame, carried over
+  uint32_t frame_samples_ = 0;  // in the current frame
+  uint32_t sample_ = 0;         // rendered of the current frame
+  Frame frame_;
+  uint8_t next_write_ = 0;
+  uint8_t sound_timer_ = 0;
+
+  std::atomic<uint64_t> underruns_{0};
+  std::atomic<uint64_t> skipped_{0};
+};
+
+// Writes 16-bit mono samples to a WAV file
+class WavWriter {
+public:
+  ~WavWriter();
+
+  bool Open(const std::string& path, uint32_t sample_rate);
+  bool Write(const int16_t* samples, size_t count);
+  bool Close();  // fills in the sizes in the header
+
+private:
+  std::ofstream os_;
+  uint32_t data_size_ = 0;
+};
+
+}  // namespace chip8
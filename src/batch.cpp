@@ -0,0 +1,722 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <iostream>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#include "batch.h"
+
+namespace chip8 {
+
+namespace {
+
+// A vector of 8-bit lanes. Masks have all bits of a lane set or clear.
+#if defined(__AVX2__)
+struct Vector {
+  static constexpr size_t kWidth = 32;
+  __m256i value;
+
+  static Vector Load(const uint8_t* p) {
+    return {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))};
+  }
+  static Vector Fill(uint8_t b) {
+    return {_mm256_set1_epi8(static_cast<char>(b))};
+  }
+  void Store(uint8_t* p) const {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), value);
+  }
+};
+inline Vector operator+(Vector a, Vector b) {
+  return {_mm256_add_epi8(a.value, b.value)};
+}
+inline Vector operator|(Vector a, Vector b) {
+  return {_mm256_or_si256(a.value, b.value)};
+}
+inline Vector operator&(Vector a, Vector b) {
+  return {_mm256_and_si256(a.value, b.value)};
+}
+inline Vector operator^(Vector a, Vector b) {
+  return {_mm256_xor_si256(a.value, b.value)};
+}
+inline Vector Equal(Vector a, Vector b) {
+  return {_mm256_cmpeq_epi8(a.value, b.value)};
+}
+inline Vector operator-(Vector a, Vector b) {
+  return {_mm256_sub_epi8(a.value, b.value)};
+}
+inline Vector SubtractSaturated(Vector a, Vector b) {  // at zero
+  return {_mm256_subs_epu8(a.value, b.value)};
+}
+inline Vector ShiftRight(Vector a) {  // by one bit
+  return {_mm256_and_si256(_mm256_srli_epi16(a.value, 1),
+                           _mm256_set1_epi8(0x7F))};
+}
+inline Vector Decrement(Vector a) {  // saturates at zero
+  return {_mm256_subs_epu8(a.value, _mm256_set1_epi8(1))};
+}
+inline Vector Select(Vector mask, Vector a, Vector b) {
+  return {_mm256_blendv_epi8(b.value, a.value, mask.value)};
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+struct Vector {
+  static constexpr size_t kWidth = 16;
+  __m128i value;
+
+  static Vector Load(const uint8_t* p) {
+    return {_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))};
+  }
+  static Vector Fill(uint8_t b) {
+    return {_mm_set1_epi8(static_cast<char>(b))};
+  }
+  void Store(uint8_t* p) const {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), value);
+  }
+};
+inline Vector operator+(Vector a, Vector b) {
+  return {_mm_add_epi8(a.value, b.value)};
+}
+inline Vector operator|(Vector a, Vector b) {
+  return {_mm_or_si128(a.value, b.value)};
+}
+inline Vector operator&(Vector a, Vector b) {
+  return {_mm_and_si128(a.value, b.value)};
+}
+inline Vector operator^(Vector a, Vector b) {
+  return {_mm_xor_si128(a.value, b.value)};
+}
+inline Vector Equal(Vector a, Vector b) {
+  return {_mm_cmpeq_epi8(a.value, b.value)};
+}
+inline Vector operator-(Vector a, Vector b) {
+  return {_mm_sub_epi8(a.value, b.value)};
+}
+inline Vector SubtractSaturated(Vector a, Vector b) {
+  return {_mm_subs_epu8(a.value, b.value)};
+}
+inline Vector ShiftRight(Vector a) {
+  return {_mm_and_si128(_mm_srli_epi16(a.value, 1), _mm_set1_epi8(0x7F))};
+}
+inline Vector Decrement(Vector a) {
+  return {_mm_subs_epu8(a.value, _mm_set1_epi8(1))};
+}
+inline Vector Select(Vector mask, Vector a, Vector b) {
+  return {_mm_or_si128(_mm_and_si128(mask.value, a.value),
+                       _mm_andnot_si128(mask.value, b.value))};
+}
+#else
+struct Vector {
+  static constexpr size_t kWidth = 1;
+  uint8_t value;
+
+  static Vector Load(const uint8_t* p) { return {*p}; }
+  static Vector Fill(uint8_t b) { return {b}; }
+  void Store(uint8_t* p) const { *p = value; }
+};
+inline Vector operator+(Vector a, Vector b) {
+  return {static_cast<uint8_t>(a.value + b.value)};
+}
+inline Vector operator|(Vector a, Vector b) {
+  return {static_cast<uint8_t>(a.value | b.value)};
+}
+inline Vector operator&(Vector a, Vector b) {
+  return {static_cast<uint8_t>(a.value & b.value)};
+}
+inline Vector operator^(Vector a, Vector b) {
+  return {static_cast<uint8_t>(a.value ^ b.value)};
+}
+inline Vector Equal(Vector a, Vector b) {
+  return {static_cast<uint8_t>(a.value == b.value ? 0xFF : 0x00)};
+}
+inline Vector operator-(Vector a, Vector b) {
+  return {static_cast<uint8_t>(a.value - b.value)};
+}
+inline Vector SubtractSaturated(Vector a, Vector b) {
+  return {static_cast<uint8_t>(a.value > b.value ? a.value - b.value : 0)};
+}
+inline Vector ShiftRight(Vector a) {
+  return {static_cast<uint8_t>(a.value >> 1)};
+}
+inline Vector Decrement(Vector a) {
+  return {static_cast<uint8_t>(a.value ? a.value - 1 : 0)};
+}
+inline Vector Select(Vector mask, Vector a, Vector b) {
+  return {static_cast<uint8_t>((mask.value & a.value) |
+                               (~mask.value & b.value))};
+}
+#endif
+
+constexpr size_t kMaxVectorWidth = 32;
+
+// 1 in lanes where a > b, unsigned, and 0 elsewhere
+inline Vector Greater(Vector a, Vector b) {
+  const auto zero = Vector::Fill(0);
+  return (Equal(SubtractSaturated(a, b), zero) ^ Vector::Fill(0xFF)) &
+         Vector::Fill(1);
+}
+
+// Replaces `row` with `operation(row, lane)` where `mask` is set
+template <typename Operation>
+void Apply(uint8_t* row, const uint8_t* mask, size_t stride,
+           Operation operation) {
+  for (size_t lane = 0; lane < stride; lane += Vector::kWidth) {
+    const auto value = Vector::Load(row + lane);
+    const auto result = operation(value, lane);
+    Select(Vector::Load(mask + lane), result, value).Store(row + lane);
+  }
+}
+
+// Whether the first `count` values are all equal. Without an early exit, so
+// that the loop is vectorized.
+inline bool Same(const uint16_t* values, size_t count) {
+  uint16_t difference = 0;
+  for (size_t j = 1; j < count; ++j)
+    difference |= values[j] ^ values[0];
+  return !difference;
+}
+
+// Writes `value` to the vector at `row` where `mask` is set
+inline void Store(uint8_t* row, Vector mask, Vector value) {
+  Select(mask, value, Vector::Load(row)).Store(row);
+}
+
+}  // namespace
+
+Batch::Batch(size_t lanes)
+    : lanes_(std::max<size_t>(1, lanes)),
+      stride_((lanes_ + kMaxVectorWidth - 1) / kMaxVectorWidth *
+              kMaxVectorWidth) {
+  v_.resize(16 * stride_);
+  i_.resize(stride_);
+  pc_.resize(stride_);
+  sp_.resize(stride_);
+  stack_.resize(16 * stride_);
+  dt_.resize(stride_);
+  st_.resize(stride_);
+  input_.resize(stride_);
+  seed_.resize(lanes_, kDefaultSeed);
+  random_.resize(lanes_);
+
+  memory_.resize(lanes_);
+  private_.resize(lanes_);
+  display_.resize(lanes_);
+
+  code_.resize(stride_);
+  mask_.resize(stride_);
+  done_.resize(stride_);
+  condition_.resize(stride_);
+
+  active_.resize(stride_);
+  std::fill(active_.begin(), active_.begin() + lanes_, 0xFF);
+
+  Reset();
+}
+
+void Batch::Reset() {
+  std::fill(v_.begin(), v_.end(), 0);
+  std::fill(i_.begin(), i_.end(), 0);
+  std::fill(pc_.begin(), pc_.end(), kProgramOffset);
+  std::fill(sp_.begin(), sp_.end(), 0);
+  std::fill(stack_.begin(), stack_.end(), 0);
+  std::fill(dt_.begin(), dt_.end(), 0);
+  std::fill(st_.begin(), st_.end(), 0);
+  std::fill(input_.begin(), input_.end(), 0);
+  for (size_t lane = 0; lane < lanes_; ++lane) {
+    random_[lane].Seed(seed_[lane]);
+  }
+
+  shared_memory_.fill(0);
+  std::copy(kFont.begin(), kFont.end(), shared_memory_.begin());
+  std::copy(kBigFont.begin(), kBigFont.end(),
+            shared_memory_.begin() + kBigFontOffset);
+  std::fill(private_.begin(), private_.end(), 0);
+  private_count_ = 0;
+  for (auto& display : display_) {
+    display.fill(0);
+  }
+  synchronized_ = false;
+}
+
+bool Batch::Load(const std::vector<uint8_t>& program) {
+  if (program.size() > kMemorySize - kProgramOffset)
+    return false;
+
+  std::copy(program.begin(), program.end(),
+            shared_memory_.begin() + kProgramOffset);
+  for (size_t lane = 0; lane < lanes_; ++lane) {
+    if (private_[lane]) {
+      std::copy(program.begin(), program.end(),
+                memory_[lane]->begin() + kProgramOffset);
+    }
+  }
+
+  synchronized_ = false;
+  return true;
+}
+
+void Batch::Cycle() {
+  if (lockstep_ && !synchronized_) {
+    for (size_t lane = 0; lane < lanes_; ++lane) {
+      Synchronize(lane);
+    }
+    synchronized_ = true;
+  }
+
+  Dispatch();
+
+  if (lockstep_)
+    Verify();
+}
+
+void Batch::Dispatch() {
+  const uint16_t* pc = pc_.data();
+  const bool same_pc = Same(pc, lanes_);
+
+  // In the common case all lanes share their memory and program counter, and
+  // the instruction is fetched only once
+  if (same_pc && !private_count_) {
+    const uint16_t address = *pc & kAddressMask;
+    const uint16_t code = shared_memory_[address] << 8 |
+                          shared_memory_[(address + 1) & kAddressMask];
+    for (size_t lane = 0; lane < stride_; ++lane) {
+      pc_[lane] += 2;
+    }
+    Execute(Decode(code, Extension::kNone), active_.data());
+    return;
+  }
+
+  for (size_t lane = 0; lane < lanes_; ++lane) {
+    const auto& memory = this->memory(lane);
+    const uint16_t address = pc_[lane] & kAddressMask;
+    code_[lane] = memory[address] << 8 | memory[(address + 1) & kAddressMask];
+  }
+  for (size_t lane = 0; lane < stride_; ++lane) {
+    pc_[lane] += 2;
+  }
+
+  if (Same(code_.data(), lanes_)) {
+    Execute(Decode(code_[0], Extension::kNone), active_.data());
+    return;
+  }
+
+  // Otherwise each distinct instruction is executed once, for the group of
+  // lanes that share it
+  std::fill(done_.begin(), done_.end(), 0);
+  for (size_t first = 0; first < lanes_; ++first) {
+    if (done_[first])
+      continue;
+
+    const uint16_t code = code_[first];
+    for (size_t lane = 0; lane < stride_; ++lane) {
+      mask_[lane] = lane < lanes_ && !done_[lane] && code_[lane] == code ?
+                    0xFF : 0x00;
+      done_[lane] |= mask_[lane];
+    }
+
+    Execute(Decode(code, Extension::kNone), mask_.data());
+  }
+}
+
+void Batch::RunCycles(uint32_t cycles) {
+  for (uint32_t cycle = 0; cycle < cycles; ++cycle) {
+    Cycle();
+  }
+}
+
+void Batch::UpdateTimers() {
+  for (size_t lane = 0; lane < stride_; lane += Vector::kWidth) {
+    Decrement(Vector::Load(&dt_[lane])).Store(&dt_[lane]);
+    Decrement(Vector::Load(&st_[lane])).Store(&st_[lane]);
+  }
+
+  if (lockstep_ && synchronized_) {
+    for (const auto& reference : references_) {
+      reference->UpdateTimers();
+    }
+  }
+}
+
+void Batch::SetKey(size_t lane, uint8_t key, bool pressed) {
+  if (lane >= lanes_ || key >= 16)
+    return;
+  if (pressed) {
+    input_[lane] |= 1 << key;
+  } else {
+    input_[lane] &= ~(1 << key);
+  }
+
+  if (lockstep_ && synchronized_)
+    references_[lane]->SetKey(key, pressed);
+}
+
+void Batch::Seed(uint64_t seed) {
+  for (size_t lane = 0; lane < lanes_; ++lane) {
+    Seed(lane, seed);
+  }
+}
+
+void Batch::Seed(size_t lane, uint64_t seed) {
+  if (lane >= lanes_)
+    return;
+  seed_[lane] = seed;
+  random_[lane].Seed(seed);
+  synchronized_ = false;
+}
+
+size_t Batch::lanes() const {
+  return lanes_;
+}
+
+const display_t& Batch::display(size_t lane) const {
+  return display_[lane];
+}
+
+const memory_t& Batch::memory(size_t lane) const {
+  return private_[lane] ? *memory_[lane] : shared_memory_;
+}
+
+Processor Batch::processor(size_t lane) const {
+  Processor processor;
+  for (uint8_t x = 0; x < 16; ++x) {
+    processor.v[x] = v_[x * stride_ + lane];
+    processor.stack[x] = stack_[x * stride_ + lane];
+  }
+  processor.i = i_[lane];
+  processor.pc = pc_[lane];
+  processor.sp = sp_[lane];
+  processor.dt = dt_[lane];
+  processor.st = st_[lane];
+  return processor;
+}
+
+void Batch::set_lockstep(bool enabled) {
+  lockstep_ = enabled;
+  synchronized_ = false;
+  if (lockstep_ && references_.empty()) {
+    for (size_t lane = 0; lane < lanes_; ++lane) {
+      references_.emplace_back(new Emulator(Executor::kInterpreter));
+    }
+    state_.reset(new State);
+  }
+}
+
+size_t Batch::divergences() const {
+  return divergences_;
+}
+
+void Batch::Synchronize(size_t lane) {
+  auto& state = *state_;
+  state.cycles = 0;
+  state.seed = seed_[lane];
+  state.random = random_[lane].state();
+  state.instruction = 0x0000;
+  state.program_size = 0;
+  state.display = display_[lane];
+  for (uint8_t key = 0; key < 16; ++key) {
+    state.input[key] = (input_[lane] >> key) & 1;
+  }
+  state.processor = processor(lane);
+  state.hires = false;
+  state.planes = 1;
+  state.rpl.fill(0);
+  state.memory_end = kMemorySize;
+  state.memory = memory(lane);
+  references_[lane]->LoadState(state);
+}
+
+void Batch::Verify() {
+  for (size_t lane = 0; lane < lanes_; ++lane) {
+    auto& reference = *references_[lane];
+    const uint16_t address = reference.processor.pc;
+    reference.Cycle();
+
+    const auto a = processor(lane);
+    const auto& b = reference.processor;
+    if (a.v == b.v && a.i == b.i && a.pc == b.pc && a.sp == b.sp &&
+        a.stack == b.stack && a.dt == b.dt && a.st == b.st &&
+        std::equal(reference.memory.begin(), reference.memory.end(),
+                   memory(lane).begin(), memory(lane).end()) &&
+        display_[lane] == reference.display) {
+      continue;
+    }
+
+    ++divergences_;
+    std::cout << "Lane " << lane << " diverged from the interpreter at 0x"
+              << std::hex << address << std::dec << "\n";
+    Synchronize(lane);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Batch::Execute(const Instruction& instruction, const uint8_t* mask) {
+  const auto vx = row(instruction.x);
+  const auto vy = row(instruction.y);
+  const auto kk = Vector::Fill(instruction.kk);
+
+  // Skips first compute a per-lane condition, which then moves the 16-bit
+  // program counters
+  auto skip = [&](bool equal, const uint8_t* other) {
+    for (size_t lane = 0; lane < stride_; lane += Vector::kWidth) {
+      const auto rhs = other ? Vector::Load(other + lane) : kk;
+      auto condition = Equal(Vector::Load(vx + lane), rhs);
+      if (!equal)
+        condition = condition ^ Vector::Fill(0xFF);
+      (condition & Vector::Load(mask + lane)).Store(&condition_[lane]);
+    }
+    for (size_t lane = 0; lane < stride_; ++lane) {
+      pc_[lane] += condition_[lane] & 2;
+    }
+  };
+
+  // Arithmetic that sets VF writes the rows in the same order as the
+  // handlers, so that x or y may be F
+  const auto vf = row(0xF);
+  auto each = [&](auto operation) {
+    for (size_t lane = 0; lane < stride_; lane += Vector::kWidth)
+      operation(Vector::Load(mask + lane), lane);
+  };
+
+  switch (instruction.op) {
+    case Opcode::k1nnn:  // JP addr
+      for (size_t lane = 0; lane < stride_; ++lane) {
+        if (mask[lane])
+          pc_[lane] = instruction.nnn;
+      }
+      return;
+    case Opcode::k3xkk:  // SE Vx, byte
+      return skip(true, nullptr);
+    case Opcode::k4xkk:  // SNE Vx, byte
+      return skip(false, nullptr);
+    case Opcode::k5xy0:  // SE Vx, Vy
+      return skip(true, vy);
+    case Opcode::k9xy0:  // SNE Vx, Vy
+      return skip(false, vy);
+    case Opcode::k6xkk:  // LD Vx, byte
+      return Apply(vx, mask, stride_,
+                   [&](Vector, size_t) { return kk; });
+    case Opcode::k7xkk:  // ADD Vx, byte
+      return Apply(vx, mask, stride_,
+                   [&](Vector value, size_t) { return value + kk; });
+    case Opcode::k8xy0:  // LD Vx, Vy
+      return Apply(vx, mask, stride_, [&](Vector, size_t lane) {
+        return Vector::Load(vy + lane);
+      });
+    case Opcode::k8xy1:  // OR Vx, Vy
+      return Apply(vx, mask, stride_, [&](Vector value, size_t lane) {
+        return value | Vector::Load(vy + lane);
+      });
+    case Opcode::k8xy2:  // AND Vx, Vy
+      return Apply(vx, mask, stride_, [&](Vector value, size_t lane) {
+        return value & Vector::Load(vy + lane);
+      });
+    case Opcode::k8xy3:  // XOR Vx, Vy
+      return Apply(vx, mask, stride_, [&](Vector value, size_t lane) {
+        return value ^ Vector::Load(vy + lane);
+      });
+    case Opcode::k8xy4:  // ADD Vx, Vy
+      return each([&](Vector active, size_t lane) {
+        const auto a = Vector::Load(vx + lane);
+        const auto b = Vector::Load(vy + lane);
+        const auto carry = Greater(b, a ^ Vector::Fill(0xFF));
+        Store(vx + lane, active, a + b);
+        Store(vf + lane, active, carry);
+      });
+    case Opcode::k8xy5:  // SUB Vx, Vy
+      return each([&](Vector active, size_t lane) {
+        const auto a = Vector::Load(vx + lane);
+        const auto b = Vector::Load(vy + lane);
+        Store(vx + lane, active, a - b);
+        Store(vf + lane, active, Greater(a, b));
+      });
+    case Opcode::k8xy6:  // SHR Vx {, Vy}
+      return each([&](Vector active, size_t lane) {
+        const auto value = Vector::Load(vx + lane);
+        Store(vx + lane, active, ShiftRight(value));
+        Store(vf + lane, active, value & Vector::Fill(1));
+      });
+    case Opcode::k8xy7:  // SUBN Vx, Vy
+      return each([&](Vector active, size_t lane) {
+        const auto a = Vector::Load(vx + lane);
+        const auto b = Vector::Load(vy + lane);
+        Store(vx + lane, active, b - a);
+        Store(vf + lane, active, Greater(b, a));
+      });
+    case Opcode::k8xyE:  // SHL Vx {, Vy}
+      return each([&](Vector active, size_t lane) {
+        const auto value = Vector::Load(vx + lane);
+        Store(vx + lane, active, value + value);
+        Store(vf + lane, active, Greater(value, Vector::Fill(0x7F)));
+      });
+    case Opcode::kAnnn:  // LD I, addr
+      for (size_t lane = 0; lane < stride_; ++lane) {
+        if (mask[lane])
+          i_[lane] = instruction.nnn;
+      }
+      return;
+    case Opcode::kCxkk:  // RND Vx, byte
+      for (size_t lane = 0; lane < lanes_; ++lane) {
+        if (mask[lane]) {
+          vx[lane] = static_cast<uint8_t>(random_[lane].Next() >> 24) &
+                     instruction.kk;
+        }
+      }
+      return;
+    case Opcode::kFx07:  // LD Vx, DT
+      return Apply(vx, mask, stride_, [&](Vector, size_t lane) {
+        return Vector::Load(&dt_[lane]);
+      });
+    case Opcode::kFx15:  // LD DT, Vx
+      return Apply(dt_.data(), mask, stride_, [&](Vector, size_t lane) {
+        return Vector::Load(vx + lane);
+      });
+    case Opcode::kFx18:  // LD ST, Vx
+      return Apply(st_.data(), mask, stride_, [&](Vector, size_t lane) {
+        return Vector::Load(vx + lane);
+      });
+    default:
+      for (size_t lane = 0; lane < lanes_; ++lane) {
+        if (mask[lane])
+          Step(lane, instruction);
+      }
+      return;
+  }
+}
+
+// Mirrors the handlers of Emulator for a single lane
+void Batch::Step(size_t lane, const Instruction& instruction) {
+  const auto& memory = this->memory(lane);
+  auto& display = display_[lane];
+  auto& pc = pc_[lane];
+  auto& i = i_[lane];
+  auto& sp = sp_[lane];
+  auto& vx = v(instruction.x, lane);
+  auto& vy = v(instruction.y, lane);
+  auto& vf = v(0xF, lane);
+
+  switch (instruction.op) {
+    case Opcode::k00E0:  // CLS
+      display.fill(0);
+      break;
+    case Opcode::k00EE:  // RET
+      if (sp > 0)
+        pc = stack_[--sp * stride_ + lane];
+      break;
+    case Opcode::k2nnn:  // CALL addr
+      if (sp < 16) {
+        stack_[sp++ * stride_ + lane] = pc;
+        pc = instruction.nnn;
+      }
+      break;
+    case Opcode::kBnnn:  // JP V0, addr
+      pc = instruction.nnn + v(0, lane);
+      break;
+    case Opcode::kDxyn: {  // DRW Vx, Vy, nibble
+      const uint8_t x = vx % kDisplayWidth;
+      const uint8_t y = vy % kDisplayHeight;
+      uint64_t collision = 0;
+      for (uint8_t row = 0; row < instruction.n; ++row) {
+        const uint64_t sprite =
+            static_cast<uint64_t>(memory[(i + row) & kAddressMask]) << 56;
+        const uint64_t bits = (sprite >> x) | (sprite << ((64 - x) & 63));
+        auto& line = display[(y + row) % kDisplayHeight];
+        collision |= line & bits;
+        line ^= bits;
+      }
+      vf = collision ? 1 : 0;
+      break;
+    }
+    case Opcode::kEx9E:  // SKP Vx
+      if (vx < 16 && (input_[lane] >> vx) & 1)
+        pc += 2;
+      break;
+    case Opcode::kExA1:  // SKNP Vx
+      if (vx >= 16 || !((input_[lane] >> vx) & 1))
+        pc += 2;
+      break;
+    case Opcode::kFx0A: {  // LD Vx, K
+      uint8_t key = 0;
+      while (key < 16 && !((input_[lane] >> key) & 1))
+        ++key;
+      if (key < 16) {
+        vx = key;
+      } else {
+        pc -= 2;
+      }
+      break;
+    }
+    case Opcode::kFx1E:  // ADD I, Vx
+      i += vx;
+      break;
+    case Opcode::kFx29:  // LD F, Vx
+      i = vx * kDefaultSpriteHeight;
+      break;
+    case Opcode::kFx33: {  // LD B, Vx
+      const uint8_t value = vx;
+      auto& memory = writable_memory(lane);
+      memory[(i + 0) & kAddressMask] = value / 100;
+      memory[(i + 1) & kAddressMask] = (value / 10) % 10;
+      memory[(i + 2) & kAddressMask] = value % 10;
+      break;
+    }
+    case Opcode::kFx55: {  // LD [I], Vx
+      auto& memory = writable_memory(lane);
+      for (uint8_t j = 0; j <= instruction.x; ++j) {
+        memory[(i + j) & kAddressMask] = v(j, lane);
+      }
+      break;
+    }
+    case Opcode::kFx65:  // LD Vx, [I]
+      for (uint8_t j = 0; j <= instruction.x; ++j) {
+        v(j, lane) = memory[(i + j) & kAddressMask];
+      }
+      break;
+    default:  // unknown instructions do nothing
+      break;
+  }
+}
+
+memory_t& Batch::writable_memory(size_t lane) {
+  if (!private_[lane]) {
+    if (!memory_[lane])
+      memory_[lane].reset(new memory_t);
+    *memory_[lane] = shared_memory_;
+    private_[lane] = 1;
+    ++private_count_;
+  }
+  return *memory_[lane];
+}
+
+uint8_t& Batch::v(uint8_t x, size_t lane) {
+  return v_[x * stride_ + lane];
+}
+
+uint8_t* Batch::row(uint8_t x) {
+  return &v_[x * stride_];
+}
+
+}  // namespace chip8
@@ -0,0 +1,122 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "chip8.h"
+
+namespace chip8 {
+
+// Steps many copies of the same program in lockstep. Registers and timers are
+// stored as structure-of-arrays, one row per register with one byte per lane,
+// so that an instruction shared by a group of lanes runs as a few vector
+// operations (AVX2 or SSE2 where available). Lanes whose program counters
+// diverge are grouped by instruction and masked. The display is kept per lane,
+// and memory is shared between lanes until a lane writes to it. Lanes follow
+// QuirkProfile::kChip8, so the SUPER-CHIP and XO-CHIP instructions are
+// unknown and Dxy0 draws nothing.
+class Batch {
+public:
+  explicit Batch(size_t lanes);  // at least one
+
+  void Reset();
+  bool Load(const std::vector<uint8_t>& program);
+
+  // Same semantics as Emulator::Cycle() and Emulator::UpdateTimers() with
+  // QuirkProfile::kChip8, for every lane at once, except that unknown
+  // instructions and stack faults do not stop a lane
+  void Cycle();
+  void RunCycles(uint32_t cycles);
+  void UpdateTimers();
+
+  void SetKey(size_t lane, uint8_t key, bool pressed);
+
+  // As with Emulator, RND is reseeded by Reset()
+  void Seed(uint64_t seed);
+  void Seed(size_t lane, uint64_t seed);
+
+  size_t lanes() const;
+  const display_t& display(size_t lane) const;
+  const memory_t& memory(size_t lane) const;
+  Processor processor(size_t lane) const;
+
+  // Lockstep mode runs a reference interpreter for every lane and compares
+  // the machines after every cycle. Lanes that diverge are resynchronized.
+  void set_lockstep(bool enabled);
+  size_t divergences() const;
+
+private:
+  void Dispatch();  // fetches and executes the next instruction of each lane
+  // For the lanes set in `mask`, one byte per lane
+  void Execute(const Instruction& instruction, const uint8_t* mask);
+  void Step(size_t lane, const Instruction& instruction);
+
+  memory_t& writable_memory(size_t lane);
+  uint8_t& v(uint8_t x, size_t lane);
+  uint8_t* row(uint8_t x);
+
+  void Synchronize(size_t lane);
+  void Verify();
+
+  size_t lanes_;
+  size_t stride_;  // lanes rounded up to the widest vector
+
+  std::vector<uint8_t> v_;       // 16 rows
+  std::vector<uint16_t> i_;
+  std::vector<uint16_t> pc_;
+  std::vector<uint8_t> sp_;
+  std::vector<uint16_t> stack_;  // 16 rows
+  std::vector<uint8_t> dt_;
+  std::vector<uint8_t> st_;
+  std::vector<uint16_t> input_;  // one bit per key
+  std::vector<uint64_t> seed_;
+  std::vector<Random> random_;
+
+  memory_t shared_memory_;
+  // Private copies, allocated on the first write
+  std::vector<std::unique_ptr<memory_t>> memory_;
+  std::vector<uint8_t> private_;    // whether a lane has its private copy
+  size_t private_count_ = 0;
+  std::vector<display_t> display_;
+
+  std::vector<uint8_t> active_;  // mask of lanes that are not padding
+
+  // Scratch rows for a single cycle
+  std::vector<uint16_t> code_;
+  std::vector<uint8_t> mask_;
+  std::vector<uint8_t> done_;
+  std::vector<uint8_t> condition_;
+
+  bool lockstep_ = false;
+  bool synchronized_ = false;  // cleared by anything that is not mirrored
+  size_t divergences_ = 0;
+  std::vector<std::unique_ptr<Emulator>> references_;
+  std::unique_ptr<State> state_;  // to load the references from
+};
+
+}  // namespace chip8
@@ -0,0 +1,395 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Microbenchmarks for the hot paths of the core, using synthetic programs
+// that each stress one kind of instruction.
+//
+// Usage: bench [options]
+//   --samples=N   timed samples per benchmark (default 15)
+//   --cycles=N    instructions per sample (default 2000000)
+//   --filter=S    only run benchmarks whose name contains S
+//   --csv=PATH    also write the results as CSV
+//   --json=PATH   also write the results as JSON
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch.h"
+#include "chip8.h"
+#include "runner.h"
+
+namespace {
+
+// Keeps results that are otherwise unused from being optimized away
+volatile uint32_t sink = 0;
+
+struct Program {
+  const char* name;
+  std::vector<uint8_t> code;
+};
+
+// Each one loops forever, without waiting for keys or faulting
+const std::vector<Program> kPrograms = {
+  {"alu", {  // 7xkk and 8xy4
+    0x70, 0x01, 0x71, 0x03, 0x80, 0x14, 0x72, 0x05,
+    0x81, 0x24, 0x73, 0x07, 0x82, 0x34, 0x83, 0x04,
+    0x70, 0x11, 0x80, 0x14, 0x81, 0x24, 0x82, 0x34,
+    0x12, 0x00,
+  }},
+  {"branch", {  // 3xkk and 1nnn
+    0x70, 0x01, 0x30, 0x80, 0x12, 0x08, 0x60, 0x00,
+    0x31, 0x00, 0x12, 0x0E, 0x12, 0x00, 0x71, 0x01,
+    0x12, 0x00,
+  }},
+  {"sprite", {  // Dxyn
+    0xA0, 0x00, 0xD0, 0x15, 0xD1, 0x25, 0xD2, 0x05,
+    0x70, 0x05, 0x71, 0x03, 0x72, 0x07, 0xA0, 0x0A,
+    0xD0, 0x1F, 0x12, 0x02,
+  }},
+  {"memory", {  // Fx33, Fx55 and Fx65
+    0xA3, 0x00, 0xF0, 0x33, 0xF7, 0x55, 0xF7, 0x65,
+    0x70, 0x01, 0xF0, 0x33, 0xFF, 0x55, 0xFF, 0x65,
+    0x12, 0x02,
+  }},
+  {"random", {  // Cxkk
+    0xC0, 0xFF, 0xC1, 0x0F, 0xC2, 0xFF, 0xC3, 0x3C,
+    0xC4, 0xFF, 0xC5, 0x01, 0xC6, 0xFF, 0xC7, 0x80,
+    0x12, 0x00,
+  }},
+};
+
+struct Result {
+  std::string name;
+  std::string unit;  // what a single operation is
+  std::vector<double> samples;  // nanoseconds per operation
+  double median = 0.0;
+  double mean = 0.0;
+  double deviation = 0.0;  // standard deviation
+  double min = 0.0;
+  double max = 0.0;
+};
+
+struct Options {
+  size_t samples = 15;
+  uint32_t cycles = 2000000;
+  std::string filter;
+  std::string csv;
+  std::string json;
+};
+
+// Runs `body` once untimed, then times it `samples` times. `body` returns
+// the number of operations it performed.
+Result Measure(const std::string& name, const std::string& unit,
+               size_t samples, const std::function<uint64_t()>& body) {
+  Result result;
+  result.name = name;
+  result.unit = unit;
+
+  body();
+
+  for (size_t i = 0; i < samples; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto operations = body();
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    result.samples.push_back(elapsed.count() / std::max<uint64_t>(1, operations));
+  }
+
+  auto sorted = result.samples;
+  std::sort(sorted.begin(), sorted.end());
+  const size_t n = sorted.size();
+  result.median = n % 2 ? sorted[n / 2]
+                        : (sorted[n / 2 - 1] + sorted[n / 2]) / 2.0;
+  result.min = sorted.front();
+  result.max = sorted.back();
+  for (const auto sample : sorted)
+    result.mean += sample / n;
+  for (const auto sample : sorted)
+    result.deviation += (sample - result.mean) * (sample - result.mean) / n;
+  result.deviation = std::sqrt(result.deviation);
+
+  return result;
+}
+
+std::vector<Result> RunBenchmarks(const Options& options) {
+  std::vector<Result> results;
+  auto enabled = [&](const std::string& name) {
+    return name.find(options.filter) != std::string::npos;
+  };
+
+  static const std::pair<const char*, chip8::Executor> executors[] = {
+    {"interpreter", chip8::Executor::kInterpreter},
+    {"threaded", chip8::Executor::kThreaded},
+    {"jit", chip8::Executor::kJit},
+  };
+
+  for (const auto& program : kPrograms) {
+    for (const auto& executor : executors) {
+      const std::string name =
+          std::string(program.name) + "/" + executor.first;
+      if (!enabled(name))
+        continue;
+
+      chip8::Emulator emulator(executor.second);
+      emulator.Reset();
+      emulator.Load(program.code);
+      results.push_back(Measure(name, "instruction", options.samples, [&]() {
+        const auto cycles = emulator.cycles();
+        emulator.RunCycles(options.cycles);
+        return emulator.cycles() - cycles;
+      }));
+    }
+  }
+
+  // Batch against as many emulators, each lane seeded differently so that
+  // RND makes them diverge. Both are timed per lane instruction.
+  constexpr size_t kLanes = 64;
+  const uint32_t lane_cycles = std::max<uint32_t>(1, options.cycles / kLanes);
+  for (const auto& program : kPrograms) {
+    const std::string suffix = "/" + std::to_string(kLanes);
+    const std::string batch_name = std::string(program.name) + "/batch" +
+                                   suffix;
+    if (enabled(batch_name)) {
+      chip8::Batch batch(kLanes);
+      for (size_t lane = 0; lane < kLanes; ++lane)
+        batch.Seed(lane, lane);
+      batch.Reset();
+      batch.Load(program.code);
+      results.push_back(Measure(batch_name, "instruction", options.samples,
+                                [&]() {
+        batch.RunCycles(lane_cycles);
+        return uint64_t{lane_cycles} * kLanes;
+      }));
+    }
+
+    const std::string scalar_name = std::string(program.name) +
+                                    "/threaded" + suffix;
+    if (enabled(scalar_name)) {
+      std::vector<std::unique_ptr<chip8::Emulator>> emulators;
+      for (size_t lane = 0; lane < kLanes; ++lane) {
+        emulators.emplace_back(
+            new chip8::Emulator(chip8::Executor::kThreaded));
+        emulators.back()->Seed(lane);
+        emulators.back()->Reset();
+        emulators.back()->Load(program.code);
+      }
+      results.push_back(Measure(scalar_name, "instruction", options.samples,
+                                [&]() {
+        uint64_t cycles = 0;
+        for (auto& emulator : emulators) {
+          const auto start = emulator->cycles();
+          emulator->RunCycles(lane_cycles);
+          cycles += emulator->cycles() - start;
+        }
+        return cycles;
+      }));
+    }
+  }
+
+  // The same jobs on more threads, which should scale with the cores. Every
+  // program is run as several jobs, so that there is work to steal.
+  std::vector<size_t> thread_counts = {1, 2, 4};
+  const size_t hardware = std::thread::hardware_concurrency();
+  if (hardware > thread_counts.back())
+    thread_counts.push_back(hardware);
+  for (const auto threads : thread_counts) {
+    const std::string name = "runner/" + std::to_string(threads);
+    if (!enabled(name))
+      continue;
+
+    constexpr size_t kJobsPerProgram = 16;
+    std::vector<chip8::Job> jobs;
+    for (size_t j = 0; j < kJobsPerProgram; ++j) {
+      for (const auto& program : kPrograms) {
+        chip8::Job job;
+        job.program = program.code;
+        job.cycles = options.cycles / (kJobsPerProgram * kPrograms.size());
+        jobs.push_back(job);
+      }
+    }
+    chip8::Runner runner(threads);
+    std::vector<chip8::Result> outcomes;
+    results.push_back(Measure(name, "instruction", options.samples, [&]() {
+      return runner.Run(jobs, outcomes).cycles;
+    }));
+  }
+
+  // Calls are batched so that timer overhead does not dominate
+  constexpr uint64_t kCalls = 10000;
+  const auto& program = kPrograms.front().code;
+
+  if (enabled("reset")) {
+    chip8::Emulator emulator;
+    results.push_back(Measure("reset", "call", options.samples, [&]() {
+      for (uint64_t i = 0; i < kCalls; ++i) {
+        emulator.Reset();
+        emulator.Load(program);
+      }
+      return kCalls;
+    }));
+  }
+
+  if (enabled("restart")) {
+    chip8::Emulator emulator;
+    emulator.Reset();
+    emulator.Load(program);
+    results.push_back(Measure("restart", "call", options.samples, [&]() {
+      for (uint64_t i = 0; i < kCalls; ++i)
+        emulator.Restart();
+      return kCalls;
+    }));
+  }
+
+  if (enabled("state")) {
+    chip8::Emulator emulator(chip8::Executor::kThreaded);
+    emulator.Reset();
+    emulator.Load(kPrograms[2].code);
+    std::unique_ptr<chip8::State> state(new chip8::State);
+    results.push_back(Measure("state", "save and load", options.samples,
+                              [&]() {
+      for (uint64_t i = 0; i < kCalls; ++i) {
+        emulator.SaveState(*state);
+        emulator.RunCycles(8);
+        emulator.LoadState(*state);
+      }
+      return kCalls;
+    }));
+  }
+
+  // Converts the display to 32-bit pixels the way the frontend does, one row
+  // at a time
+  if (enabled("export")) {
+    chip8::Emulator emulator(chip8::Executor::kThreaded);
+    emulator.Reset();
+    emulator.Load(kPrograms[2].code);
+    emulator.RunCycles(1000);
+    std::vector<uint32_t> pixels(chip8::kDisplayWidth * chip8::kDisplayHeight);
+    results.push_back(Measure("export", "frame", options.samples, [&]() {
+      for (uint64_t i = 0; i < kCalls; ++i) {
+        auto line = pixels.data();
+        for (uint8_t y = 0; y < chip8::kDisplayHeight; ++y) {
+          const auto row = emulator.GetRow(y);
+          for (uint8_t x = 0; x < chip8::kDisplayWidth; ++x) {
+            const bool pixel = (row >> (chip8::kDisplayWidth - 1 - x)) & 1;
+            line[x] = pixel ? 0xFFFFFFFF : 0xFF000000;
+          }
+          line += chip8::kDisplayWidth;
+        }
+        emulator.ClearDirtyRows();
+      }
+      sink = pixels[pixels.size() / 2];
+      return kCalls;
+    }));
+  }
+
+  return results;
+}
+
+void WriteCsv(const std::string& path, const std::vector<Result>& results) {
+  std::ofstream os(path);
+  os << "name,unit,median_ns,mean_ns,stddev_ns,min_ns,max_ns,mops,samples\n";
+  for (const auto& r : results) {
+    os << r.name << ',' << r.unit << ',' << r.median << ',' << r.mean << ','
+       << r.deviation << ',' << r.min << ',' << r.max << ','
+       << 1000.0 / r.median << ',' << r.samples.size() << '\n';
+  }
+}
+
+void WriteJson(const std::string& path, const std::vector<Result>& results) {
+  std::ofstream os(path);
+  os << "[\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& r = results[i];
+    os << "  {\"name\": \"" << r.name << "\", \"unit\": \"" << r.unit
+       << "\", \"median_ns\": " << r.median << ", \"mean_ns\": " << r.mean
+       << ", \"stddev_ns\": " << r.deviation << ", \"min_ns\": " << r.min
+       << ", \"max_ns\": " << r.max << ", \"mops\": " << 1000.0 / r.median
+       << ", \"samples\": " << r.samples.size() << "}"
+       << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  os << "]\n";
+}
+
+bool GetOption(const std::string& arg, const std::string& name,
+               std::string& value) {
+  const std::string prefix = "--" + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  value = arg.substr(prefix.size());
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char const *argv[]) {
+  Options options;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    std::string value;
+    if (GetOption(arg, "samples", value)) {
+      options.samples = std::max(1ul, std::strtoul(value.c_str(), nullptr, 10));
+    } else if (GetOption(arg, "cycles", value)) {
+      options.cycles = std::strtoul(value.c_str(), nullptr, 10);
+    } else if (GetOption(arg, "filter", value)) {
+      options.filter = value;
+    } else if (GetOption(arg, "csv", value)) {
+      options.csv = value;
+    } else if (GetOption(arg, "json", value)) {
+      options.json = value;
+    } else {
+      std::cerr << "Unknown option: " << arg << "\n";
+      return 1;
+    }
+  }
+
+  const auto results = RunBenchmarks(options);
+
+  std::cout << std::left << std::setw(22) << "benchmark" << std::right
+            << std::setw(12) << "median ns" << std::setw(10) << "stddev"
+            << std::setw(12) << "Mops/s" << "  unit\n"
+            << std::fixed << std::setprecision(2);
+  for (const auto& r : results) {
+    std::cout << std::left << std::setw(22) << r.name << std::right
+              << std::setw(12) << r.median << std::setw(10) << r.deviation
+              << std::setw(12) << 1000.0 / r.median << "  " << r.unit << "\n";
+  }
+
+  if (!options.csv.empty())
+    WriteCsv(options.csv, results);
+  if (!options.json.empty())
+    WriteJson(options.json, results);
+
+  return 0;
+}
@@ -23,70 +23,415 @@ SOFTWARE.
 */
 
 #include <algorithm>
-#include <functional>
-#include <iostream>
-#include <random>
-#include <tuple>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
+#include "aot.h"
 #include "chip8.h"
+#include "jit.h"
 
 namespace chip8 {
 
-void Emulator::Cycle() {
-  instruction_ = memory[processor.pc] << 8 | memory[processor.pc + 1];
+const font_t kFont = {
+  0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
+  0x20, 0x60, 0x20, 0x20, 0x70,  // 1
+  0xF0, 0x10, 0xF0, 0x80, 0xF0,  // 2
+  0xF0, 0x10, 0xF0, 0x10, 0xF0,  // 3
+  0x90, 0x90, 0xF0, 0x10, 0x10,  // 4
+  0xF0, 0x80, 0xF0, 0x10, 0xF0,  // 5
+  0xF0, 0x80, 0xF0, 0x90, 0xF0,  // 6
+  0xF0, 0x10, 0x20, 0x40, 0x40,  // 7
+  0xF0, 0x90, 0xF0, 0x90, 0xF0,  // 8
+  0xF0, 0x90, 0xF0, 0x10, 0xF0,  // 9
+  0xF0, 0x90, 0xF0, 0x90, 0x90,  // A
+  0xE0, 0x90, 0xE0, 0x90, 0xE0,  // B
+  0xF0, 0x80, 0x80, 0x80, 0xF0,  // C
+  0xE0, 0x90, 0x90, 0x90, 0xE0,  // D
+  0xF0, 0x80, 0xF0, 0x80, 0xF0,  // E
+  0xF0, 0x80, 0xF0, 0x80, 0x80,  // F
+};
 
-  increment_pc();
+const big_font_t kBigFont = {
+  0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C,  // 0
+  0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C,  // 1
+  0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF,  // 2
+  0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C,  // 3
+  0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06,  // 4
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C,  // 5
+  0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C,  // 6
+  0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60,  // 7
+  0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C,  // 8
+  0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C,  // 9
+  0x3C, 0x7E, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3,  // A
+  0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC,  // B
+  0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C,  // C
+  0xFC, 0xFE, 0xC7, 0xC3, 0xC3, 0xC3, 0xC3, 0xC7, 0xFE, 0xFC,  // D
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFE, 0xFE, 0xC0, 0xC0, 0xFF, 0xFF,  // E
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFE, 0xFE, 0xC0, 0xC0, 0xC0, 0xC0,  // F
+};
 
-  struct Operation {
-    uint16_t code;
-    uint16_t mask;
-    std::function<void()> function;
-  };
-  static const std::vector<Operation> operations = {
-    {0x00E0, 0xFFFF, std::bind(&Emulator::op_00E0, this)},  // CLS
-    {0x00EE, 0xFFFF, std::bind(&Emulator::op_00EE, this)},  // RET
-    {0x1000, 0xF000, std::bind(&Emulator::op_1nnn, this)},  // JP addr
-    {0x2000, 0xF000, std::bind(&Emulator::op_2nnn, this)},  // CALL addr
-    {0x3000, 0xF000, std::bind(&Emulator::op_3xkk, this)},  // SE Vx, byte
-    {0x4000, 0xF000, std::bind(&Emulator::op_4xkk, this)},  // SNE Vx, byte
-    {0x5000, 0xF00F, std::bind(&Emulator::op_5xy0, this)},  // SE Vx, Vy
-    {0x6000, 0xF000, std::bind(&Emulator::op_6xkk, this)},  // LD Vx, byte
-    {0x7000, 0xF000, std::bind(&Emulator::op_7xkk, this)},  // ADD Vx, byte
-    {0x8000, 0xF00F, std::bind(&Emulator::op_8xy0, this)},  // LD Vx, Vy
-    {0x8001, 0xF00F, std::bind(&Emulator::op_8xy1, this)},  // OR Vx, Vy
-    {0x8002, 0xF00F, std::bind(&Emulator::op_8xy2, this)},  // AND Vx, Vy
-    {0x8003, 0xF00F, std::bind(&Emulator::op_8xy3, this)},  // XOR Vx, Vy
-    {0x8004, 0xF00F, std::bind(&Emulator::op_8xy4, this)},  // ADD Vx, Vy
-    {0x8005, 0xF00F, std::bind(&Emulator::op_8xy5, this)},  // SUB Vx, Vy
-    {0x8006, 0xF00F, std::bind(&Emulator::op_8xy6, this)},  // SHR Vx {, Vy}
-    {0x8007, 0xF00F, std::bind(&Emulator::op_8xy7, this)},  // SUBN Vx, Vy
-    {0x800E, 0xF00F, std::bind(&Emulator::op_8xyE, this)},  // SHL Vx {, Vy}
-    {0x9000, 0xF00F, std::bind(&Emulator::op_9xy0, this)},  // SNE Vx, Vy
-    {0xA000, 0xF000, std::bind(&Emulator::op_Annn, this)},  // LD I, addr
-    {0xB000, 0xF000, std::bind(&Emulator::op_Bnnn, this)},  // JP V0, addr
-    {0xC000, 0xF000, std::bind(&Emulator::op_Cxkk, this)},  // RND Vx, byte
-    {0xD000, 0xF000, std::bind(&Emulator::op_Dxyn, this)},  // DRW Vx, Vy, nibble
-    {0xE09E, 0xF0FF, std::bind(&Emulator::op_Ex9E, this)},  // SKP Vx
-    {0xE0A1, 0xF0FF, std::bind(&Emulator::op_ExA1, this)},  // SKNP Vx
-    {0xF007, 0xF0FF, std::bind(&Emulator::op_Fx07, this)},  // LD Vx, DT
-    {0xF00A, 0xF0FF, std::bind(&Emulator::op_Fx0A, this)},  // LD Vx, K
-    {0xF015, 0xF0FF, std::bind(&Emulator::op_Fx15, this)},  // LD DT, Vx
-    {0xF018, 0xF0FF, std::bind(&Emulator::op_Fx18, this)},  // LD ST, Vx
-    {0xF01E, 0xF0FF, std::bind(&Emulator::op_Fx1E, this)},  // ADD I, Vx
-    {0xF029, 0xF0FF, std::bind(&Emulator::op_Fx29, this)},  // LD F, Vx
-    {0xF033, 0xF0FF, std::bind(&Emulator::op_Fx33, this)},  // LD B, Vx
-    {0xF055, 0xF0FF, std::bind(&Emulator::op_Fx55, this)},  // LD [I], Vx
-    {0xF065, 0xF0FF, std::bind(&Emulator::op_Fx65, this)},  // LD Vx, [I]
+#ifdef CHIP8_PROFILE
+constexpr bool kProfile = true;
+#else
+constexpr bool kProfile = false;
+#endif
+
+// Translated blocks are flushed when their code grows beyond this
+constexpr size_t kMaxBlockCodeSize = 64 * 1024;
+
+bool IsBlockEnd(Opcode op) {
+  switch (op) {
+    // Control flow
+    case Opcode::k00EE:
+    case Opcode::k1nnn:
+    case Opcode::k2nnn:
+    case Opcode::kBnnn:
+    // Skips
+    case Opcode::k3xkk:
+    case Opcode::k4xkk:
+    case Opcode::k5xy0:
+    case Opcode::k9xy0:
+    case Opcode::kEx9E:
+    case Opcode::kExA1:
+    // Rewinds the program counter while waiting for a key
+    case Opcode::kFx0A:
+    // May start or stop the tone, which is timed to the instruction
+    case Opcode::kFx18:
+    // Stops the program
+    case Opcode::k00FD:
+    // Followed by an operand rather than an instruction
+    case Opcode::kF000:
+    // May modify the code that follows
+    case Opcode::kFx33:
+    case Opcode::kFx55:
+    case Opcode::k5xy2:
+    case Opcode::kUnknown:
+      return true;
+    default:
+      return false;
+  }
+}
+
+uint8_t GetInstructionSize(uint16_t code, Extension extension) {
+  return code == 0xF000 && extension == Extension::kXoChip ? 4 : 2;
+}
+
+// The instruction set that introduced an opcode
+static Extension GetExtension(Opcode op) {
+  switch (op) {
+    case Opcode::k00Cn:
+    case Opcode::k00FB:
+    case Opcode::k00FC:
+    case Opcode::k00FD:
+    case Opcode::k00FE:
+    case Opcode::k00FF:
+    case Opcode::kFx30:
+    case Opcode::kFx75:
+    case Opcode::kFx85:
+      return Extension::kSuperChip;
+    case Opcode::k00Dn:
+    case Opcode::k5xy2:
+    case Opcode::k5xy3:
+    case Opcode::kF000:
+    case Opcode::kFx01:
+      return Extension::kXoChip;
+    default:
+      return Extension::kNone;
+  }
+}
+
+Instruction Decode(uint16_t code, Extension extension) {
+  Instruction instruction;
+  instruction.code = code;
+  instruction.nnn = static_cast<uint16_t>(code & 0x0FFF);
+  instruction.kk = static_cast<uint8_t>(code & 0x00FF);
+  instruction.n = static_cast<uint8_t>(code & 0x000F);
+  instruction.x = static_cast<uint8_t>((code & 0x0F00) >> 8);
+  instruction.y = static_cast<uint8_t>((code & 0x00F0) >> 4);
+  instruction.op = Opcode::kUnknown;
+
+  auto& op = instruction.op;
+
+  switch (code >> 12) {
+    case 0x0:
+      switch (code & 0xFFF0) {
+        case 0x00C0: op = Opcode::k00Cn; break;  // SCD nibble
+        case 0x00D0: op = Opcode::k00Dn; break;  // SCU nibble
+      }
+      switch (code) {
+        case 0x00E0: op = Opcode::k00E0; break;  // CLS
+        case 0x00EE: op = Opcode::k00EE; break;  // RET
+        case 0x00FB: op = Opcode::k00FB; break;  // SCR
+        case 0x00FC: op = Opcode::k00FC; break;  // SCL
+        case 0x00FD: op = Opcode::k00FD; break;  // EXIT
+        case 0x00FE: op = Opcode::k00FE; break;  // LOW
+        case 0x00FF: op = Opcode::k00FF; break;  // HIGH
+      }
+      break;
+    case 0x1: op = Opcode::k1nnn; break;  // JP addr
+    case 0x2: op = Opcode::k2nnn; break;  // CALL addr
+    case 0x3: op = Opcode::k3xkk; break;  // SE Vx, byte
+    case 0x4: op = Opcode::k4xkk; break;  // SNE Vx, byte
+    case 0x5:
+      switch (instruction.n) {
+        case 0x0: op = Opcode::k5xy0; break;  // SE Vx, Vy
+        case 0x2: op = Opcode::k5xy2; break;  // LD [I], Vx-Vy
+        case 0x3: op = Opcode::k5xy3; break;  // LD Vx-Vy, [I]
+      }
+      break;
+    case 0x6: op = Opcode::k6xkk; break;  // LD Vx, byte
+    case 0x7: op = Opcode::k7xkk; break;  // ADD Vx, byte
+    case 0x8:
+      switch (instruction.n) {
+        case 0x0: op = Opcode::k8xy0; break;  // LD Vx, Vy
+        case 0x1: op = Opcode::k8xy1; break;  // OR Vx, Vy
+        case 0x2: op = Opcode::k8xy2; break;  // AND Vx, Vy
+        case 0x3: op = Opcode::k8xy3; break;  // XOR Vx, Vy
+        case 0x4: op = Opcode::k8xy4; break;  // ADD Vx, Vy
+        case 0x5: op = Opcode::k8xy5; break;  // SUB Vx, Vy
+        case 0x6: op = Opcode::k8xy6; break;  // SHR Vx {, Vy}
+        case 0x7: op = Opcode::k8xy7; break;  // SUBN Vx, Vy
+        case 0xE: op = Opcode::k8xyE; break;  // SHL Vx {, Vy}
+      }
+      break;
+    case 0x9:
+      if (instruction.n == 0x0)
+        op = Opcode::k9xy0;  // SNE Vx, Vy
+      break;
+    case 0xA: op = Opcode::kAnnn; break;  // LD I, addr
+    case 0xB: op = Opcode::kBnnn; break;  // JP V0, addr
+    case 0xC: op = Opcode::kCxkk; break;  // RND Vx, byte
+    case 0xD: op = Opcode::kDxyn; break;  // DRW Vx, Vy, nibble
+    case 0xE:
+      switch (instruction.kk) {
+        case 0x9E: op = Opcode::kEx9E; break;  // SKP Vx
+        case 0xA1: op = Opcode::kExA1; break;  // SKNP Vx
+      }
+      break;
+    case 0xF:
+      switch (instruction.kk) {
+        case 0x00:
+          if (instruction.x == 0x0)
+            op = Opcode::kF000;  // LD I, long
+          break;
+        case 0x01: op = Opcode::kFx01; break;  // PLANE x
+        case 0x07: op = Opcode::kFx07; break;  // LD Vx, DT
+        case 0x0A: op = Opcode::kFx0A; break;  // LD Vx, K
+        case 0x15: op = Opcode::kFx15; break;  // LD DT, Vx
+        case 0x18: op = Opcode::kFx18; break;  // LD ST, Vx
+        case 0x1E: op = Opcode::kFx1E; break;  // ADD I, Vx
+        case 0x29: op = Opcode::kFx29; break;  // LD F, Vx
+        case 0x33: op = Opcode::kFx33; break;  // LD B, Vx
+        case 0x55: op = Opcode::kFx55; break;  // LD [I], Vx
+        case 0x30: op = Opcode::kFx30; break;  // LD HF, Vx
+        case 0x65: op = Opcode::kFx65; break;  // LD Vx, [I]
+        case 0x75: op = Opcode::kFx75; break;  // LD R, Vx
+        case 0x85: op = Opcode::kFx85; break;  // LD Vx, R
+      }
+      break;
+  }
+
+  if (GetExtension(op) > extension)
+    op = Opcode::kUnknown;
+
+  return instruction;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool ReadProgram(const std::string& path, std::vector<uint8_t>& program) {
+  std::FILE* file = std::fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+
+  // Programs are small enough to read with a single call, and reading one
+  // byte more than fits tells whether the file is too large
+  program.resize(kXoChipMaxProgramSize + 1);
+  const size_t size = std::fread(program.data(), 1, program.size(), file);
+  const bool failed = std::ferror(file) != 0;
+  std::fclose(file);
+
+  program.resize(size);
+  return !failed && size <= kXoChipMaxProgramSize;
+}
+
+uint64_t HashProgram(const std::vector<uint8_t>& program) {
+  uint64_t hash = 0xCBF29CE484222325;  // FNV-1a
+  for (const auto byte : program) {
+    hash ^= byte;
+    hash *= 0x100000001B3;
+  }
+  return hash;
+}
+
+bool ParseQuirkProfile(const std::string& name, QuirkProfile& quirks) {
+  if (name == "chip8") {
+    quirks = QuirkProfile::kChip8;
+  } else if (name == "cosmac") {
+    quirks = QuirkProfile::kCosmac;
+  } else if (name == "schip") {
+    quirks = QuirkProfile::kSuperChip;
+  } else if (name == "xochip") {
+    quirks = QuirkProfile::kXoChip;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Random::Random(uint64_t seed) {
+  Seed(seed);
+}
+
+void Random::Seed(uint64_t seed) {
+  state_ = 0;
+  Next();
+  state_ += seed;
+  Next();
+}
+
+uint32_t Random::Next() {
+  const uint64_t state = state_;
+  state_ = state * 6364136223846793005 + 1442695040888963407;
+  const auto xorshifted = static_cast<uint32_t>(((state >> 18) ^ state) >> 27);
+  const auto rotation = static_cast<uint32_t>(state >> 59);
+  return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+}
+
+uint64_t Random::state() const {
+  return state_;
+}
+
+void Random::set_state(uint64_t state) {
+  state_ = state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Emulator::Emulator(Executor executor, QuirkProfile quirks)
+    : executor_(executor) {
+  sound_writes_.reserve(kMaxSoundWrites);
+  set_quirks(quirks);
+}
+
+template <typename Q>
+const Emulator::Dispatch& Emulator::Specialize() {
+  static const Dispatch dispatch = {
+    &Emulator::Cycle<Q>,
+    &Emulator::Execute<Q>,
+    &Emulator::RunInterpreter<Q>,
+    &Emulator::RunThreaded<Q>,
+    Q::kExtension,
+    Q::kShiftVy,
+    Q::kIncrementI,
+    Q::kJumpVx,
   };
+  return dispatch;
+}
 
-  std::function<void()> op_function(std::bind(&Emulator::op_unknown, this));
-  for (const auto& op : operations) {
-    if ((instruction_ & op.mask) == op.code) {
-      op_function = op.function;
+void Emulator::Cycle() {
+  (this->*dispatch_->cycle)();
+}
+
+void Emulator::Execute() {
+  (this->*dispatch_->execute)();
+}
+
+uint32_t Emulator::RunInterpreter(uint32_t cycles) {
+  return (this->*dispatch_->run_interpreter)(cycles);
+}
+
+uint32_t Emulator::RunThreaded(uint32_t cycles) {
+  return (this->*dispatch_->run_threaded)(cycles);
+}
+
+template <typename Q>
+void Emulator::Cycle() {
+  const uint16_t pc = processor.pc & Q::kAddressMask;
+  auto& instruction = decoded_[pc];
+
+  if (instruction.op == Opcode::kNone) {
+    instruction = Decode(memory[pc] << 8 | memory[(pc + 1) & Q::kAddressMask],
+                         Q::kExtension);
+    MarkDecoded(pc);
+  }
+
+  instruction_ = instruction;
+
+  increment_pc();
+
+#ifdef CHIP8_PROFILE
+  profile_.Count(pc, static_cast<uint8_t>(instruction_.op),
+                 processor.stack.data(), processor.sp, memory.data(),
+                 Q::kAddressMask);
+
+  // Only the handlers that are expensive enough to be worth timing
+  switch (instruction_.op) {
+    case Opcode::k00E0:
+    case Opcode::kDxyn:
+    case Opcode::kFx33:
+    case Opcode::kFx55:
+    case Opcode::kFx65: {
+      const auto start = std::chrono::steady_clock::now();
+      Execute<Q>();
+      const std::chrono::duration<uint64_t, std::nano> elapsed =
+          std::chrono::steady_clock::now() - start;
+      profile_.AddTime(static_cast<uint8_t>(instruction_.op),
+                       elapsed.count());
+      return;
+    }
+    default:
       break;
+  }
+#endif
+
+  Execute<Q>();
+}
+
+StopReason Emulator::RunCycles(uint32_t cycles) {
+  stop_ = StopReason::kBudget;
+  idle_run_ = false;
+
+  uint32_t executed = 0;
+  if (has_breakpoints_ || kProfile) {
+    executed = RunInterpreter(cycles);
+  } else {
+    switch (executor_) {
+      case Executor::kInterpreter:
+        executed = RunInterpreter(cycles);
+        break;
+      case Executor::kThreaded:
+        executed = RunThreaded(cycles);
+        break;
+      case Executor::kJit:
+        executed = jit()->Run(cycles);
+        break;
+      case Executor::kAot:
+        executed = aot()->Run(cycles);
+        break;
     }
   }
-  op_function();
+  // Waiting for a key would repeat Fx0A until the end of the run, which is
+  // counted as in SkipIdle()
+  if (stop_ == StopReason::kWaitingForKey) {
+    idle_cycles_ += cycles - executed;
+    idle_run_ = true;
+    executed = cycles;
+  }
+
+  cycles_ += executed;
+
+  return stop_;
+}
+
+StopReason Emulator::RunFrame() {
+  const auto reason = RunCycles(cycles_per_frame_);
+  UpdateTimers();
+  return reason;
 }
 
 void Emulator::UpdateTimers() {
@@ -95,22 +440,32 @@ void Emulator::UpdateTimers() {
 
   if (processor.st > 0)
     --processor.st;
+
+  frame_start_ = cycles_;
+  sound_writes_.clear();
 }
 
 bool Emulator::Load(const std::vector<uint8_t>& program) {
   if (program.size() > memory.size() - kProgramOffset)
     return false;
 
-  std::copy(program.begin(), program.end(), std::back_inserter(program_));
+  program_.assign(program.begin(), program.end());
   std::copy(program.begin(), program.end(), memory.begin() + kProgramOffset);
+  Invalidate(kProgramOffset, program.size());
+  if (aot_ && aot_->owner() == this)
+    aot_->Flush();
 
   return true;
 }
 
 void Emulator::Reset() {
-  display.fill(false);
+  display.fill(0);
+  dirty_rows_ = ~0ull;
   input.fill(false);
-  memory.fill(0);
+  std::fill_n(memory.begin(), memory_end_, 0);
+  hires = false;
+  planes = 1;
+  rpl.fill(0);
 
   processor.v.fill(0);
   processor.i = 0;
@@ -120,41 +475,182 @@ void Emulator::Reset() {
   processor.dt = 0;
   processor.st = 0;
 
-  static const std::array<uint8_t, 16 * 5> sprites = {
-    0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
-    0x20, 0x60, 0x20, 0x20, 0x70,  // 1
-    0xF0, 0x10, 0xF0, 0x80, 0xF0,  // 2
-    0xF0, 0x10, 0xF0, 0x10, 0xF0,  // 3
-    0x90, 0x90, 0xF0, 0x10, 0x10,  // 4
-    0xF0, 0x80, 0xF0, 0x10, 0xF0,  // 5
-    0xF0, 0x80, 0xF0, 0x90, 0xF0,  // 6
-    0xF0, 0x10, 0x20, 0x40, 0x40,  // 7
-    0xF0, 0x90, 0xF0, 0x90, 0xF0,  // 8
-    0xF0, 0x90, 0xF0, 0x10, 0xF0,  // 9
-    0xF0, 0x90, 0xF0, 0x90, 0x90,  // A
-    0xE0, 0x90, 0xE0, 0x90, 0xE0,  // B
-    0xF0, 0x80, 0x80, 0x80, 0xF0,  // C
-    0xE0, 0x90, 0x90, 0x90, 0xE0,  // D
-    0xF0, 0x80, 0xF0, 0x80, 0xF0,  // E
-    0xF0, 0x80, 0xF0, 0x80, 0x80,  // F
-  };
-  std::copy(sprites.begin(), sprites.end(), memory.begin());
-
-  instruction_ = 0x0000;
+  std::copy(kFont.begin(), kFont.end(), memory.begin());
+  std::copy(kBigFont.begin(), kBigFont.end(),
+            memory.begin() + kBigFontOffset);
+  memory_end_ = kBigFontOffset + kBigFont.size();
+
+  instruction_ = Instruction();
+  FlushCode();
+  cycles_ = 0;
+  stop_ = StopReason::kBudget;
+  idle_cycles_ = 0;
+  idle_run_ = false;
+  frame_start_ = 0;
+  sound_writes_.clear();
+  random_.Seed(seed_);
   program_.clear();
 }
 
 void Emulator::Restart() {
-  const auto program = program_;
+  // Kept aside rather than copied, as Reset() forgets the program
+  std::vector<uint8_t> program;
+  program.swap(program_);
   Reset();
-  Load(program);
+  program_.swap(program);
+
+  // The decode cache is empty after a reset, so there is nothing to
+  // invalidate
+  std::copy(program_.begin(), program_.end(), memory.begin() + kProgramOffset);
+  memory_end_ = std::max<uint32_t>(
+      memory_end_, static_cast<uint32_t>(kProgramOffset + program_.size()));
 }
 
-bool Emulator::GetPixel(uint8_t x, uint8_t y) const {
-  const size_t pixel = x + (kDisplayWidth * y);
-  if (pixel < display.size())
-    return display[pixel];
-  return false;
+template <uint32_t MemorySize>
+bool Emulator::SaveState(BasicState<MemorySize>& state) const {
+  if (memory_end_ > MemorySize || program_.size() > state.program.size())
+    return false;
+
+  state.magic = kStateMagic;
+  state.version = kStateVersion;
+  state.cycles = cycles_;
+  state.seed = seed_;
+  state.random = random_.state();
+  state.instruction = instruction_.code;
+  state.program_size = static_cast<uint16_t>(program_.size());
+  state.display = display;
+  state.input = input;
+  state.processor = processor;
+  state.hires = hires;
+  state.planes = planes;
+  state.rpl = rpl;
+  // The state's memory is zero past its own end, and needs clearing only
+  // where ours is shorter
+  std::copy_n(memory.begin(), memory_end_, state.memory.begin());
+  if (state.memory_end > memory_end_) {
+    std::fill(state.memory.begin() + memory_end_,
+              state.memory.begin() + state.memory_end, 0);
+  }
+  state.memory_end = memory_end_;
+  std::copy(program_.begin(), program_.end(), state.program.begin());
+  return true;
+}
+
+// Only XO-CHIP selects planes, including none of them
+static bool IsValidPlanes(uint8_t planes, Extension extension) {
+  if (extension == Extension::kXoChip)
+    return planes < 1 << kPlanes;
+  return planes == 1;
+}
+
+template <uint32_t MemorySize>
+bool Emulator::LoadState(const BasicState<MemorySize>& state) {
+  if (state.magic != kStateMagic || state.version != kStateVersion ||
+      state.program_size > state.program.size() ||
+      state.program_size > memory.size() - kProgramOffset ||
+      state.memory_end > std::min<size_t>(MemorySize, memory.size()) ||
+      state.processor.sp > state.processor.stack.size() ||
+      !IsValidPlanes(state.planes, dispatch_->extension)) {
+    return false;
+  }
+
+  // Memory that the state is too small to hold is zero in it
+  if (memory_end_ > MemorySize) {
+    std::fill(memory.begin() + MemorySize, memory.begin() + memory_end_, 0);
+    Invalidate(static_cast<uint16_t>(MemorySize), memory_end_ - MemorySize);
+    memory_end_ = MemorySize;
+  }
+
+  // Copy memory in chunks, so that the decode cache survives where the
+  // program has not modified itself. Both are zero past their ends.
+  constexpr size_t kChunkSize = 64;
+  const size_t end =
+      (std::max(memory_end_, state.memory_end) + kChunkSize - 1) /
+      kChunkSize * kChunkSize;
+  size_t changed = end;  // start of the current run of changes, if before end
+  for (size_t address = 0; address <= end; address += kChunkSize) {
+    const bool differs = address < end &&
+        std::memcmp(&memory[address], &state.memory[address], kChunkSize);
+    if (differs && changed == end) {
+      changed = address;
+    } else if (!differs && changed != end) {
+      std::memcpy(&memory[changed], &state.memory[changed], address - changed);
+      Invalidate(static_cast<uint16_t>(changed), address - changed);
+      changed = end;
+    }
+  }
+  memory_end_ = state.memory_end;
+
+  if (hires != state.hires) {
+    dirty_rows_ = ~0ull;
+  } else {
+    for (size_t j = 0; j < display.size(); ++j) {
+      if (display[j] != state.display[j])
+        dirty_rows_ |= 1ull << (j % kHiResHeight);
+    }
+  }
+  display = state.display;
+  input = state.input;
+  processor = state.processor;
+  hires = state.hires;
+  planes = state.planes;
+  rpl = state.rpl;
+
+  instruction_ = Decode(state.instruction, dispatch_->extension);
+  cycles_ = state.cycles;
+  frame_start_ = cycles_;
+  sound_writes_.clear();
+  seed_ = state.seed;
+  random_.set_state(state.random);
+  stop_ = StopReason::kBudget;
+  if (aot_ && aot_->owner() == this &&
+      (program_.size() != state.program_size ||
+       !std::equal(program_.begin(), program_.end(), state.program.begin()))) {
+    aot_->Flush();
+  }
+  program_.assign(state.program.begin(),
+                  state.program.begin() + state.program_size);
+
+  return true;
+}
+
+template bool Emulator::SaveState(State& state) const;
+template bool Emulator::SaveState(XoChipState& state) const;
+template bool Emulator::LoadState(const State& state);
+template bool Emulator::LoadState(const XoChipState& state);
+
+uint8_t Emulator::width() const {
+  return hires ? kHiResWidth : kDisplayWidth;
+}
+
+uint8_t Emulator::height() const {
+  return hires ? kHiResHeight : kDisplayHeight;
+}
+
+uint8_t Emulator::GetPixel(uint8_t x, uint8_t y) const {
+  if (x >= width() || y >= height())
+    return 0;
+
+  uint8_t pixel = 0;
+  for (uint8_t plane = 0; plane < kPlanes; ++plane) {
+    const auto row = display[GetDisplayIndex(plane, x / 64, y)];
+    pixel |= ((row >> (63 - x % 64)) & 1) << plane;
+  }
+  return pixel;
+}
+
+uint64_t Emulator::GetRow(uint8_t y, uint8_t column, uint8_t plane) const {
+  if (y < height() && column < width() / 64 && plane < kPlanes)
+    return display[GetDisplayIndex(plane, column, y)];
+  return 0;
+}
+
+uint64_t Emulator::dirty_rows() const {
+  return dirty_rows_;
+}
+
+void Emulator::ClearDirtyRows() {
+  dirty_rows_ = 0;
 }
 
 void Emulator::SetKey(uint8_t key, bool pressed) {
@@ -162,17 +658,587 @@ void Emulator::SetKey(uint8_t key, bool pressed) {
     input[key] = pressed;
 }
 
+void Emulator::SetBreakpoint(uint16_t address, bool enabled) {
+  breakpoints_[address] = enabled;
+  has_breakpoints_ = breakpoints_.any();
+}
+
+void Emulator::ClearBreakpoints() {
+  breakpoints_.reset();
+  has_breakpoints_ = false;
+}
+
+void Emulator::Seed(uint64_t seed) {
+  seed_ = seed;
+  random_.Seed(seed);
+}
+
+uint64_t Emulator::seed() const {
+  return seed_;
+}
+
+void Emulator::SetRandomSource(std::function<uint8_t()> source) {
+  random_source_ = std::move(source);
+  // Compiled code draws from the default generator directly
+  if (jit_ && jit_->owner() == this)
+    jit_->Flush();
+}
+
+uint64_t Emulator::idle_cycles() const {
+  return idle_cycles_;
+}
+
+bool Emulator::idle() const {
+  return idle_run_;
+}
+
+const std::vector<SoundWrite>& Emulator::sound_writes() const {
+  return sound_writes_;
+}
+
+QuirkProfile Emulator::quirks() const {
+  return quirks_;
+}
+
+void Emulator::set_quirks(QuirkProfile quirks) {
+  const auto previous = dispatch_;
+  quirks_ = quirks;
+  switch (quirks) {
+    case QuirkProfile::kChip8:
+      dispatch_ = &Specialize<Chip8Quirks>();
+      break;
+    case QuirkProfile::kCosmac:
+      dispatch_ = &Specialize<CosmacQuirks>();
+      break;
+    case QuirkProfile::kSuperChip:
+      dispatch_ = &Specialize<SuperChipQuirks>();
+      break;
+    case QuirkProfile::kXoChip:
+      dispatch_ = &Specialize<XoChipQuirks>();
+      break;
+  }
+
+  const uint32_t size = GetMemorySize(dispatch_->extension);
+  if (memory.size() != size || decoded_.size() != size) {
+    memory.resize(size);
+    decoded_.resize(size);
+    blocks_.resize(size);
+    if (program_.size() > size - kProgramOffset)
+      program_.resize(size - kProgramOffset);
+    program_.reserve(size - kProgramOffset);
+    decoded_end_ = std::min(decoded_end_, size);
+    memory_end_ = std::min(memory_end_, size);
+    address_mask_ = static_cast<uint16_t>(size - 1);
+  }
+
+  if (!previous || previous->extension != dispatch_->extension) {
+    FlushCode();
+  } else if (previous != dispatch_ && jit_ && jit_->owner() == this) {
+    jit_->Flush();  // compiled code has the quirks built in
+  }
+}
+
+uint64_t Emulator::cycles() const {
+  return cycles_;
+}
+
+uint32_t Emulator::cycles_per_frame() const {
+  return cycles_per_frame_;
+}
+
+void Emulator::set_cycles_per_frame(uint32_t cycles) {
+  cycles_per_frame_ = cycles;
+}
+
+void Emulator::Invalidate(uint16_t address, size_t length) {
+  // A range that wraps around leaves all of memory in use
+  memory_end_ = static_cast<uint32_t>(std::max<size_t>(
+      memory_end_, std::min<size_t>(address + length, memory.size())));
+
+  // Most stores are to data, away from any instruction, which is at most four
+  // bytes long
+  if (address + length <= memory.size() &&
+      (address + length <= decoded_begin_ || address >= decoded_end_ + 3)) {
+    return;
+  }
+
+  // An instruction starting one byte before the range overlaps it as well
+  for (size_t j = 0; j <= length; ++j) {
+    decoded_[(address + j - 1) & address_mask_].op = Opcode::kNone;
+  }
+
+  // So does any block that starts within its maximum size before the range
+  for (size_t j = 0; j < length + kMaxBlockLength * 2; ++j) {
+    blocks_[(address + length - 1 - j) & address_mask_].length = 0;
+  }
+
+  if (jit_ && jit_->owner() == this)
+    jit_->Invalidate(address, length);
+  if (aot_ && aot_->owner() == this)
+    aot_->Invalidate(address, length);
+}
+
+#ifdef CHIP8_PROFILE
+Profile& Emulator::profile() {
+  return profile_;
+}
+#endif
+
+Jit* Emulator::jit() {
+  if (executor_ != Executor::kJit)
+    return nullptr;
+
+  // A copied emulator must not share translated code with its original
+  if (!jit_ || jit_->owner() != this)
+    jit_ = std::make_shared<Jit>(*this);
+
+  return jit_.get();
+}
+
+Aot* Emulator::aot() {
+  if (executor_ != Executor::kAot)
+    return nullptr;
+
+  if (!aot_ || aot_->owner() != this)
+    aot_ = std::make_shared<Aot>(*this);
+
+  return aot_.get();
+}
+
+template <typename Q>
+void Emulator::Execute() {
+  switch (instruction_.op) {
+    case Opcode::k00E0: return op_00E0();
+    case Opcode::k00EE: return op_00EE();
+    case Opcode::k1nnn: return op_1nnn();
+    case Opcode::k2nnn: return op_2nnn();
+    case Opcode::k3xkk: return op_3xkk();
+    case Opcode::k4xkk: return op_4xkk();
+    case Opcode::k5xy0: return op_5xy0();
+    case Opcode::k6xkk: return op_6xkk();
+    case Opcode::k7xkk: return op_7xkk();
+    case Opcode::k8xy0: return op_8xy0();
+    case Opcode::k8xy1: return op_8xy1();
+    case Opcode::k8xy2: return op_8xy2();
+    case Opcode::k8xy3: return op_8xy3();
+    case Opcode::k8xy4: return op_8xy4();
+    case Opcode::k8xy5: return op_8xy5();
+    case Opcode::k8xy6: return op_8xy6<Q>();
+    case Opcode::k8xy7: return op_8xy7();
+    case Opcode::k8xyE: return op_8xyE<Q>();
+    case Opcode::k9xy0: return op_9xy0();
+    case Opcode::kAnnn: return op_Annn();
+    case Opcode::kBnnn: return op_Bnnn<Q>();
+    case Opcode::kCxkk: return op_Cxkk();
+    case Opcode::kDxyn: return op_Dxyn<Q>();
+    case Opcode::kEx9E: return op_Ex9E();
+    case Opcode::kExA1: return op_ExA1();
+    case Opcode::kFx07: return op_Fx07();
+    case Opcode::kFx0A: return op_Fx0A();
+    case Opcode::kFx15: return op_Fx15();
+    case Opcode::kFx18: return op_Fx18();
+    case Opcode::kFx1E: return op_Fx1E();
+    case Opcode::kFx29: return op_Fx29();
+    case Opcode::kFx33: return op_Fx33();
+    case Opcode::kFx55: return op_Fx55<Q>();
+    case Opcode::kFx65: return op_Fx65<Q>();
+    case Opcode::k00Cn: return op_00Cn();
+    case Opcode::k00FB: return op_00FB();
+    case Opcode::k00FC: return op_00FC();
+    case Opcode::k00FD: return op_00FD();
+    case Opcode::k00FE: return op_00FE();
+    case Opcode::k00FF: return op_00FF();
+    case Opcode::kFx30: return op_Fx30();
+    case Opcode::kFx75: return op_Fx75();
+    case Opcode::kFx85: return op_Fx85();
+    case Opcode::k00Dn: return op_00Dn();
+    case Opcode::k5xy2: return op_5xy2();
+    case Opcode::k5xy3: return op_5xy3();
+    case Opcode::kF000: return op_F000();
+    case Opcode::kFx01: return op_Fx01();
+    default: return op_unknown();
+  }
+}
+
+void Emulator::MarkDecoded(uint32_t address) {
+  decoded_begin_ = std::min(decoded_begin_, address);
+  decoded_end_ = std::max(decoded_end_, address + 1);
+}
+
+void Emulator::Write(uint16_t address, uint8_t value) {
+  memory[address & address_mask_] = value;
+  memory_end_ = std::max(memory_end_,
+                         static_cast<uint32_t>((address & address_mask_) + 1));
+  ++side_effects_;
+}
+
+static bool operator==(const Processor& a, const Processor& b) {
+  return a.pc == b.pc && a.v == b.v && a.i == b.i && a.sp == b.sp &&
+         a.dt == b.dt && a.st == b.st && a.stack == b.stack;
+}
+
+uint32_t Emulator::SkipIdle(uint32_t cycle, uint32_t cycles) {
+  constexpr uint32_t kMaxPeriod = 256;   // in instructions
+  constexpr uint32_t kMaxBackoff = 64;  // in backward jumps
+
+  idle_countdown_ = 1;
+
+  // The state is deterministic, so once it repeats without side effects, it
+  // repeats with the same period until the inputs change
+  if (idle_.valid && cycle > idle_.cycle &&
+      idle_.side_effects == side_effects_ && idle_.processor == processor) {
+    const uint32_t period = cycle - idle_.cycle;
+    const uint32_t skipped = (cycles - cycle) / period * period;
+    idle_.cycle = cycle + skipped;
+    idle_cycles_ += skipped;
+    idle_run_ |= skipped > 0;
+    idle_backoff_ = 1;
+    return skipped;
+  }
+
+  // Loops with more than one backward jump come back to the first one
+  if (idle_.valid && cycle > idle_.cycle &&
+      cycle - idle_.cycle < kMaxPeriod &&
+      idle_.side_effects == side_effects_ &&
+      idle_.processor.pc != processor.pc) {
+    return 0;
+  }
+
+  // A loop that keeps changing the state is doing work, and is checked less
+  // and less often
+  if (idle_.valid && idle_.processor.pc == processor.pc) {
+    idle_backoff_ = std::min(idle_backoff_ * 2, kMaxBackoff);
+    idle_countdown_ = idle_backoff_;
+  } else {
+    idle_backoff_ = 1;
+  }
+
+  idle_.valid = true;
+  idle_.processor = processor;
+  idle_.cycle = cycle;
+  idle_.side_effects = side_effects_;
+  return 0;
+}
+
+bool Emulator::EndsRun(uint32_t cycle) {
+  if (stop_ != StopReason::kSoundTimer)
+    return true;
+
+  const uint64_t offset = cycles_ + cycle - frame_start_;
+  const SoundWrite write = {
+    static_cast<uint32_t>(std::min<uint64_t>(offset, UINT32_MAX)),
+    processor.st,
+  };
+  if (sound_writes_.size() < kMaxSoundWrites) {
+    sound_writes_.push_back(write);
+  } else {
+    sound_writes_.back() = write;
+  }
+
+  stop_ = StopReason::kBudget;
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename Q>
+uint32_t Emulator::RunInterpreter(uint32_t cycles) {
+  // Stepping over idle loops would skip breakpoints and profiling samples
+  const bool skip_idle = !has_breakpoints_ && !kProfile;
+  uint32_t cycle = 0;
+  idle_.valid = false;
+
+  while (cycle < cycles) {
+    if (has_breakpoints_ && cycle > 0 &&
+        breakpoints_[processor.pc & Q::kAddressMask]) {
+      stop_ = StopReason::kBreakpoint;
+      break;
+    }
+
+    const uint16_t pc = processor.pc;
+    Cycle<Q>();
+    ++cycle;
+
+    // Checked first, as waiting for a key rewinds the program counter
+    if (stop_ != StopReason::kBudget && EndsRun(cycle))
+      break;
+
+    if (skip_idle && processor.pc <= pc && !--idle_countdown_)
+      cycle += SkipIdle(cycle, cycles);
+  }
+
+  return cycle;
+}
+
+template <typename Q>
+uint32_t Emulator::RunThreaded(uint32_t cycles) {
+#if defined(__GNUC__)
+  // Indexed by Opcode
+  static void* const labels[] = {
+    &&end,
+    &&op_00E0, &&op_00EE, &&op_1nnn, &&op_2nnn, &&op_3xkk, &&op_4xkk,
+    &&op_5xy0, &&op_6xkk, &&op_7xkk, &&op_8xy0, &&op_8xy1, &&op_8xy2,
+    &&op_8xy3, &&op_8xy4, &&op_8xy5, &&op_8xy6, &&op_8xy7, &&op_8xyE,
+    &&op_9xy0, &&op_Annn, &&op_Bnnn, &&op_Cxkk, &&op_Dxyn, &&op_Ex9E,
+    &&op_ExA1, &&op_Fx07, &&op_Fx0A, &&op_Fx15, &&op_Fx18, &&op_Fx1E,
+    &&op_Fx29, &&op_Fx33, &&op_Fx55, &&op_Fx65,
+    &&op_00Cn, &&op_00FB, &&op_00FC, &&op_00FD, &&op_00FE, &&op_00FF,
+    &&op_Fx30, &&op_Fx75, &&op_Fx85,
+    &&op_00Dn, &&op_5xy2, &&op_5xy3, &&op_F000, &&op_Fx01,
+    &&op_unknown,
+  };
+  static_assert(sizeof(labels) / sizeof(labels[0]) ==
+                static_cast<size_t>(Opcode::kUnknown) + 1,
+                "Label table must match Opcode");
+#endif
+
+  uint32_t cycle = 0;
+  idle_.valid = false;
+
+  while (cycle < cycles) {
+    const uint16_t pc = processor.pc;
+    const auto& block = GetBlock(pc & Q::kAddressMask);
+
+    // Finish a partial block one instruction at a time, so that the
+    // program counter is exact when we return
+    if (cycles - cycle < block.length) {
+      while (cycle < cycles) {
+        Cycle<Q>();
+        ++cycle;
+        if (stop_ != StopReason::kBudget && EndsRun(cycle))
+          break;
+      }
+      break;
+    }
+    cycle += block.length;
+
+    // Blocks are terminated by an instruction of Opcode::kNone
+    const Instruction* it = &block_code_[block.offset];
+
+#if defined(__GNUC__)
+#define CHIP8_OPERATION(name) \
+    name: \
+      instruction_ = *it++; \
+      increment_pc(); \
+      name(); \
+      goto *labels[static_cast<size_t>(it->op)];
+#define CHIP8_QUIRK_OPERATION(name) \
+    name: \
+      instruction_ = *it++; \
+      increment_pc(); \
+      name<Q>(); \
+      goto *labels[static_cast<size_t>(it->op)];
+
+    goto *labels[static_cast<size_t>(it->op)];
+
+    CHIP8_OPERATION(op_00E0)
+    CHIP8_OPERATION(op_00EE)
+    CHIP8_OPERATION(op_1nnn)
+    CHIP8_OPERATION(op_2nnn)
+    CHIP8_OPERATION(op_3xkk)
+    CHIP8_OPERATION(op_4xkk)
+    CHIP8_OPERATION(op_5xy0)
+    CHIP8_OPERATION(op_6xkk)
+    CHIP8_OPERATION(op_7xkk)
+    CHIP8_OPERATION(op_8xy0)
+    CHIP8_OPERATION(op_8xy1)
+    CHIP8_OPERATION(op_8xy2)
+    CHIP8_OPERATION(op_8xy3)
+    CHIP8_OPERATION(op_8xy4)
+    CHIP8_OPERATION(op_8xy5)
+    CHIP8_QUIRK_OPERATION(op_8xy6)
+    CHIP8_OPERATION(op_8xy7)
+    CHIP8_QUIRK_OPERATION(op_8xyE)
+    CHIP8_OPERATION(op_9xy0)
+    CHIP8_OPERATION(op_Annn)
+    CHIP8_QUIRK_OPERATION(op_Bnnn)
+    CHIP8_OPERATION(op_Cxkk)
+    CHIP8_QUIRK_OPERATION(op_Dxyn)
+    CHIP8_OPERATION(op_Ex9E)
+    CHIP8_OPERATION(op_ExA1)
+    CHIP8_OPERATION(op_Fx07)
+    CHIP8_OPERATION(op_Fx0A)
+    CHIP8_OPERATION(op_Fx15)
+    CHIP8_OPERATION(op_Fx18)
+    CHIP8_OPERATION(op_Fx1E)
+    CHIP8_OPERATION(op_Fx29)
+    CHIP8_OPERATION(op_Fx33)
+    CHIP8_QUIRK_OPERATION(op_Fx55)
+    CHIP8_QUIRK_OPERATION(op_Fx65)
+    CHIP8_OPERATION(op_00Cn)
+    CHIP8_OPERATION(op_00FB)
+    CHIP8_OPERATION(op_00FC)
+    CHIP8_OPERATION(op_00FD)
+    CHIP8_OPERATION(op_00FE)
+    CHIP8_OPERATION(op_00FF)
+    CHIP8_OPERATION(op_Fx30)
+    CHIP8_OPERATION(op_Fx75)
+    CHIP8_OPERATION(op_Fx85)
+    CHIP8_OPERATION(op_00Dn)
+    CHIP8_OPERATION(op_5xy2)
+    CHIP8_OPERATION(op_5xy3)
+    CHIP8_OPERATION(op_F000)
+    CHIP8_OPERATION(op_Fx01)
+    CHIP8_OPERATION(op_unknown)
+
+#undef CHIP8_QUIRK_OPERATION
+#undef CHIP8_OPERATION
+  end:
+    ;
+#else
+    for (; it->op != Opcode::kNone; ++it) {
+      instruction_ = *it;
+      increment_pc();
+      Execute<Q>();
+    }
+#endif
+
+    // Only block ends can stop execution
+    if (stop_ != StopReason::kBudget && EndsRun(cycle))
+      break;
+
+    if (processor.pc <= pc && !--idle_countdown_)
+      cycle += SkipIdle(cycle, cycles);
+  }
+
+  return cycle;
+}
+
+const Emulator::Block& Emulator::GetBlock(uint16_t address) {
+  auto& block = blocks_[address];
+
+  if (block.length > 0)
+    return block;
+
+  // Safe, because no other block is executing while we translate
+  if (block_code_.size() > kMaxBlockCodeSize)
+    FlushBlocks();
+
+  block.offset = static_cast<uint32_t>(block_code_.size());
+
+  for (;;) {
+    auto& instruction = decoded_[address];
+    if (instruction.op == Opcode::kNone) {
+      instruction = Decode(memory[address] << 8 |
+                               memory[(address + 1) & address_mask_],
+                           dispatch_->extension);
+      MarkDecoded(address);
+    }
+    block_code_.push_back(instruction);
+    ++block.length;
+    address += 2;
+
+    if (IsBlockEnd(instruction.op) || block.length == kMaxBlockLength ||
+        address >= address_mask_) {
+      break;
+    }
+  }
+
+  block_code_.push_back(Instruction());
+
+  return block;
+}
+
+void Emulator::FlushBlocks() {
+  // Blocks only start at decoded addresses
+  std::fill_n(blocks_.begin(), decoded_end_, Block());
+  block_code_.clear();
+}
+
+void Emulator::FlushCode() {
+  FlushBlocks();
+  std::fill_n(decoded_.begin(), decoded_end_, Instruction());
+  decoded_begin_ = kXoChipMemorySize;
+  decoded_end_ = 0;
+  if (jit_ && jit_->owner() == this)
+    jit_->Flush();
+  if (aot_ && aot_->owner() == this)
+    aot_->Flush();
+}
+
+void Emulator::ScrollDown(uint8_t rows) {
+  ++side_effects_;
+  rows = std::min(rows, height());
+  for (uint8_t plane = 0; plane < kPlanes; ++plane) {
+    if (!(planes & (1 << plane)))
+      continue;
+    for (uint8_t column = 0; column < width() / 64; ++column) {
+      const auto first = display.begin() + GetDisplayIndex(plane, column, 0);
+      std::copy_backward(first, first + height() - rows, first + height());
+      std::fill(first, first + rows, 0);
+    }
+  }
+  dirty_rows_ = ~0ull;
+}
+
+void Emulator::ScrollUp(uint8_t rows) {
+  ++side_effects_;
+  rows = std::min(rows, height());
+  for (uint8_t plane = 0; plane < kPlanes; ++plane) {
+    if (!(planes & (1 << plane)))
+      continue;
+    for (uint8_t column = 0; column < width() / 64; ++column) {
+      const auto first = display.begin() + GetDisplayIndex(plane, column, 0);
+      std::copy(first + rows, first + height(), first);
+      std::fill(first + height() - rows, first + height(), 0);
+    }
+  }
+  dirty_rows_ = ~0ull;
+}
+
+void Emulator::ScrollRight() {
+  ++side_effects_;
+  for (uint8_t plane = 0; plane < kPlanes; ++plane) {
+    if (!(planes & (1 << plane)))
+      continue;
+    auto left = display.begin() + GetDisplayIndex(plane, 0, 0);
+    auto right = display.begin() + GetDisplayIndex(plane, 1, 0);
+    for (uint8_t y = 0; y < height(); ++y) {
+      if (hires)
+        right[y] = right[y] >> 4 | left[y] << 60;
+      left[y] >>= 4;
+    }
+  }
+  dirty_rows_ = ~0ull;
+}
+
+void Emulator::ScrollLeft() {
+  ++side_effects_;
+  for (uint8_t plane = 0; plane < kPlanes; ++plane) {
+    if (!(planes & (1 << plane)))
+      continue;
+    auto left = display.begin() + GetDisplayIndex(plane, 0, 0);
+    auto right = display.begin() + GetDisplayIndex(plane, 1, 0);
+    for (uint8_t y = 0; y < height(); ++y) {
+      left[y] <<= 4;
+      if (hires) {
+        left[y] |= right[y] >> 60;
+        right[y] <<= 4;
+      }
+    }
+  }
+  dirty_rows_ = ~0ull;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void Emulator::op_00E0() {  // CLS
-  display.fill(false);
+  ++side_effects_;
+  for (uint8_t plane = 0; plane < kPlanes; ++plane) {
+    if (!(planes & (1 << plane)))
+      continue;
+    const auto first = display.begin() + GetDisplayIndex(plane, 0, 0);
+    std::fill(first, first + kPlaneSize, 0);
+  }
+  // Every visible row, rather than a scan for the ones that had pixels
+  dirty_rows_ |= ~0ull >> (kHiResHeight - height());
 }
 
 void Emulator::op_00EE() {  // RET
   if (processor.sp > 0) {
     processor.pc = processor.stack[--processor.sp];
   } else {
-    std::cout << "Stack underflow\n";
+    stop_ = StopReason::kStackFault;  // underflow
   }
 }
 
@@ -185,23 +1251,23 @@ void Emulator::op_2nnn() {  // CALL addr
     processor.stack[processor.sp++] = processor.pc;
     processor.pc = get_addr();
   } else {
-    std::cout << "Stack overflow\n";
+    stop_ = StopReason::kStackFault;  // overflow
   }
 }
 
 void Emulator::op_3xkk() {  // SE Vx, byte
   if (vx() == get_byte())
-    increment_pc();
+    skip();
 }
 
 void Emulator::op_4xkk() {  // SNE Vx, byte
   if (vx() != get_byte())
-    increment_pc();
+    skip();
 }
 
 void Emulator::op_5xy0() {  // SE Vx, Vy
   if (vx() == vy())
-    increment_pc();
+    skip();
 }
 
 void Emulator::op_6xkk() {  // LD Vx, byte
@@ -229,63 +1295,140 @@ void Emulator::op_8xy3() {  // XOR Vx, Vy
 }
 
 void Emulator::op_8xy4() {  // ADD Vx, Vy
-  vx() += vy();
-  vf() = vx() > 0x00FF ? 1 : 0;
-  vx() &= 0x00FF;
+  const uint16_t sum = vx() + vy();
+  vx() = static_cast<uint8_t>(sum);
+  vf() = sum > 0x00FF ? 1 : 0;
 }
 
 void Emulator::op_8xy5() {  // SUB Vx, Vy
-  vf() = vx() > vy() ? 1 : 0;
+  const uint8_t flag = vx() > vy() ? 1 : 0;
   vx() -= vy();
+  vf() = flag;
 }
 
+template <typename Q>
 void Emulator::op_8xy6() {  // SHR Vx {, Vy}
-  vf() = vx() & 1 ? 1 : 0;
-  vx() >>= 1;
+  const uint8_t value = Q::kShiftVy ? vy() : vx();
+  vx() = value >> 1;
+  vf() = value & 1;
 }
 
 void Emulator::op_8xy7() {  // SUBN Vx, Vy
-  vf() = vy() > vx() ? 1 : 0;
+  const uint8_t flag = vy() > vx() ? 1 : 0;
   vx() = vy() - vx();
+  vf() = flag;
 }
 
+template <typename Q>
 void Emulator::op_8xyE() {  // SHL Vx {, Vy}
-  vf() = static_cast<uint16_t>(vx()) >> 15 ? 1 : 0;
-  vx() <<= 1;
+  const uint8_t value = Q::kShiftVy ? vy() : vx();
+  vx() = value << 1;
+  vf() = value >> 7;
 }
 
 void Emulator::op_9xy0() {  // SNE Vx, Vy
   if (vx() != vy())
-    increment_pc();
+    skip();
 }
 
 void Emulator::op_Annn() {  // LD I, addr
   processor.i = get_addr();
 }
 
+template <typename Q>
 void Emulator::op_Bnnn() {  // JP V0, addr
-  processor.pc = get_addr() + processor.v[0];
+  processor.pc = get_addr() + processor.v[Q::kJumpVx ? instruction_.x : 0];
 }
 
 void Emulator::op_Cxkk() {  // RND Vx, byte
-  std::random_device random_device;
-  std::mt19937 mt19937(random_device());
-  std::uniform_int_distribution<uint16_t> distribution(0, 255);
-  vx() = static_cast<uint8_t>(distribution(mt19937)) & get_byte();
+  ++side_effects_;
+  const uint8_t value = random_source_ ?
+      random_source_() : static_cast<uint8_t>(random_.Next() >> 24);
+  vx() = value & get_byte();
 }
 
+template <typename Q, bool HiRes, bool Wide>
+inline uint64_t Emulator::DrawPlane(uint8_t plane, uint16_t address,
+                                    uint8_t x, uint8_t y, uint8_t rows) {
+  constexpr uint8_t height = HiRes ? kHiResHeight : kDisplayHeight;
+  const uint8_t column = HiRes ? x / 64 : 0;
+  const uint8_t offset = x % 64;
+  uint64_t collision = 0;
+
+  for (uint8_t row = 0; row < rows; ++row) {
+    uint64_t sprite;
+    if (Wide) {
+      const uint16_t at = address + row * 2;
+      sprite = static_cast<uint64_t>(memory[at & Q::kAddressMask]) << 56 |
+               static_cast<uint64_t>(memory[(at + 1) & Q::kAddressMask])
+                   << 48;
+    } else {
+      sprite = static_cast<uint64_t>(
+                   memory[(address + row) & Q::kAddressMask]) << 56;
+    }
+
+    // The part of the row that does not fit into the first word spills
+    // into the next one, or wraps around to the left edge
+    const uint64_t head = sprite >> offset;
+    const uint64_t tail = sprite << (63 - offset) << 1;
+    const uint8_t line_y = (y + row) % height;
+    auto& line = display[GetDisplayIndex(plane, column, line_y)];
+    const uint64_t bits = HiRes || Q::kClipSprites ?
+        head : head | sprite << ((64 - offset) & 63);
+    collision |= line & bits;
+    line ^= bits;
+    if (HiRes && (column == 0 || !Q::kClipSprites)) {
+      auto& next = display[GetDisplayIndex(plane, column ^ 1, line_y)];
+      collision |= next & tail;
+      next ^= tail;
+    }
+    if (sprite)
+      dirty_rows_ |= 1ull << line_y;
+  }
+
+  return collision;
+}
+
+template <typename Q>
 void Emulator::op_Dxyn() {  // DRW Vx, Vy, nibble
-  bool collision = false;
-
-  for (uint8_t y = 0; y < get_nibble(); ++y) {
-    const auto sprite = memory[processor.i + y];
-    for (uint8_t x = 0; x < 8; ++x) {
-      const uint8_t pos_x = (vx() + x) % kDisplayWidth;
-      const uint8_t pos_y = (vy() + y) % kDisplayHeight;
-      auto& pixel = display[pos_x + (kDisplayWidth * pos_y)];
-      bool new_pixel = pixel ^ ((sprite >> (7 - x)) & 1);
-      collision |= pixel && !new_pixel;
-      pixel = new_pixel;
+  static_assert(kHiResHeight <= 64, "Rows must fit into the dirty mask");
+
+  ++side_effects_;
+
+  // Sprites that wrap around the edges of the screen have their rows rotated
+  // into place rather than shifted. Either way, only the position wraps.
+  const uint8_t x = vx() & (width() - 1);
+  const uint8_t y = vy() & (height() - 1);
+  // Dxy0 draws 16x16 sprites, two bytes per row, and nothing on CHIP-8
+  const bool wide = Q::kExtension != Extension::kNone && !get_nibble();
+  const uint8_t size = wide ? 16 : get_nibble();
+  const uint8_t rows = Q::kClipSprites ?
+      std::min<uint8_t>(size, height() - y) : size;
+  uint16_t address = processor.i;
+  uint64_t collision = 0;
+
+  // Plain CHIP-8 sprites take a path of their own, as the general one is
+  // noticeably slower for them
+  if (!hires && !wide && planes == 1) {
+    vf() = DrawPlane<Q, false, false>(0, address, x, y, rows) ? 1 : 0;
+    return;
+  }
+
+  // Each plane that is drawn to takes the next sprite in memory
+  for (uint8_t plane = 0; plane < kPlanes; ++plane) {
+    if (!(planes & (1 << plane)))
+      continue;
+    if (wide) {
+      collision |= hires ? DrawPlane<Q, true, true>(plane, address, x, y, rows)
+                         : DrawPlane<Q, false, true>(plane, address, x, y,
+                                                     rows);
+      address += size * 2;
+    } else {
+      collision |= hires ? DrawPlane<Q, true, false>(plane, address, x, y,
+                                                     rows)
+                         : DrawPlane<Q, false, false>(plane, address, x, y,
+                                                      rows);
+      address += size;
     }
   }
 
@@ -293,13 +1436,13 @@ void Emulator::op_Dxyn() {  // DRW Vx, Vy, nibble
 }
 
 void Emulator::op_Ex9E() {  // SKP Vx
-  if (input[vx()])
-    increment_pc();
+  if (vx() < input.size() && input[vx()])
+    skip();
 }
 
 void Emulator::op_ExA1() {  // SKNP Vx
-  if (!input[vx()])
-    increment_pc();
+  if (vx() >= input.size() || !input[vx()])
+    skip();
 }
 
 void Emulator::op_Fx07() {  // LD Vx, DT
@@ -313,7 +1456,8 @@ void Emulator::op_Fx0A() {  // LD Vx, K
       return;
     }
   }
-  processor.pc -= sizeof(instruction_);  // 2
+  processor.pc -= 2;
+  stop_ = StopReason::kWaitingForKey;
 }
 
 void Emulator::op_Fx15() {  // LD DT, Vx
@@ -321,6 +1465,8 @@ void Emulator::op_Fx15() {  // LD DT, Vx
 }
 
 void Emulator::op_Fx18() {  // LD ST, Vx
+  if ((processor.st > 0) != (vx() > 0))
+    stop_ = StopReason::kSoundTimer;
   processor.st = vx();
 }
 
@@ -333,41 +1479,137 @@ void Emulator::op_Fx29() {  // LD F, Vx
 }
 
 void Emulator::op_Fx33() {  // LD B, Vx
-  memory[processor.i + 0] = vx() / 100;
-  memory[processor.i + 1] = (vx() / 10) % 10;
-  memory[processor.i + 2] = vx() % 10;
+  Write(processor.i + 0, vx() / 100);
+  Write(processor.i + 1, (vx() / 10) % 10);
+  Write(processor.i + 2, vx() % 10);
+  Invalidate(processor.i, 3);
 }
 
+template <typename Q>
 void Emulator::op_Fx55() {  // LD [I], Vx
-  for (uint8_t j = 0; j <= ((instruction_ & 0x0F00) >> 8); ++j) {
-    memory[processor.i + j] = processor.v[j];
+  for (uint8_t j = 0; j <= instruction_.x; ++j) {
+    Write(processor.i + j, processor.v[j]);
   }
+  Invalidate(processor.i, instruction_.x + 1);
+  if (Q::kIncrementI)
+    processor.i += instruction_.x + 1;
 }
 
+template <typename Q>
 void Emulator::op_Fx65() {  // LD Vx, [I]
-  for (uint8_t j = 0; j <= ((instruction_ & 0x0F00) >> 8); ++j) {
-    processor.v[j] = memory[processor.i + j];
+  for (uint8_t j = 0; j <= instruction_.x; ++j) {
+    processor.v[j] = memory[(processor.i + j) & Q::kAddressMask];
+  }
+  if (Q::kIncrementI)
+    processor.i += instruction_.x + 1;
+}
+
+void Emulator::op_00Cn() {  // SCD nibble
+  ScrollDown(get_nibble());
+}
+
+void Emulator::op_00FB() {  // SCR
+  ScrollRight();
+}
+
+void Emulator::op_00FC() {  // SCL
+  ScrollLeft();
+}
+
+void Emulator::op_00FD() {  // EXIT
+  processor.pc -= 2;
+  stop_ = StopReason::kExit;
+}
+
+void Emulator::op_00FE() {  // LOW
+  ++side_effects_;
+  hires = false;
+  display.fill(0);
+  dirty_rows_ = ~0ull;
+}
+
+void Emulator::op_00FF() {  // HIGH
+  ++side_effects_;
+  hires = true;
+  display.fill(0);
+  dirty_rows_ = ~0ull;
+}
+
+void Emulator::op_Fx30() {  // LD HF, Vx
+  processor.i = kBigFontOffset + (vx() & 0xF) * kBigSpriteHeight;
+}
+
+void Emulator::op_Fx75() {  // LD R, Vx
+  ++side_effects_;
+  for (uint8_t j = 0; j <= instruction_.x; ++j) {
+    rpl[j] = processor.v[j];
+  }
+}
+
+void Emulator::op_Fx85() {  // LD Vx, R
+  for (uint8_t j = 0; j <= instruction_.x; ++j) {
+    processor.v[j] = rpl[j];
+  }
+}
+
+void Emulator::op_00Dn() {  // SCU nibble
+  ScrollUp(get_nibble());
+}
+
+void Emulator::op_5xy2() {  // LD [I], Vx-Vy
+  const int step = instruction_.x <= instruction_.y ? 1 : -1;
+  const uint8_t count = std::abs(instruction_.y - instruction_.x) + 1;
+  for (uint8_t j = 0; j < count; ++j) {
+    Write(processor.i + j, processor.v[instruction_.x + j * step]);
   }
+  Invalidate(processor.i, count);
+}
+
+void Emulator::op_5xy3() {  // LD Vx-Vy, [I]
+  const int step = instruction_.x <= instruction_.y ? 1 : -1;
+  const uint8_t count = std::abs(instruction_.y - instruction_.x) + 1;
+  for (uint8_t j = 0; j < count; ++j) {
+    processor.v[instruction_.x + j * step] =
+        memory[(processor.i + j) & address_mask_];
+  }
+}
+
+void Emulator::op_F000() {  // LD I, long
+  const uint16_t pc = processor.pc;
+  processor.i = memory[pc] << 8 | memory[(pc + 1) & address_mask_];
+  increment_pc();
+}
+
+void Emulator::op_Fx01() {  // PLANE x
+  ++side_effects_;
+  planes = instruction_.x & ((1 << kPlanes) - 1);
 }
 
 void Emulator::op_unknown() {
-  std::cout << "Unknown instruction: 0x" << std::hex << instruction_ << "\n";
+  stop_ = StopReason::kUnknownInstruction;
 }
 
 inline uint16_t Emulator::get_addr() const {
-  return static_cast<uint16_t>(instruction_ & 0x0FFF);
+  return instruction_.nnn;
 };
 
 inline uint8_t Emulator::get_byte() const {
-  return static_cast<uint8_t>(instruction_ & 0x00FF);
+  return instruction_.kk;
 };
 
 inline uint8_t Emulator::get_nibble() const {
-  return static_cast<uint8_t>(instruction_ & 0x000F);
+  return instruction_.n;
 };
 
 inline void Emulator::increment_pc() {
-  processor.pc += sizeof(instruction_);  // 2
+  processor.pc += 2;
+};
+
+inline void Emulator::skip() {
+  const uint16_t pc = processor.pc & address_mask_;
+  processor.pc += GetInstructionSize(memory[pc] << 8 |
+                                         memory[(pc + 1) & address_mask_],
+                                     dispatch_->extension);
 };
 
 inline uint8_t& Emulator::vf() {
@@ -375,11 +1617,11 @@ inline uint8_t& Emulator::vf() {
 };
 
 inline uint8_t& Emulator::vx()  {
-  return processor.v[(instruction_ & 0x0F00) >> 8];
+  return processor.v[instruction_.x];
 };
 
 inline uint8_t& Emulator::vy() {
-  return processor.v[(instruction_ & 0x00F0) >> 4];
+  return processor.v[instruction_.y];
 };
 
 }  // namespace chip8
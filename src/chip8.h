@@ -25,19 +25,58 @@ SOFTWARE.
 #pragma once
 
 #include <array>
+#include <bitset>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
+#ifdef CHIP8_PROFILE
+#include "profile.h"
+#endif
+
 namespace chip8 {
 
 constexpr uint8_t kDefaultSpriteHeight = 5;
+constexpr uint8_t kBigSpriteHeight = 10;
 constexpr uint8_t kDisplayHeight = 32;
 constexpr uint8_t kDisplayWidth = 64;
+constexpr uint8_t kHiResHeight = 64;  // SUPER-CHIP's high resolution mode
+constexpr uint8_t kHiResWidth = 128;
+constexpr uint8_t kDisplayColumns = kHiResWidth / 64;  // words per row
+constexpr uint8_t kPlanes = 2;  // XO-CHIP draws in up to four colours
+constexpr size_t kPlaneSize = kDisplayColumns * kHiResHeight;  // in words
+constexpr uint32_t kMemorySize = 0x1000;
+constexpr uint16_t kAddressMask = kMemorySize - 1;
+constexpr uint32_t kXoChipMemorySize = 0x10000;  // XO-CHIP's address space
+constexpr uint16_t kXoChipAddressMask = kXoChipMemorySize - 1;
+constexpr uint16_t kBigFontOffset = 0x50;  // after the small font
 constexpr uint16_t kProgramOffset = 0x200;
+constexpr uint16_t kMaxProgramSize = kMemorySize - kProgramOffset;
+constexpr uint16_t kXoChipMaxProgramSize = kXoChipMemorySize - kProgramOffset;
+constexpr uint16_t kMaxBlockLength = 32;  // in instructions
+constexpr uint32_t kDefaultCyclesPerFrame = 8;  // about 500 Hz at 60 FPS
+constexpr size_t kMaxSoundWrites = 4;  // per frame
+constexpr uint64_t kDefaultSeed = 0x853C49E6748FEA9B;
 
-typedef std::array<bool, kDisplayWidth * kDisplayHeight> display_t;
+// Each plane is stored as columns of 64-bit words, one word per row, the
+// most significant bit being the leftmost pixel. The low resolution mode only
+// uses the first kDisplayHeight words of a plane, so that scrolls and clears
+// are a few word operations in either mode.
+typedef std::array<uint64_t, kPlanes * kPlaneSize> display_t;
 typedef std::array<bool, 16> input_t;
-typedef std::array<uint8_t, 4096> memory_t;
+typedef std::array<uint8_t, kMemorySize> memory_t;
+typedef std::array<uint8_t, 16 * kDefaultSpriteHeight> font_t;
+typedef std::array<uint8_t, 16 * kBigSpriteHeight> big_font_t;
+
+extern const font_t kFont;  // hexadecimal digits, loaded at address 0
+extern const big_font_t kBigFont;  // loaded at kBigFontOffset
+
+// Index of the word that holds pixels [64 * column, 64 * column + 63] of a row
+constexpr size_t GetDisplayIndex(uint8_t plane, uint8_t column, uint8_t y) {
+  return plane * kPlaneSize + column * kHiResHeight + y;
+}
 
 struct Processor {
   std::array<uint8_t, 16> v;       // 8-bit registers
@@ -49,25 +88,327 @@ struct Processor {
   uint8_t st = 0;                  // sound timer
 };
 
+enum class Opcode : uint8_t {
+  kNone,  // not decoded yet
+  k00E0, k00EE, k1nnn, k2nnn, k3xkk, k4xkk, k5xy0, k6xkk, k7xkk,
+  k8xy0, k8xy1, k8xy2, k8xy3, k8xy4, k8xy5, k8xy6, k8xy7, k8xyE,
+  k9xy0, kAnnn, kBnnn, kCxkk, kDxyn, kEx9E, kExA1,
+  kFx07, kFx0A, kFx15, kFx18, kFx1E, kFx29, kFx33, kFx55, kFx65,
+  // SUPER-CHIP
+  k00Cn, k00FB, k00FC, k00FD, k00FE, k00FF, kFx30, kFx75, kFx85,
+  // XO-CHIP
+  k00Dn, k5xy2, k5xy3, kF000, kFx01,
+  kUnknown,
+};
+
+// Decoded form of a 16-bit instruction with its operands pre-extracted
+struct Instruction {
+  uint16_t code = 0x0000;         // raw instruction
+  uint16_t nnn = 0;               // 12-bit address
+  uint8_t kk = 0;                 // 8-bit byte
+  uint8_t n = 0;                  // 4-bit nibble
+  uint8_t x = 0;                  // register index
+  uint8_t y = 0;                  // register index
+  Opcode op = Opcode::kNone;
+};
+
+// Instructions beyond the original set, each extension including the ones
+// before it
+enum class Extension {
+  kNone,
+  kSuperChip,  // display modes, scrolling, 16x16 sprites and user flags
+  kXoChip,     // bitplanes, register ranges and 16-bit addresses
+};
+
+// Only XO-CHIP addresses more than kMemorySize bytes
+constexpr uint32_t GetMemorySize(Extension extension) {
+  return extension == Extension::kXoChip ? kXoChipMemorySize : kMemorySize;
+}
+
+// Instructions of a larger set than `extension` decode as Opcode::kUnknown
+Instruction Decode(uint16_t code, Extension extension = Extension::kXoChip);
+bool IsBlockEnd(Opcode op);
+// In bytes. F000 nnnn is the only instruction that takes four.
+uint8_t GetInstructionSize(uint16_t code,
+                           Extension extension = Extension::kXoChip);
+
+// Fails if the file cannot be read or is too large to load
+bool ReadProgram(const std::string& path, std::vector<uint8_t>& program);
+// Identifies a program in movies, analysis caches and recompiled code
+uint64_t HashProgram(const std::vector<uint8_t>& program);
+
+enum class Executor {
+  kInterpreter,  // decodes and executes one instruction per dispatch
+  kThreaded,     // executes basic blocks of pre-decoded instructions
+  kJit,          // compiles hot basic blocks to native code
+  kAot,          // runs basic blocks recompiled ahead of time to C++
+};
+
+// Behaviours that CHIP-8 interpreters disagree on, resolved at compile time so
+// that each profile gets handlers without any quirk checks
+template <bool ShiftVy, bool IncrementI, bool JumpVx, bool ClipSprites,
+          Extension Ext>
+struct Quirks {
+  static constexpr bool kShiftVy = ShiftVy;          // 8xy6 and 8xyE shift Vy
+  static constexpr bool kIncrementI = IncrementI;    // Fx55 and Fx65 move I
+  static constexpr bool kJumpVx = JumpVx;            // Bxnn adds Vx, not V0
+  static constexpr bool kClipSprites = ClipSprites;  // rather than wrap
+  static constexpr Extension kExtension = Ext;       // instructions decoded
+  static constexpr uint16_t kAddressMask = GetMemorySize(Ext) - 1;
+};
+
+// Cowgod's reference
+typedef Quirks<false, false, false, false, Extension::kNone> Chip8Quirks;
+// The COSMAC VIP
+typedef Quirks<true, true, false, true, Extension::kNone> CosmacQuirks;
+// SUPER-CHIP 1.1
+typedef Quirks<false, false, true, true, Extension::kSuperChip>
+    SuperChipQuirks;
+// XO-CHIP
+typedef Quirks<true, true, false, false, Extension::kXoChip> XoChipQuirks;
+
+enum class QuirkProfile {
+  kChip8,
+  kCosmac,
+  kSuperChip,
+  kXoChip,
+};
+
+// Accepts "chip8", "cosmac", "schip" and "xochip"
+bool ParseQuirkProfile(const std::string& name, QuirkProfile& quirks);
+
+// PCG32, a small and fast generator whose whole state is a single word
+class Random {
+public:
+  explicit Random(uint64_t seed = kDefaultSeed);
+
+  void Seed(uint64_t seed);
+  uint32_t Next();
+
+  uint64_t state() const;
+  void set_state(uint64_t state);
+
+private:
+  friend class Jit;
+
+  uint64_t state_ = 0;
+};
+
+enum class StopReason {
+  kBudget,              // all requested instructions were executed
+  kWaitingForKey,       // Fx0A is waiting for a key press, for the whole run
+  kUnknownInstruction,
+  kStackFault,          // stack overflow or underflow
+  kBreakpoint,          // the next instruction is at a breakpoint
+  kExit,                // 00FD ended the program
+  kSoundTimer,          // Fx18 started or stopped the tone, never returned
+};
+
+// A write to the sound timer that started or stopped the tone
+struct SoundWrite {
+  uint32_t cycle;  // instructions into the frame, including Fx18 itself
+  uint8_t value;
+};
+
+class Aot;
+class Jit;
+
 struct Machine {
   display_t display;
   input_t input;
-  memory_t memory;
+  std::vector<uint8_t> memory;  // GetMemorySize() of the profile's extension
+  Processor processor;
+  bool hires = false;  // 128x64 rather than 64x32
+  uint8_t planes = 1;  // mask of the planes that are drawn to
+  std::array<uint8_t, 16> rpl;  // SUPER-CHIP's persistent user flags
+};
+
+constexpr uint32_t kStateMagic = 0x38504843;  // "CHP8" in little endian
+constexpr uint32_t kStateVersion = 1;
+
+// Everything that determines how an emulator continues, as a flat blob in
+// host byte order. Settings such as the executor, breakpoints and cycles per
+// frame are not included. Only XO-CHIP programs need the larger memory.
+template <uint32_t MemorySize>
+struct BasicState {
+  uint32_t magic = kStateMagic;
+  uint32_t version = kStateVersion;
+  uint64_t cycles = 0;
+  uint64_t seed = 0;
+  uint64_t random = 0;               // generator state
+  uint16_t instruction = 0x0000;     // last executed instruction
+  uint16_t program_size = 0;
+  display_t display;
+  input_t input;
   Processor processor;
+  bool hires = false;
+  uint8_t planes = 1;
+  std::array<uint8_t, 16> rpl;
+  uint32_t memory_end = 0;  // memory past it is zero
+  std::array<uint8_t, MemorySize> memory{};
+  std::array<uint8_t, MemorySize - kProgramOffset> program;
 };
 
+typedef BasicState<kMemorySize> State;
+typedef BasicState<kXoChipMemorySize> XoChipState;
+
 class Emulator : public Machine {
 public:
+  explicit Emulator(Executor executor = Executor::kInterpreter,
+                    QuirkProfile quirks = QuirkProfile::kChip8);
+
   void Cycle();
   void UpdateTimers();
+
+  // Executes up to `cycles` instructions and tells why it stopped. The
+  // instruction that causes a stop is executed, unless it is a breakpoint.
+  StopReason RunCycles(uint32_t cycles);
+  // Executes one frame worth of instructions, then updates the timers
+  StopReason RunFrame();
+
+  // Fails if the program does not fit into memory, so the profile of an
+  // XO-CHIP program must be set first
   bool Load(const std::vector<uint8_t>& program);
   void Reset();
   void Restart();
 
-  bool GetPixel(uint8_t x, uint8_t y) const;
+  // Neither allocates. Restoring only invalidates the memory that differs, so
+  // it is cheapest between states of the same program. Saving fails if the
+  // machine does not fit into the state, which takes an XoChipState once an
+  // XO-CHIP program uses more than kMemorySize bytes. Restoring fails if the
+  // state was saved by an incompatible version, does not fit into memory, or
+  // has a stack pointer or planes that the profile cannot have.
+  template <uint32_t MemorySize>
+  bool SaveState(BasicState<MemorySize>& state) const;
+  template <uint32_t MemorySize>
+  bool LoadState(const BasicState<MemorySize>& state);
+
+  // Size of the display in the current mode
+  uint8_t width() const;
+  uint8_t height() const;
+
+  // Pixels are a mask of the planes that are set
+  uint8_t GetPixel(uint8_t x, uint8_t y) const;
+  uint64_t GetRow(uint8_t y, uint8_t column = 0, uint8_t plane = 0) const;
+
+  // One bit per display row that has changed since the last clear
+  uint64_t dirty_rows() const;
+  void ClearDirtyRows();
   void SetKey(uint8_t key, bool pressed);
 
+  // Execution stops before the instruction at a breakpoint, unless it is the
+  // first one to be executed. Setting any breakpoint makes every executor
+  // step one instruction at a time.
+  void SetBreakpoint(uint16_t address, bool enabled = true);
+  void ClearBreakpoints();
+
+  // RND draws from a generator seeded by Seed(), and reseeded by Reset(), so
+  // runs are reproducible. A custom source replaces it until it is cleared.
+  void Seed(uint64_t seed);
+  uint64_t seed() const;
+  void SetRandomSource(std::function<uint8_t()> source);
+
+  // Selects the handlers that were instantiated for the profile. Can be
+  // changed at any time. Switching to a profile with another instruction set
+  // drops decoded and translated code.
+  QuirkProfile quirks() const;
+  void set_quirks(QuirkProfile quirks);
+
+  uint64_t cycles() const;
+  uint32_t cycles_per_frame() const;
+  void set_cycles_per_frame(uint32_t cycles);
+
+  // Loops that would repeat the same state until the end of a run are
+  // skipped, as neither the timers nor the input can change before then.
+  // Cycles are counted as if every iteration had been executed, as are those
+  // left in a run that waits for a key.
+  uint64_t idle_cycles() const;  // skipped since the last reset
+  bool idle() const;  // whether the last run ended idle or waiting for a key
+
+  // Since the timers were last updated, so that the tone can be started and
+  // stopped within a frame. Past kMaxSoundWrites, the last one is replaced.
+  const std::vector<SoundWrite>& sound_writes() const;
+
+  // Must be called after writing to `memory` directly, so that stale
+  // instructions are dropped from the decode cache.
+  void Invalidate(uint16_t address, size_t length);
+
+  // Returns nullptr unless the emulator was constructed with Executor::kJit
+  Jit* jit();
+  // Returns nullptr unless the emulator was constructed with Executor::kAot
+  Aot* aot();
+
+#ifdef CHIP8_PROFILE
+  // While profiling, every executor steps one instruction at a time
+  Profile& profile();
+#endif
+
 private:
+  friend class Aot;
+  friend class Jit;
+
+  struct Block {
+    uint32_t offset = 0;  // index of the first instruction in block_code_
+    uint16_t length = 0;  // number of instructions, 0 if not translated
+  };
+
+  // Machine state after a backward jump, to be compared with the next one
+  struct Idle {
+    bool valid = false;
+    Processor processor;
+    uint32_t cycle = 0;
+    uint32_t side_effects = 0;
+  };
+
+  // Entry points of one quirk profile
+  struct Dispatch {
+    void (Emulator::*cycle)();
+    void (Emulator::*execute)();
+    uint32_t (Emulator::*run_interpreter)(uint32_t cycles);
+    uint32_t (Emulator::*run_threaded)(uint32_t cycles);
+    Extension extension;
+    bool shift_vy;  // the quirks, for code that is generated at run time
+    bool increment_i;
+    bool jump_vx;
+  };
+
+  template <typename Q> static const Dispatch& Specialize();
+
+  // Forward to the current profile
+  void Execute();
+  uint32_t RunInterpreter(uint32_t cycles);
+  uint32_t RunThreaded(uint32_t cycles);
+
+  template <typename Q> void Cycle();
+  template <typename Q> void Execute();
+  template <typename Q> uint32_t RunInterpreter(uint32_t cycles);
+  template <typename Q> uint32_t RunThreaded(uint32_t cycles);
+
+  void Write(uint16_t address, uint8_t value);
+  void MarkDecoded(uint32_t address);  // extends the decoded range
+  const Block& GetBlock(uint16_t address);
+  void FlushBlocks();
+  void FlushCode();  // decoded instructions and translated blocks
+
+  // Draws one plane of a sprite, and returns the pixels that collided
+  template <typename Q, bool HiRes, bool Wide>
+  uint64_t DrawPlane(uint8_t plane, uint16_t address, uint8_t x, uint8_t y,
+                     uint8_t rows);
+
+  // Scroll the planes that are drawn to, by pixels of the current mode
+  void ScrollDown(uint8_t rows);
+  void ScrollUp(uint8_t rows);
+  void ScrollRight();  // by 4
+  void ScrollLeft();   // by 4
+
+  // Returns how many of the remaining cycles can be skipped. Must be called
+  // after backward jumps, with the cycles executed so far in the same run,
+  // once idle_countdown_ runs out.
+  uint32_t SkipIdle(uint32_t cycle, uint32_t cycles);
+  // Must be called when stop_ is set, with the cycles executed so far in the
+  // same run. Returns false for stops that the run goes on from.
+  bool EndsRun(uint32_t cycle);
+
   void op_00E0();
   void op_00EE();
   void op_1nnn();
@@ -83,14 +424,14 @@ private:
   void op_8xy3();
   void op_8xy4();
   void op_8xy5();
-  void op_8xy6();
+  template <typename Q> void op_8xy6();
   void op_8xy7();
-  void op_8xyE();
+  template <typename Q> void op_8xyE();
   void op_9xy0();
   void op_Annn();
-  void op_Bnnn();
+  template <typename Q> void op_Bnnn();
   void op_Cxkk();
-  void op_Dxyn();
+  template <typename Q> void op_Dxyn();
   void op_Ex9E();
   void op_ExA1();
   void op_Fx07();
@@ -100,20 +441,75 @@ private:
   void op_Fx1E();
   void op_Fx29();
   void op_Fx33();
-  void op_Fx55();
-  void op_Fx65();
+  template <typename Q> void op_Fx55();
+  template <typename Q> void op_Fx65();
+  void op_00Cn();
+  void op_00FB();
+  void op_00FC();
+  void op_00FD();
+  void op_00FE();
+  void op_00FF();
+  void op_Fx30();
+  void op_Fx75();
+  void op_Fx85();
+  void op_00Dn();
+  void op_5xy2();
+  void op_5xy3();
+  void op_F000();
+  void op_Fx01();
   void op_unknown();
 
   inline uint16_t get_addr() const;
   inline uint8_t get_byte() const;
   inline uint8_t get_nibble() const;
   inline void increment_pc();
+  inline void skip();
   inline uint8_t& vf();
   inline uint8_t& vx();
   inline uint8_t& vy();
 
-  uint16_t instruction_ = 0x0000;
-  std::vector<uint8_t> program_;
+  Instruction instruction_;
+  std::vector<Instruction> decoded_;  // one per byte of memory
+  // Every instruction decoded or translated since the last flush starts in
+  // [decoded_begin_, decoded_end_), so neither decoded_ nor blocks_ needs
+  // clearing past it, and stores elsewhere need not invalidate anything
+  uint32_t decoded_begin_ = kXoChipMemorySize;
+  uint32_t decoded_end_ = 0;
+  // Memory past it is zero, so that resets and states can skip it
+  uint32_t memory_end_ = kMemorySize;
+  uint16_t address_mask_ = kAddressMask;  // of the current memory size
+
+  uint64_t dirty_rows_ = 0;
+  uint64_t seed_ = kDefaultSeed;
+  Random random_;
+  std::function<uint8_t()> random_source_;
+  uint64_t cycles_ = 0;
+  uint32_t cycles_per_frame_ = kDefaultCyclesPerFrame;
+  StopReason stop_ = StopReason::kBudget;
+  std::bitset<kXoChipMemorySize> breakpoints_;
+  bool has_breakpoints_ = false;
+
+  Idle idle_;
+  uint32_t idle_countdown_ = 1;  // backward jumps until the next check
+  uint32_t idle_backoff_ = 1;
+  uint32_t side_effects_ = 0;  // drawing, memory writes and RND
+  uint64_t idle_cycles_ = 0;
+  bool idle_run_ = false;
+  uint64_t frame_start_ = 0;  // cycles when the timers were last updated
+  std::vector<SoundWrite> sound_writes_;
+
+  Executor executor_;
+  QuirkProfile quirks_ = QuirkProfile::kChip8;
+  const Dispatch* dispatch_ = nullptr;
+  std::vector<Block> blocks_;  // one per byte of memory, by start address
+  std::vector<Instruction> block_code_;
+  std::shared_ptr<Jit> jit_;  // owned by the emulator it was created for
+  std::shared_ptr<Aot> aot_;  // likewise
+  std::vector<uint8_t> program_;  // reserved up to the largest that fits
+
+#ifdef CHIP8_PROFILE
+  Profile profile_;
+#endif
 };
 
 }  // namespace chip8
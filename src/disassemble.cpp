@@ -0,0 +1,158 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Prints a listing of a program with its basic blocks, subroutines, sprites
+// and self-modifying stores, followed by its call graph.
+//
+// Usage: disassemble <program> [--cache=DIR]
+//   --cache=DIR  reuse the analysis stored in DIR, or store it there
+
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "analysis.h"
+#include "chip8.h"
+
+static std::string Format(const char* format, unsigned value) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), format, value);
+  return buffer;
+}
+
+// One character per pixel, as in a sprite
+static std::string Pixels(uint8_t byte) {
+  std::string pixels;
+  for (int bit = 7; bit >= 0; --bit)
+    pixels += (byte >> bit) & 1 ? '#' : '.';
+  return pixels;
+}
+
+int main(int argc, char const *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <program> [--cache=DIR]\n";
+    return 1;
+  }
+
+  const std::string path = argv[1];
+  std::vector<uint8_t> program;
+  if (!chip8::ReadProgram(path, program)) {
+    std::cerr << "Cannot read program: " << path << "\n";
+    return 1;
+  }
+
+  chip8::Analysis analysis;
+  const std::string cache = "--cache=";
+  if (argc > 2 && std::string(argv[2]).compare(0, cache.size(), cache) == 0) {
+    chip8::AnalyzeCached(program, argv[2] + cache.size(), analysis);
+  } else {
+    chip8::Analyze(program, analysis);
+  }
+
+  std::map<uint16_t, const chip8::Store*> stores;
+  for (const auto& store : analysis.stores)
+    stores[store.address] = &store;
+
+  std::cout << "; " << path.substr(path.find_last_of("/\\") + 1) << ", "
+            << program.size() << " bytes, "
+            << analysis.blocks.size() << " basic blocks, "
+            << analysis.calls.size() << " calls\n";
+  if (analysis.indirect_jumps)
+    std::cout << "; uses indirect jumps, some code may not be found\n";
+  if (analysis.self_modifying())
+    std::cout << "; may modify its own code\n";
+
+  for (size_t offset = 0; offset < program.size(); ) {
+    const auto address = static_cast<uint16_t>(chip8::kProgramOffset + offset);
+    const uint8_t flags = analysis.flags[offset];
+
+    if (flags & chip8::kFlagSubroutine) {
+      std::cout << "\nsub_" << Format("%03X", address) << ":\n";
+    } else if (flags & chip8::kFlagEntry) {
+      std::cout << "\nloc_" << Format("%03X", address) << ":\n";
+    }
+
+    std::string line = "  " + Format("%03X", address) + "  ";
+    std::string comment;
+
+    if (flags & chip8::kFlagCode) {
+      const uint16_t code = program[offset] << 8 | program[offset + 1];
+      size_t size = chip8::GetInstructionSize(code);
+      if (offset + size > program.size())
+        size = 2;  // the operand is cut off
+      if (size == 4) {
+        const unsigned operand = program[offset + 2] << 8 | program[offset + 3];
+        line += Format("%04X", code) + Format("%04X", operand) + "  LD I, " +
+                Format("0x%04X", operand);
+      } else {
+        line += Format("%04X", code) + "  " +
+                chip8::Disassemble(chip8::Decode(code));
+      }
+
+      const auto it = stores.find(address);
+      if (it != stores.end() && it->second->modifies_code) {
+        comment = it->second->known ?
+            "modifies code at " + Format("%03X", it->second->target) :
+            "may modify code";
+      }
+      if ((flags | analysis.flags[offset + 1]) & chip8::kFlagWritten)
+        comment += comment.empty() ? "overwritten" : ", overwritten";
+      offset += size;
+    } else {
+      line += Format("%02X", program[offset]) + "    DB 0x" +
+              Format("%02X", program[offset]);
+      if (flags & chip8::kFlagSprite) {
+        comment = Pixels(program[offset]);
+      } else if (flags & chip8::kFlagData) {
+        comment = "data";
+      } else if (flags & chip8::kFlagWritten) {
+        comment = "variable";
+      }
+      offset += 1;
+    }
+
+    if (!comment.empty())
+      line.append(std::max<size_t>(line.size() + 1, 32) - line.size(), ' ')
+          .append("; " + comment);
+    std::cout << line << "\n";
+  }
+
+  if (!analysis.calls.empty()) {
+    std::map<uint16_t, std::vector<uint16_t>> callers;
+    for (const auto& call : analysis.calls)
+      callers[call.target].push_back(call.address);
+
+    std::cout << "\n; Calls\n";
+    for (const auto& it : callers) {
+      std::cout << ";   sub_" << Format("%03X", it.first) << " <-";
+      for (const auto caller : it.second)
+        std::cout << " " << Format("%03X", caller);
+      std::cout << "\n";
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,310 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Runs a program without a display or audio device, as fast as possible, and
+// prints the speed and a hash of the final display. Given several programs,
+// or --jobs, runs each of them as a job on a thread pool and prints the
+// results along with the overall speed.
+//
+// Usage: headless <program>... [options]
+//   --frames=N     run N frames (default 600)
+//   --cycles=N     run N instructions instead, updating timers every frame
+//   --cycles-per-frame=N
+//                  instructions between timer updates (default 8)
+//   --executor=E   interpreter, threaded (default), jit or aot (needs the
+//                  program's chip8-recompile output linked in)
+//   --quirks=Q     chip8 (default), cosmac, schip or xochip
+//   --seed=N       seed for RND
+//   --folded=PATH  write folded call stacks for flame graphs (needs a core
+//                  built with CHIP8_PROFILE, which also prints a report)
+//   --wav=PATH     write what the buzzer plays while running frames
+//   --jobs=N       worker threads for several programs (default 0, one per
+//                  hardware thread)
+//   --cache=DIR    with the jit executor, compile the program's blocks before
+//                  running, from its analysis stored in DIR (or stored there)
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "analysis.h"
+#include "aot.h"
+#include "audio.h"
+#include "chip8.h"
+#include "jit.h"
+#include "runner.h"
+
+static const char* GetReasonName(chip8::StopReason reason) {
+  switch (reason) {
+    case chip8::StopReason::kBudget:
+      return "budget";
+    case chip8::StopReason::kWaitingForKey:
+      return "waiting for key";
+    case chip8::StopReason::kUnknownInstruction:
+      return "unknown instruction";
+    case chip8::StopReason::kStackFault:
+      return "stack fault";
+    case chip8::StopReason::kBreakpoint:
+      return "breakpoint";
+    case chip8::StopReason::kExit:
+      return "exit";
+    case chip8::StopReason::kSoundTimer:
+      return "sound timer";
+  }
+  return "unknown";
+}
+
+static bool GetOption(const std::string& arg, const std::string& name,
+                      std::string& value) {
+  const std::string prefix = "--" + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  value = arg.substr(prefix.size());
+  return true;
+}
+
+// Runs every program as a job of `prototype`
+static int RunJobs(const std::vector<std::string>& paths, size_t threads,
+                   const chip8::Job& prototype) {
+  std::vector<chip8::Job> jobs(paths.size(), prototype);
+  for (size_t j = 0; j < paths.size(); ++j) {
+    if (!chip8::ReadProgram(paths[j], jobs[j].program)) {
+      std::cerr << "Cannot read program: " << paths[j] << "\n";
+      return 1;
+    }
+  }
+
+  chip8::Runner runner(threads);
+  std::vector<chip8::Result> results;
+  const auto summary = runner.Run(jobs, results);
+
+  int status = 0;
+  for (size_t j = 0; j < paths.size(); ++j) {
+    const auto& result = results[j];
+    std::cout << paths[j] << ": ";
+    if (!result.loaded) {
+      std::cout << "does not fit into memory\n";
+      status = 1;
+      continue;
+    }
+    std::cout << result.cycles << " instructions ("
+              << result.idle_cycles << " skipped), stopped: "
+              << GetReasonName(result.reason)
+              << ", display hash " << std::hex << result.display_hash
+              << std::dec << "\n";
+  }
+
+  std::cout << "Jobs: " << summary.jobs << "\n"
+            << "Instructions: " << summary.cycles << " ("
+            << summary.idle_cycles << " skipped in idle loops)\n"
+            << "Seconds: " << summary.seconds << "\n"
+            << "Instructions/s: " << summary.mips * 1000000.0
+            << " executed\n";
+  return status;
+}
+
+int main(int argc, char const *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <program>... [--frames=N] "
+              << "[--cycles=N] [--cycles-per-frame=N] [--executor=E] "
+              << "[--quirks=Q] [--seed=N] [--wav=PATH] [--jobs=N] "
+              << "[--cache=DIR]\n";
+    return 1;
+  }
+
+  uint64_t frames = 600;
+  uint64_t cycles = 0;
+  uint32_t cycles_per_frame = chip8::kDefaultCyclesPerFrame;
+  auto executor = chip8::Executor::kThreaded;
+  auto quirks = chip8::QuirkProfile::kChip8;
+  uint64_t seed = chip8::kDefaultSeed;
+  std::string folded;
+  std::string wav;
+  std::string cache;
+  std::vector<std::string> paths;
+  bool batch = false;
+  size_t threads = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    std::string value;
+    if (arg.compare(0, 2, "--") != 0) {
+      paths.push_back(arg);
+    } else if (GetOption(arg, "frames", value)) {
+      frames = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (GetOption(arg, "cycles-per-frame", value)) {
+      cycles_per_frame = std::strtoul(value.c_str(), nullptr, 10);
+    } else if (GetOption(arg, "cycles", value)) {
+      cycles = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (GetOption(arg, "seed", value)) {
+      seed = std::strtoull(value.c_str(), nullptr, 0);
+    } else if (GetOption(arg, "folded", value)) {
+      folded = value;
+    } else if (GetOption(arg, "wav", value)) {
+      wav = value;
+    } else if (GetOption(arg, "cache", value)) {
+      cache = value;
+    } else if (GetOption(arg, "jobs", value)) {
+      threads = std::strtoul(value.c_str(), nullptr, 10);
+      batch = true;
+    } else if (GetOption(arg, "executor", value)) {
+      if (value == "interpreter") {
+        executor = chip8::Executor::kInterpreter;
+      } else if (value == "threaded") {
+        executor = chip8::Executor::kThreaded;
+      } else if (value == "jit") {
+        executor = chip8::Executor::kJit;
+      } else if (value == "aot") {
+        executor = chip8::Executor::kAot;
+      } else {
+        std::cerr << "Unknown executor: " << value << "\n";
+        return 1;
+      }
+    } else if (GetOption(arg, "quirks", value)) {
+      if (!chip8::ParseQuirkProfile(value, quirks)) {
+        std::cerr << "Unknown quirks: " << value << "\n";
+        return 1;
+      }
+    } else {
+      std::cerr << "Unknown option: " << arg << "\n";
+      return 1;
+    }
+  }
+
+  if (paths.empty()) {
+    std::cerr << "No program given\n";
+    return 1;
+  }
+
+  if (batch || paths.size() > 1) {
+    if (!wav.empty() || !folded.empty() || !cache.empty()) {
+      std::cerr << "--wav, --folded and --cache take a single program\n";
+      return 1;
+    }
+    chip8::Job prototype;
+    prototype.cycles = cycles ? cycles : frames * cycles_per_frame;
+    prototype.executor = executor;
+    prototype.quirks = quirks;
+    prototype.seed = seed;
+    prototype.cycles_per_frame = cycles_per_frame;
+    return RunJobs(paths, threads, prototype);
+  }
+
+  const auto& path = paths.front();
+  std::vector<uint8_t> program;
+  if (!chip8::ReadProgram(path, program)) {
+    std::cerr << "Cannot read program: " << path << "\n";
+    return 1;
+  }
+
+  chip8::Emulator emulator(executor, quirks);
+  emulator.Seed(seed);
+  emulator.set_cycles_per_frame(cycles_per_frame);
+  emulator.Reset();
+  if (!emulator.Load(program)) {
+    std::cerr << "Program does not fit into memory: " << path << "\n";
+    return 1;
+  }
+  if (emulator.aot() && !emulator.aot()->available())
+    std::cerr << "No recompiled code for this program, running threaded\n";
+  if (!cache.empty() && emulator.jit()) {
+    chip8::Analysis analysis;
+    chip8::AnalyzeCached(program, cache, analysis);
+    if (!emulator.jit()->Precompile(analysis))
+      std::cerr << "Cannot precompile this program, compiling as it runs\n";
+  }
+
+  // Samples are rendered as each frame ends, the same as the audio callback
+  // would if it were always on time
+  chip8::Audio audio;
+  chip8::WavWriter writer;
+  std::vector<int16_t> samples(audio.sample_rate() / chip8::kTimerRate + 1);
+  uint64_t rendered = 0;
+  if (!wav.empty() && !writer.Open(wav, audio.sample_rate())) {
+    std::cerr << "Cannot write audio: " << wav << "\n";
+    return 1;
+  }
+
+  auto reason = chip8::StopReason::kBudget;
+  const auto start = std::chrono::steady_clock::now();
+
+  if (cycles) {
+    reason = chip8::RunScript(emulator, {}, cycles);
+  } else {
+    for (uint64_t frame = 0; frame < frames; ++frame) {
+      if (wav.empty()) {
+        reason = emulator.RunFrame();
+      } else {
+        reason = emulator.RunCycles(emulator.cycles_per_frame());
+        audio.Push(emulator);
+        emulator.UpdateTimers();
+        const uint64_t total =
+            (frame + 1) * audio.sample_rate() / chip8::kTimerRate;
+        audio.Render(samples.data(), total - rendered);
+        writer.Write(samples.data(), total - rendered);
+        rendered = total;
+      }
+      if (reason != chip8::StopReason::kBudget &&
+          reason != chip8::StopReason::kWaitingForKey) {
+        break;
+      }
+    }
+  }
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  // Skipped instructions take no time, so they are left out of the speed
+  const uint64_t executed = emulator.cycles() - emulator.idle_cycles();
+  std::cout << "Instructions: " << emulator.cycles() << " ("
+            << emulator.idle_cycles() << " skipped in idle loops)\n"
+            << "Seconds: " << elapsed.count() << "\n"
+            << "Instructions/s: "
+            << (elapsed.count() > 0.0 ? executed / elapsed.count() : 0.0)
+            << " executed\n"
+            << "Stopped: " << GetReasonName(reason) << "\n"
+            << "Display hash: " << std::hex
+            << chip8::HashDisplay(emulator.display) << std::dec << "\n";
+  if (emulator.aot() && emulator.aot()->available()) {
+    std::cout << "Interpreted outside of recompiled blocks: "
+              << emulator.aot()->interpreted() << "\n";
+  }
+
+#ifdef CHIP8_PROFILE
+  std::cout << "\n";
+  emulator.profile().WriteReport(std::cout);
+  if (!folded.empty()) {
+    std::ofstream os(folded);
+    emulator.profile().WriteFoldedStacks(os);
+  }
+#else
+  if (!folded.empty())
+    std::cerr << "Profiling is not enabled, build with CHIP8_PROFILE\n";
+#endif
+
+  return 0;
+}
@@ -0,0 +1,681 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHIP8_JIT_X64 1
+#endif
+
+#if defined(CHIP8_JIT_X64)
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+#include "analysis.h"
+#include "jit.h"
+
+namespace chip8 {
+
+// Executable memory reserved per emulator; flushed when full
+constexpr size_t kCodeCapacity = 1024 * 1024;
+// Granularity of code protection, which is always 4 KB on x86-64
+constexpr size_t kPageSize = 4096;
+// Number of times a block entry is reached before it is compiled
+constexpr uint8_t kHotThreshold = 8;
+
+#if defined(CHIP8_JIT_X64)
+
+// Code is never writable and executable at the same time (W^X): it is
+// mapped writable, and pages are switched to executable once a block has been
+// copied into them.
+static uint8_t* AllocateCode(size_t size) {
+#if defined(_WIN32)
+  return static_cast<uint8_t*>(VirtualAlloc(nullptr, size,
+                                            MEM_COMMIT | MEM_RESERVE,
+                                            PAGE_READWRITE));
+#else
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p != MAP_FAILED ? static_cast<uint8_t*>(p) : nullptr;
+#endif
+}
+
+static bool ProtectCode(uint8_t* code, size_t size, bool writable) {
+#if defined(_WIN32)
+  DWORD previous;
+  return VirtualProtect(code, size,
+                        writable ? PAGE_READWRITE : PAGE_EXECUTE_READ,
+                        &previous) != 0;
+#else
+  return mprotect(code, size, writable ? PROT_READ | PROT_WRITE
+                                       : PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+static void FreeCode(uint8_t* code, size_t size) {
+#if defined(_WIN32)
+  VirtualFree(code, 0, MEM_RELEASE);
+#else
+  munmap(code, size);
+#endif
+}
+
+// Emits the handful of x86-64 instructions that blocks are made of. The
+// processor is addressed through rbx, the emulator is kept in r12.
+class Assembler {
+public:
+  const std::vector<uint8_t>& code() const { return code_; }
+
+  void Prologue() {
+    Emit({0x53});                    // push rbx
+    Emit({0x41, 0x54});              // push r12
+#if defined(_WIN32)
+    Emit({0x48, 0x83, 0xEC, 0x28});  // sub rsp, 40 (shadow space)
+    Emit({0x48, 0x89, 0xCB});        // mov rbx, rcx
+    Emit({0x49, 0x89, 0xD4});        // mov r12, rdx
+#else
+    Emit({0x48, 0x83, 0xEC, 0x08});  // sub rsp, 8
+    Emit({0x48, 0x89, 0xFB});        // mov rbx, rdi
+    Emit({0x49, 0x89, 0xF4});        // mov r12, rsi
+#endif
+  }
+
+  void Epilogue() {
+#if defined(_WIN32)
+    Emit({0x48, 0x83, 0xC4, 0x28});  // add rsp, 40
+#else
+    Emit({0x48, 0x83, 0xC4, 0x08});  // add rsp, 8
+#endif
+    Emit({0x41, 0x5C});              // pop r12
+    Emit({0x5B});                    // pop rbx
+    Emit({0xC3});                    // ret
+  }
+
+  // op byte [rbx+disp], imm8
+  void ByteImmediate(uint8_t opcode, uint8_t ext, uint8_t disp, uint8_t imm) {
+    Emit({opcode, static_cast<uint8_t>(0x43 | (ext << 3)), disp, imm});
+  }
+
+  // op reg, byte [rbx+disp] or op byte [rbx+disp], reg; al unless given
+  void ByteRegister(uint8_t opcode, uint8_t disp, uint8_t reg = 0) {
+    Emit({opcode, static_cast<uint8_t>(0x43 | (reg << 3)), disp});
+  }
+
+  void StoreWord(uint8_t disp, uint16_t imm) {  // mov word [rbx+disp], imm16
+    Emit({0x66, 0xC7, 0x43, disp,
+          static_cast<uint8_t>(imm), static_cast<uint8_t>(imm >> 8)});
+  }
+
+  void AddWord(uint8_t disp) {  // movzx eax, byte [rbx+disp] is expected
+    Emit({0x66, 0x01, 0x43, disp});  // add word [rbx+disp], ax
+  }
+
+  void LoadByteZeroExtended(uint8_t disp) {
+    Emit({0x0F, 0xB6, 0x43, disp});  // movzx eax, byte [rbx+disp]
+  }
+
+  void StoreAx(uint8_t disp) {  // mov word [rbx+disp], ax
+    Emit({0x66, 0x89, 0x43, disp});
+  }
+
+  void SetFlag(uint8_t condition) {  // setcc cl
+    Emit({0x0F, static_cast<uint8_t>(0x90 | condition), 0xC1});
+  }
+
+  void LoadAddress(uint8_t reg, const void* pointer) {  // mov reg, imm64
+    Emit({0x48, static_cast<uint8_t>(0xB8 | reg)});
+    EmitValue(reinterpret_cast<uint64_t>(pointer));
+  }
+
+  // Short forward jump, taken if `condition` holds, or always without one.
+  // Returns a label to Bind() at the target.
+  size_t Jump(int condition = -1) {
+    Emit({static_cast<uint8_t>(condition < 0 ? 0xEB : 0x70 | condition), 0});
+    return code_.size();
+  }
+
+  void Bind(size_t label) {
+    code_[label - 1] = static_cast<uint8_t>(code_.size() - label);
+  }
+
+  void Call(void (*function)(Emulator*, const Instruction*),
+            const Instruction* argument) {
+#if defined(_WIN32)
+    Emit({0x4C, 0x89, 0xE1});        // mov rcx, r12
+    Emit({0x48, 0xBA});              // mov rdx, imm64
+#else
+    Emit({0x4C, 0x89, 0xE7});        // mov rdi, r12
+    Emit({0x48, 0xBE});              // mov rsi, imm64
+#endif
+    EmitValue(reinterpret_cast<uint64_t>(argument));
+    Emit({0x48, 0xB8});              // mov rax, imm64
+    EmitValue(reinterpret_cast<uint64_t>(function));
+    Emit({0xFF, 0xD0});              // call rax
+  }
+
+  // Instructions that are only used once are emitted as they are
+  void Emit(std::initializer_list<uint8_t> bytes) {
+    code_.insert(code_.end(), bytes);
+  }
+
+  template <typename T>
+  void EmitValue(T value) {
+    for (size_t j = 0; j < sizeof(T); ++j) {
+      code_.push_back(static_cast<uint8_t>(value >> (8 * j)));
+    }
+  }
+
+private:
+  std::vector<uint8_t> code_;
+};
+
+// Condition codes of jcc and setcc
+constexpr uint8_t kBelow = 0x2;  // carry
+constexpr uint8_t kAboveOrEqual = 0x3;
+constexpr uint8_t kEqual = 0x4;
+constexpr uint8_t kNotEqual = 0x5;
+constexpr uint8_t kAbove = 0x7;
+
+// Byte offsets into Processor, all of which fit into a signed 8-bit
+// displacement
+static uint8_t v_offset(uint8_t x) {
+  return static_cast<uint8_t>(offsetof(Processor, v) + x);
+}
+constexpr uint8_t kOffsetI = offsetof(Processor, i);
+constexpr uint8_t kOffsetPc = offsetof(Processor, pc);
+constexpr uint8_t kOffsetSp = offsetof(Processor, sp);
+constexpr uint8_t kOffsetStack = offsetof(Processor, stack);
+constexpr uint8_t kOffsetDt = offsetof(Processor, dt);
+static_assert(offsetof(Processor, st) < 0x80, "Processor is too large");
+
+#endif  // CHIP8_JIT_X64
+
+Jit::Jit(Emulator& emulator)
+    : emulator_(emulator), blocks_(emulator.memory.size()) {
+#if defined(CHIP8_JIT_X64)
+  code_ = AllocateCode(kCodeCapacity);
+#endif
+}
+
+Jit::~Jit() {
+#if defined(CHIP8_JIT_X64)
+  if (code_)
+    FreeCode(code_, kCodeCapacity);
+#endif
+}
+
+bool Jit::available() const {
+  return code_ != nullptr;
+}
+
+const Emulator* Jit::owner() const {
+  return &emulator_;
+}
+
+uint32_t Jit::Run(uint32_t cycles) {
+  if (!available())
+    return emulator_.RunThreaded(cycles);
+
+  if (lockstep_)
+    Synchronize();
+
+  auto& processor = emulator_.processor;
+  uint32_t cycle = 0;
+  emulator_.idle_.valid = false;
+
+  while (cycle < cycles) {
+    const uint16_t address = processor.pc & emulator_.address_mask_;
+    auto* block = &blocks_[address];
+
+    // Compiling may flush every block, so the entry is looked up again
+    if (!block->code && entry_ && ++block->hits >= kHotThreshold &&
+        Compile(address)) {
+      block = &blocks_[address];
+    }
+
+    if (block->code && cycles - cycle >= block->length) {
+      // The block may invalidate itself by writing to memory
+      const uint16_t length = block->length;
+      block->code(&processor, &emulator_);
+      cycle += length;
+      entry_ = true;
+      if (lockstep_)
+        Verify(address, length);
+    } else {
+      // Cold code is stepped through the interpreter. Only addresses right
+      // after a block end are counted as entries, so that a loop is
+      // compiled as one block rather than one block per instruction.
+      emulator_.Cycle();
+      ++cycle;
+      entry_ = IsBlockEnd(emulator_.instruction_.op);
+      if (lockstep_)
+        Verify(address, 1);
+    }
+
+    if (emulator_.stop_ != StopReason::kBudget && emulator_.EndsRun(cycle))
+      break;
+
+    if (processor.pc <= address && !--emulator_.idle_countdown_)
+      cycle += emulator_.SkipIdle(cycle, cycles);
+  }
+
+  return cycle;
+}
+
+void Jit::Invalidate(uint16_t address, size_t length) {
+  // Native code is not reclaimed until the next flush, so a block that
+  // modifies itself can still return safely.
+  for (size_t j = 0; j < length + kMaxBlockLength * 2; ++j) {
+    blocks_[(address + length - 1 - j) & emulator_.address_mask_] = Block();
+  }
+}
+
+bool Jit::Precompile(const Analysis& analysis) {
+  if (!available() || analysis.self_modifying() ||
+      analysis.program_hash != HashProgram(emulator_.program_)) {
+    return false;
+  }
+
+  for (const auto& block : analysis.blocks) {
+    if (!blocks_[block.address & emulator_.address_mask_].code)
+      Compile(block.address);
+  }
+  return true;
+}
+
+void Jit::Flush() {
+  // Sized like memory, which changes along with the quirk profile
+  blocks_.assign(emulator_.memory.size(), Block());
+  code_size_ = 0;
+  entry_ = true;
+}
+
+void Jit::set_lockstep(bool enabled) {
+  lockstep_ = enabled;
+  if (lockstep_ && !reference_)
+    reference_.reset(new Emulator(Executor::kInterpreter));
+}
+
+size_t Jit::divergences() const {
+  return divergences_;
+}
+
+bool Jit::Compile(uint16_t address) {
+#if defined(CHIP8_JIT_X64)
+  Assembler a;
+  a.Prologue();
+
+  const uint16_t start = address;
+  const auto& memory = emulator_.memory;
+  const auto& dispatch = *emulator_.dispatch_;
+  const uint8_t vf = v_offset(0xF);
+  uint16_t length = 0;
+  bool jumped = false;
+
+  for (;;) {
+    // Calls refer to the emulator's decode cache, whose entries are only
+    // invalidated along with this block
+    auto& instruction = emulator_.decoded_[address];
+    if (instruction.op == Opcode::kNone) {
+      instruction = Decode(memory[address] << 8 |
+                               memory[(address + 1) & emulator_.address_mask_],
+                           dispatch.extension);
+      emulator_.MarkDecoded(address);
+    }
+    const uint8_t vx = v_offset(instruction.x);
+    const uint8_t vy = v_offset(instruction.y);
+    const uint8_t vs = dispatch.shift_vy ? vy : vx;  // shifted register
+    address += 2;
+    ++length;
+
+    // Skips end the block, so the instruction that may be skipped is the one
+    // right after it. Its size is part of the code, which is invalidated
+    // along with it.
+    const uint16_t next = address;
+    auto skip = [&](size_t label) {
+      const uint16_t code = memory[next & emulator_.address_mask_] << 8 |
+                            memory[(next + 1) & emulator_.address_mask_];
+      a.StoreWord(kOffsetPc,
+                  next + GetInstructionSize(code, dispatch.extension));
+      a.Bind(label);
+      jumped = true;
+    };
+    // Leaves through the emulator's own handler, with the program counter
+    // already pointing at the next instruction
+    auto call = [&]() {
+      a.StoreWord(kOffsetPc, next);
+      a.Call(&Jit::Call, &instruction);
+      jumped = true;
+    };
+
+    switch (instruction.op) {
+      case Opcode::k00EE: {  // RET
+        a.LoadByteZeroExtended(kOffsetSp);
+        a.Emit({0x84, 0xC0});  // test al, al
+        const auto underflow = a.Jump(kEqual);
+        a.Emit({0xFE, 0xC8});  // dec al
+        a.ByteRegister(0x88, kOffsetSp);
+        a.Emit({0x0F, 0xB7, 0x4C, 0x43, kOffsetStack});  // movzx ecx, stack
+        a.Emit({0x66, 0x89, 0x4B, kOffsetPc});  // mov pc, cx
+        const auto done = a.Jump();
+        a.Bind(underflow);
+        call();
+        a.Bind(done);
+        break;
+      }
+      case Opcode::k1nnn:  // JP addr
+        a.StoreWord(kOffsetPc, instruction.nnn);
+        jumped = true;
+        break;
+      case Opcode::k2nnn: {  // CALL addr
+        a.LoadByteZeroExtended(kOffsetSp);
+        a.Emit({0x3C, 0x10});  // cmp al, 16
+        const auto overflow = a.Jump(kAboveOrEqual);
+        a.Emit({0x66, 0xC7, 0x44, 0x43, kOffsetStack,  // mov stack[sp], next
+                static_cast<uint8_t>(next), static_cast<uint8_t>(next >> 8)});
+        a.Emit({0xFE, 0x43, kOffsetSp});  // inc sp
+        a.StoreWord(kOffsetPc, instruction.nnn);
+        const auto done = a.Jump();
+        a.Bind(overflow);
+        call();
+        a.Bind(done);
+        break;
+      }
+      case Opcode::k3xkk:  // SE Vx, byte
+        a.StoreWord(kOffsetPc, next);
+        a.ByteImmediate(0x80, 7, vx, instruction.kk);  // cmp Vx, kk
+        skip(a.Jump(kNotEqual));
+        break;
+      case Opcode::k4xkk:  // SNE Vx, byte
+        a.StoreWord(kOffsetPc, next);
+        a.ByteImmediate(0x80, 7, vx, instruction.kk);
+        skip(a.Jump(kEqual));
+        break;
+      case Opcode::k5xy0:  // SE Vx, Vy
+        a.StoreWord(kOffsetPc, next);
+        a.ByteRegister(0x8A, vx);
+        a.ByteRegister(0x3A, vy);  // cmp al, Vy
+        skip(a.Jump(kNotEqual));
+        break;
+      case Opcode::k6xkk:  // LD Vx, byte
+        a.ByteImmediate(0xC6, 0, vx, instruction.kk);
+        break;
+      case Opcode::k7xkk:  // ADD Vx, byte
+        a.ByteImmediate(0x80, 0, vx, instruction.kk);
+        break;
+      case Opcode::k8xy0:  // LD Vx, Vy
+        a.ByteRegister(0x8A, vy);  // mov al, Vy
+        a.ByteRegister(0x88, vx);  // mov Vx, al
+        break;
+      case Opcode::k8xy1:  // OR Vx, Vy
+        a.ByteRegister(0x8A, vy);
+        a.ByteRegister(0x08, vx);  // or Vx, al
+        break;
+      case Opcode::k8xy2:  // AND Vx, Vy
+        a.ByteRegister(0x8A, vy);
+        a.ByteRegister(0x20, vx);  // and Vx, al
+        break;
+      case Opcode::k8xy3:  // XOR Vx, Vy
+        a.ByteRegister(0x8A, vy);
+        a.ByteRegister(0x30, vx);  // xor Vx, al
+        break;
+      // The flag is written last, as in the handlers, in case x is F
+      case Opcode::k8xy4:  // ADD Vx, Vy
+        a.ByteRegister(0x8A, vx);
+        a.ByteRegister(0x02, vy);  // add al, Vy
+        a.SetFlag(kBelow);
+        a.ByteRegister(0x88, vx);
+        a.ByteRegister(0x88, vf, 1);  // mov VF, cl
+        break;
+      case Opcode::k8xy5:  // SUB Vx, Vy
+        a.ByteRegister(0x8A, vx);
+        a.ByteRegister(0x3A, vy);
+        a.SetFlag(kAbove);
+        a.ByteRegister(0x2A, vy);  // sub al, Vy
+        a.ByteRegister(0x88, vx);
+        a.ByteRegister(0x88, vf, 1);
+        break;
+      case Opcode::k8xy6:  // SHR Vx {, Vy}
+        a.ByteRegister(0x8A, vs);
+        a.Emit({0x88, 0xC1});  // mov cl, al
+        a.Emit({0xD0, 0xE8});  // shr al, 1
+        a.ByteRegister(0x88, vx);
+        a.Emit({0x80, 0xE1, 0x01});  // and cl, 1
+        a.ByteRegister(0x88, vf, 1);
+        break;
+      case Opcode::k8xy7:  // SUBN Vx, Vy
+        a.ByteRegister(0x8A, vy);
+        a.ByteRegister(0x3A, vx);
+        a.SetFlag(kAbove);
+        a.ByteRegister(0x2A, vx);
+        a.ByteRegister(0x88, vx);
+        a.ByteRegister(0x88, vf, 1);
+        break;
+      case Opcode::k8xyE:  // SHL Vx {, Vy}
+        a.ByteRegister(0x8A, vs);
+        a.Emit({0x88, 0xC1});
+        a.Emit({0xD0, 0xE0});  // shl al, 1
+        a.ByteRegister(0x88, vx);
+        a.Emit({0xC0, 0xE9, 0x07});  // shr cl, 7
+        a.ByteRegister(0x88, vf, 1);
+        break;
+      case Opcode::k9xy0:  // SNE Vx, Vy
+        a.StoreWord(kOffsetPc, next);
+        a.ByteRegister(0x8A, vx);
+        a.ByteRegister(0x3A, vy);
+        skip(a.Jump(kEqual));
+        break;
+      case Opcode::kAnnn:  // LD I, addr
+        a.StoreWord(kOffsetI, instruction.nnn);
+        break;
+      case Opcode::kBnnn:  // JP V0, addr
+        a.LoadByteZeroExtended(dispatch.jump_vx ? vx : v_offset(0));
+        a.Emit({0x66, 0x05, static_cast<uint8_t>(instruction.nnn),
+                static_cast<uint8_t>(instruction.nnn >> 8)});  // add ax, nnn
+        a.StoreAx(kOffsetPc);
+        jumped = true;
+        break;
+      case Opcode::kCxkk:  // RND Vx, byte
+        if (emulator_.random_source_) {
+          call();
+          break;
+        }
+        // Random::Next(), on the emulator's own generator
+        a.LoadAddress(2, &emulator_.random_.state_);  // rdx
+        a.Emit({0x48, 0x8B, 0x02});  // mov rax, [rdx]
+        a.Emit({0x48, 0xB9});              // mov rcx, imm64
+        a.EmitValue<uint64_t>(6364136223846793005);
+        a.Emit({0x48, 0x0F, 0xAF, 0xC8});  // imul rcx, rax
+        a.Emit({0x49, 0xB8});              // mov r8, imm64
+        a.EmitValue<uint64_t>(1442695040888963407);
+        a.Emit({0x4C, 0x01, 0xC1});        // add rcx, r8
+        a.Emit({0x48, 0x89, 0x0A});        // mov [rdx], rcx
+        a.Emit({0x48, 0x89, 0xC1});        // mov rcx, rax
+        a.Emit({0x48, 0xC1, 0xE9, 18});    // shr rcx, 18
+        a.Emit({0x48, 0x31, 0xC1});        // xor rcx, rax
+        a.Emit({0x48, 0xC1, 0xE9, 27});    // shr rcx, 27
+        a.Emit({0x48, 0xC1, 0xE8, 59});    // shr rax, 59
+        a.Emit({0x48, 0x91});              // xchg rax, rcx
+        a.Emit({0xD3, 0xC8});              // ror eax, cl
+        a.Emit({0xC1, 0xE8, 24});          // shr eax, 24
+        a.Emit({0x24, instruction.kk});    // and al, kk
+        a.ByteRegister(0x88, vx);
+        a.LoadAddress(2, &emulator_.side_effects_);
+        a.Emit({0x83, 0x02, 0x01});        // add dword [rdx], 1
+        break;
+      case Opcode::kEx9E: {  // SKP Vx
+        a.StoreWord(kOffsetPc, next);
+        a.LoadByteZeroExtended(vx);
+        a.Emit({0x3C, 0x10});  // cmp al, 16
+        const auto invalid = a.Jump(kAboveOrEqual);
+        a.LoadAddress(2, emulator_.input.data());
+        a.Emit({0x80, 0x3C, 0x02, 0x00});  // cmp byte [rdx+rax], 0
+        const auto released = a.Jump(kEqual);
+        skip(invalid);
+        a.Bind(released);
+        break;
+      }
+      case Opcode::kExA1: {  // SKNP Vx
+        a.StoreWord(kOffsetPc, next);
+        a.LoadByteZeroExtended(vx);
+        a.Emit({0x3C, 0x10});
+        const auto invalid = a.Jump(kAboveOrEqual);
+        a.LoadAddress(2, emulator_.input.data());
+        a.Emit({0x80, 0x3C, 0x02, 0x00});
+        const auto pressed = a.Jump(kNotEqual);
+        a.Bind(invalid);
+        skip(pressed);
+        break;
+      }
+      case Opcode::kFx07:  // LD Vx, DT
+        a.ByteRegister(0x8A, kOffsetDt);
+        a.ByteRegister(0x88, vx);
+        break;
+      case Opcode::kFx15:  // LD DT, Vx
+        a.ByteRegister(0x8A, vx);
+        a.ByteRegister(0x88, kOffsetDt);
+        break;
+      case Opcode::kFx1E:  // ADD I, Vx
+        a.LoadByteZeroExtended(vx);
+        a.AddWord(kOffsetI);
+        break;
+      case Opcode::kFx29:  // LD F, Vx
+        a.LoadByteZeroExtended(vx);
+        a.Emit({0x8D, 0x04, 0x80});  // lea eax, [rax+rax*4]
+        a.StoreAx(kOffsetI);
+        break;
+      case Opcode::kFx65:  // LD Vx, [I]
+        a.LoadAddress(2, memory.data());
+        a.Emit({0x0F, 0xB7, 0x4B, kOffsetI});  // movzx ecx, I
+        for (uint8_t j = 0; j <= instruction.x; ++j) {
+          a.Emit({0x8D, 0x41, j});  // lea eax, [rcx+j]
+          a.Emit({0x25});           // and eax, mask
+          a.EmitValue<uint32_t>(emulator_.address_mask_);
+          a.Emit({0x8A, 0x04, 0x02});  // mov al, [rdx+rax]
+          a.ByteRegister(0x88, v_offset(j));
+        }
+        if (dispatch.increment_i) {  // add I, x + 1
+          a.Emit({0x66, 0x83, 0x43, kOffsetI,
+                  static_cast<uint8_t>(instruction.x + 1)});
+        }
+        break;
+      default:
+        call();
+        break;
+    }
+
+    if (IsBlockEnd(instruction.op) || length == kMaxBlockLength ||
+        address >= emulator_.address_mask_) {
+      break;
+    }
+    jumped = false;
+  }
+
+  if (!jumped)
+    a.StoreWord(kOffsetPc, address);
+  a.Epilogue();
+
+  const auto& code = a.code();
+  if (code_size_ + code.size() > kCodeCapacity) {
+    Flush();  // between blocks, so nothing is executing this code
+  }
+
+  // The block may share its first page with code that is already
+  // executable, which is fine as nothing is executing it right now
+  uint8_t* const page = code_ + code_size_ / kPageSize * kPageSize;
+  const size_t span = code_ + code_size_ + code.size() - page;
+  if (!ProtectCode(page, span, true))
+    return false;
+  std::memcpy(code_ + code_size_, code.data(), code.size());
+  if (!ProtectCode(page, span, false))
+    return false;
+
+  // Looked up after the flush above, which replaces every entry
+  auto& block = blocks_[start];
+  block.code = reinterpret_cast<code_t>(code_ + code_size_);
+  block.length = length;
+  code_size_ += code.size();
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+void Jit::Call(Emulator* emulator, const Instruction* instruction) {
+  emulator->instruction_ = *instruction;
+  emulator->Execute();
+}
+
+void Jit::Synchronize() {
+  auto& reference = *reference_;
+  static_cast<Machine&>(reference) = emulator_;
+  reference.instruction_ = emulator_.instruction_;
+  reference.random_ = emulator_.random_;
+  reference.set_quirks(emulator_.quirks());
+  reference.Invalidate(0, reference.memory.size());
+}
+
+void Jit::Verify(uint16_t address, uint32_t cycles) {
+  auto& reference = *reference_;
+  bool random = false;
+  for (uint32_t cycle = 0; cycle < cycles; ++cycle) {
+    reference.Cycle();
+    random |= reference.instruction_.op == Opcode::kCxkk;
+  }
+
+  // A custom random source cannot be replayed, so the machines cannot be
+  // compared after RND
+  if (random && emulator_.random_source_) {
+    Synchronize();
+    return;
+  }
+
+  const auto& a = emulator_.processor;
+  const auto& b = reference.processor;
+  if (a.v == b.v && a.i == b.i && a.pc == b.pc && a.sp == b.sp &&
+      a.stack == b.stack && a.dt == b.dt && a.st == b.st &&
+      emulator_.memory == reference.memory &&
+      emulator_.display == reference.display &&
+      emulator_.hires == reference.hires &&
+      emulator_.planes == reference.planes && emulator_.rpl == reference.rpl) {
+    return;
+  }
+
+  ++divergences_;
+  std::cout << "JIT diverged from the interpreter at 0x" << std::hex
+            << address << std::dec << " after " << cycles
+            << " instruction(s)\n";
+  Synchronize();
+}
+
+}  // namespace chip8
@@ -0,0 +1,97 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "chip8.h"
+
+namespace chip8 {
+
+struct Analysis;
+
+// Compiles hot basic blocks to native x86-64 code. Arithmetic, skips, calls,
+// RND and loads are translated directly, with the quirks of the current
+// profile built in; drawing, stores and the rest call back into the
+// emulator's own handlers. On other hosts, or if executable memory cannot be
+// allocated, the threaded executor is used instead.
+class Jit {
+public:
+  explicit Jit(Emulator& emulator);
+  ~Jit();
+
+  Jit(const Jit&) = delete;
+  Jit& operator=(const Jit&) = delete;
+
+  bool available() const;
+  const Emulator* owner() const;
+
+  // Returns the number of instructions executed
+  uint32_t Run(uint32_t cycles);
+
+  void Invalidate(uint16_t address, size_t length);
+  void Flush();
+
+  // Compiles the basic blocks of an analysis of the loaded program before
+  // they get hot. Fails without compiling anything if the analysis is of
+  // another program, or if the program may overwrite its own code, which
+  // would only throw the blocks away.
+  bool Precompile(const Analysis& analysis);
+
+  // Lockstep mode runs a reference interpreter next to the compiled code and
+  // compares the machines after every step.
+  void set_lockstep(bool enabled);
+  size_t divergences() const;
+
+private:
+  typedef void (*code_t)(Processor* processor, Emulator* emulator);
+
+  struct Block {
+    code_t code = nullptr;
+    uint16_t length = 0;  // number of instructions
+    uint8_t hits = 0;
+  };
+
+  bool Compile(uint16_t address);  // may flush every block
+  static void Call(Emulator* emulator, const Instruction* instruction);
+
+  void Synchronize();
+  void Verify(uint16_t address, uint32_t cycles);
+
+  Emulator& emulator_;
+  std::vector<Block> blocks_;  // one per byte of the emulator's memory
+  bool entry_ = true;  // whether the program counter is at a block entry
+
+  uint8_t* code_ = nullptr;
+  size_t code_size_ = 0;
+
+  bool lockstep_ = false;
+  size_t divergences_ = 0;
+  std::unique_ptr<Emulator> reference_;
+};
+
+}  // namespace chip8
@@ -0,0 +1,108 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace chip8 {
+
+// Bounded queue for exactly one producer thread and one consumer thread
+template <typename T, size_t N>
+class SpscQueue {
+public:
+  static_assert(N && !(N & (N - 1)), "Capacity must be a power of two");
+
+  // Returns false if the queue is full
+  bool Push(const T& value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == N)
+      return false;
+    items_[tail & (N - 1)] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false if the queue is empty
+  bool Pop(T& value) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+      return false;
+    value = items_[head & (N - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t size() const {
+    return tail_.load(std::memory_order_acquire) -
+           head_.load(std::memory_order_acquire);
+  }
+
+private:
+  std::array<T, N> items_;
+  alignas(64) std::atomic<size_t> head_{0};  // next item to pop
+  alignas(64) std::atomic<size_t> tail_{0};  // next slot to push into
+};
+
+// Hands the latest value from one writer thread to one reader thread without
+// either of them waiting. The writer fills back() and publishes it; the
+// reader swaps the latest published value into front(), skipping older ones.
+template <typename T>
+class TripleBuffer {
+public:
+  T& back() {
+    return buffers_[back_];
+  }
+
+  void Publish() {
+    back_ = middle_.exchange(back_ | kFresh, std::memory_order_acq_rel) &
+            kIndex;
+  }
+
+  // Returns false if nothing was published since the last call
+  bool Update() {
+    if (!(middle_.load(std::memory_order_relaxed) & kFresh))
+      return false;
+    front_ = middle_.exchange(front_, std::memory_order_acq_rel) & kIndex;
+    return true;
+  }
+
+  const T& front() const {
+    return buffers_[front_];
+  }
+
+private:
+  static constexpr uint8_t kIndex = 0x03;
+  static constexpr uint8_t kFresh = 0x04;  // set when the middle is unread
+
+  std::array<T, 3> buffers_{};
+  uint8_t back_ = 0;
+  std::atomic<uint8_t> middle_{1};
+  uint8_t front_ = 2;
+};
+
+}  // namespace chip8
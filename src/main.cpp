@@ -22,58 +22,215 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
-#include <fstream>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <map>
+#include <random>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "audio.h"
 #include "chip8.h"
+#include "lockfree.h"
+#include "movie.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "scheduler.h"
 #include "sdl.h"
 
 constexpr uint8_t kDisplayMultiplier = 10;
 
-constexpr uint16_t kSamplesPerSecond = 44100;
-constexpr uint16_t kToneAmplitude = 8000;
-constexpr uint16_t kToneDuration = 50;
-constexpr uint16_t kToneFrequency = 1700;
+// Colours of the four plane combinations, ARGB
+constexpr Uint32 kPalette[4] = {0xFF000000, 0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555};
 
-static chip8::Emulator emulator;
+constexpr uint16_t kAudioBufferSamples = 512;
+
+using Clock = std::chrono::steady_clock;
+
+// Sent from the main thread to the emulation thread
+struct Message {
+  enum class Type : uint8_t { kKey, kRestart, kRewind };
+  Clock::time_point time;
+  Type type = Type::kKey;
+  uint8_t key = 0;
+  bool pressed = false;  // also whether rewinding starts or stops
+};
+
+// Published by the emulation thread for the main thread to render
+struct Frame {
+  chip8::display_t display;
+  bool hires = false;
+  uint64_t dirty_rows = 0;  // since the last frame that was presented
+  uint64_t sequence = 0;
+  uint64_t inputs = 0;           // key changes applied so far
+  Clock::time_point input_time;  // when the latest one was made
+};
+
+struct LatencyStats {
+  uint64_t frames = 0;    // frames presented
+  uint64_t skipped = 0;   // frames published but never presented
+  uint64_t inputs = 0;    // frames presented in response to input
+  double input_sum = 0.0;  // input-to-photon latency, in milliseconds
+  double input_max = 0.0;
+  double interval_sum = 0.0;  // between presents, in milliseconds
+  double interval_max = 0.0;
+};
 
 class Engine : public sdl::Engine {
 public:
-  void Beep(uint16_t duration) const;
-  void EnableAudio();
+  ~Engine();
 
+  chip8::Emulator& emulator();
+  const chip8::Rewind& rewind() const;
+  chip8::RunAhead& run_ahead();
+  const chip8::Scheduler& scheduler() const;
+  const chip8::Audio& audio() const;
+  const LatencyStats& latency() const;
+
+  // Input is recorded from the current state of the emulator onwards
+  void StartRecording(const std::string& path,
+                      const std::vector<uint8_t>& program);
+  bool StopRecording();
+
+  // Runs the emulator on its own thread. Nothing else may touch the emulator,
+  // rewind, run-ahead or recording until emulation is stopped.
+  void StartEmulation();
+  void StopEmulation();
+
+  // `samples` is the device buffer size, which bounds the audio latency
+  void EnableAudio(uint16_t samples);
+
+  Uint32 GetWaitTime();
   void OnKeyEvent(SDL_KeyboardEvent key_event);
-  void OnLoop();
+  void OnWindowEvent(SDL_WindowEvent window_event);
   void OnRender();
 
 private:
+  // Messages to apply, each at an instruction count from the start of a run
+  typedef std::vector<std::pair<uint32_t, Message>> messages_t;
+
+  // Emulation thread
+  void Emulate();
+  chip8::Emulator& RunFrame(messages_t::const_iterator first,
+                            messages_t::const_iterator last,
+                            uint32_t offset);
+  void Apply(const Message& message);
+  void RecordKey(uint8_t key, bool pressed);
+  void Publish(chip8::Emulator& shown);
+
+  // Audio thread
+  static void OnAudio(void* userdata, Uint8* stream, int len);
+
+  // Main thread
+  void Send(const Message& message);
+  void UpdateTexture(uint64_t dirty_rows, const Frame& frame);
+
+  chip8::Emulator emulator_{chip8::Executor::kThreaded};
+  chip8::Rewind rewind_;
+  chip8::RunAhead run_ahead_;
+  bool rewinding_ = false;
+  chip8::Movie movie_;
+  std::string movie_path_;
+  chip8::Scheduler scheduler_;
+  Clock::time_point last_run_;
+  Clock::time_point input_time_;
+  uint64_t inputs_ = 0;
+  uint64_t sequence_ = 0;
+  // Dirty rows of the frames that may not have been presented yet, by
+  // sequence, and the emulator whose display was published last
+  std::array<uint64_t, 8> published_rows_{};
+  const chip8::Emulator* published_ = nullptr;
+
+  std::thread thread_;
+  std::atomic<bool> emulating_{false};
+  chip8::SpscQueue<Message, 256> messages_;
+  chip8::TripleBuffer<Frame> frames_;
+  chip8::Audio audio_;
+
+  std::atomic<uint64_t> presented_sequence_{0};  // read by the emulation thread
+  uint64_t presented_inputs_ = 0;
+  Clock::time_point presented_time_;
+  LatencyStats latency_;
   bool audio_enabled_ = false;
+  bool redraw_ = true;
 };
 
-void Engine::Beep(uint16_t duration) const {
-  if (!audio_enabled_)
-    return;
+Engine::~Engine() {
+  StopEmulation();
+  CloseAudioDevice();  // before the callback's data goes away
+}
 
-  const auto sample_count = kSamplesPerSecond * duration / 1000;
-  std::vector<uint16_t> data(sample_count, 0);
+chip8::Emulator& Engine::emulator() {
+  return emulator_;
+}
 
-  constexpr uint16_t a = kToneAmplitude;
-  constexpr uint16_t p = kSamplesPerSecond / kToneFrequency;
-  for (int t = 0; t < data.size(); ++t) {
-    data[t] = ((4 * a) / p) * (std::abs((t % p) - (p / 2)) - (p / 4));
-  }
+const chip8::Rewind& Engine::rewind() const {
+  return rewind_;
+}
+
+chip8::RunAhead& Engine::run_ahead() {
+  return run_ahead_;
+}
+
+const chip8::Scheduler& Engine::scheduler() const {
+  return scheduler_;
+}
+
+const chip8::Audio& Engine::audio() const {
+  return audio_;
+}
+
+const LatencyStats& Engine::latency() const {
+  return latency_;
+}
+
+void Engine::StartRecording(const std::string& path,
+                            const std::vector<uint8_t>& program) {
+  movie_ = chip8::Movie();
+  movie_.seed = emulator_.seed();
+  movie_.program_hash = chip8::HashProgram(program);
+  movie_.cycles_per_frame = emulator_.cycles_per_frame();
+  movie_.quirks = emulator_.quirks();
+  movie_path_ = path;
+}
+
+bool Engine::StopRecording() {
+  if (movie_path_.empty())
+    return false;
+
+  movie_.cycles = emulator_.cycles();
+  movie_.display_hash = chip8::HashDisplay(emulator_.display);
+  const bool written = chip8::WriteMovie(movie_path_, movie_);
+  movie_path_.clear();
+  return written;
+}
 
-  QueueAudio(&data.at(0), data.size());
+void Engine::StartEmulation() {
+  emulating_ = true;
+  scheduler_.Start();
+  last_run_ = Clock::now();
+  thread_ = std::thread(&Engine::Emulate, this);
 }
 
-void Engine::EnableAudio() {
+void Engine::StopEmulation() {
+  emulating_ = false;
+  if (thread_.joinable())
+    thread_.join();
+}
+
+void Engine::EnableAudio(uint16_t samples) {
   SDL_AudioSpec audio_spec = {0};
-  audio_spec.freq = kSamplesPerSecond;
-  audio_spec.format = AUDIO_S16LSB;
+  audio_spec.freq = audio_.sample_rate();
+  audio_spec.format = AUDIO_S16SYS;
   audio_spec.channels = 1;
-  audio_spec.samples = 2048;
+  audio_spec.samples = samples;
+  audio_spec.callback = &Engine::OnAudio;
+  audio_spec.userdata = &audio_;
 
   audio_enabled_ = OpenAudioDevice(audio_spec);
 
@@ -81,16 +238,215 @@ void Engine::EnableAudio() {
     PauseAudioDevice(0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Emulation thread
+
+void Engine::Emulate() {
+  messages_t messages;
+
+  while (emulating_) {
+    scheduler_.SleepUntilDeadline();
+    const auto frames = scheduler_.Due();
+    if (!frames)
+      continue;
+
+    // Input that arrived since the previous run is spread over the frames
+    // that run now, in proportion to when it arrived, so that it lands on
+    // about the instruction it would have in real time
+    const auto start = last_run_;
+    const auto now = Clock::now();
+    const std::chrono::duration<double> span = now - start;
+    const uint32_t cycles_per_frame = emulator_.cycles_per_frame();
+    const uint32_t cycles = frames * cycles_per_frame;
+    last_run_ = now;
+
+    Message message;
+    while (messages_.Pop(message)) {
+      const std::chrono::duration<double> elapsed = message.time - start;
+      const double fraction = span.count() > 0.0 ?
+          std::min(std::max(elapsed.count() / span.count(), 0.0), 1.0) : 1.0;
+      messages.emplace_back(static_cast<uint32_t>(fraction * cycles), message);
+    }
+
+    auto first = messages.cbegin();
+    chip8::Emulator* shown = &emulator_;
+    for (uint32_t frame = 0; frame < frames; ++frame) {
+      const uint32_t offset = frame * cycles_per_frame;
+      auto last = first;
+      while (last != messages.cend() &&
+             (frame + 1 == frames || last->first < offset + cycles_per_frame)) {
+        ++last;
+      }
+      shown = &RunFrame(first, last, offset);
+      first = last;
+    }
+    messages.clear();
+
+    Publish(*shown);
+  }
+}
+
+chip8::Emulator& Engine::RunFrame(messages_t::const_iterator first,
+                                  messages_t::const_iterator last,
+                                  uint32_t offset) {
+  if (rewinding_) {
+    // Keys held while rewinding should still be held afterwards
+    for (; first != last; ++first)
+      Apply(first->second);
+    const auto input = emulator_.input;
+    rewind_.Step(emulator_);
+
+    // What happened after the restored state is no longer part of the movie
+    auto& events = movie_.input;
+    while (!events.empty() && events.back().cycle >= emulator_.cycles())
+      events.pop_back();
+    for (uint8_t key = 0; key < input.size(); ++key)
+      RecordKey(key, input[key]);
+
+    emulator_.input = input;
+    audio_.Push(0);
+    return emulator_;
+  }
+
+  // Runs up to an instruction count within the frame, unless the program
+  // has stopped. Waiting for a key uses up the cycles without stopping.
+  const uint32_t cycles_per_frame = emulator_.cycles_per_frame();
+  uint32_t cycle = 0;
+  bool stopped = false;
+  auto run_until = [&](uint32_t target) {
+    if (stopped || cycle >= target)
+      return;
+    const auto before = emulator_.cycles();
+    const auto reason = emulator_.RunCycles(target - cycle);
+    stopped = reason != chip8::StopReason::kBudget &&
+              reason != chip8::StopReason::kWaitingForKey;
+    // The core only returns the reason, so faults are reported here. The
+    // program counter has already moved past the instruction.
+    const uint16_t address = emulator_.processor.pc - 2;
+    if (reason == chip8::StopReason::kUnknownInstruction) {
+      std::cout << "Unknown instruction at 0x" << std::hex << address
+                << std::dec << "\n";
+    } else if (reason == chip8::StopReason::kStackFault) {
+      std::cout << "Stack fault at 0x" << std::hex << address << std::dec
+                << "\n";
+    }
+    cycle += static_cast<uint32_t>(emulator_.cycles() - before);
+  };
+
+  for (; first != last; ++first) {
+    run_until(std::min(first->first - offset, cycles_per_frame));
+    Apply(first->second);
+  }
+  run_until(cycles_per_frame);
+  audio_.Push(emulator_);
+  emulator_.UpdateTimers();
+
+  rewind_.Record(emulator_);
+
+  if (run_ahead_.frames())
+    return run_ahead_.Speculate(emulator_);
+  return emulator_;
+}
+
+void Engine::Apply(const Message& message) {
+  switch (message.type) {
+    case Message::Type::kKey:
+      if (emulator_.input[message.key] == message.pressed)
+        break;
+      run_ahead_.OnKey(emulator_, message.key, message.pressed);
+      RecordKey(message.key, message.pressed);
+      emulator_.SetKey(message.key, message.pressed);
+      input_time_ = message.time;
+      ++inputs_;
+      break;
+    case Message::Type::kRestart:
+      emulator_.Restart();
+      rewind_.Clear();
+      movie_.input.clear();
+      break;
+    case Message::Type::kRewind:
+      rewinding_ = message.pressed;
+      break;
+  }
+}
+
+void Engine::RecordKey(uint8_t key, bool pressed) {
+  if (!movie_path_.empty() && emulator_.input[key] != pressed)
+    movie_.input.push_back({emulator_.cycles(), key, pressed});
+}
+
+void Engine::Publish(chip8::Emulator& shown) {
+  // The core tracks rows since they were last cleared, which is only since
+  // the previous frame if that came from the same emulator
+  uint64_t dirty_rows =
+      &shown == published_ ? shown.dirty_rows() : ~uint64_t{0};
+  shown.ClearDirtyRows();
+  published_ = &shown;
+
+  // The main thread may skip frames, so the rows of every frame since the
+  // last one it presented are included
+  const uint64_t sequence = ++sequence_;
+  const uint64_t presented = presented_sequence_.load();
+  published_rows_[sequence % published_rows_.size()] = dirty_rows;
+  if (sequence - presented > published_rows_.size()) {
+    dirty_rows = ~uint64_t{0};
+  } else {
+    for (uint64_t i = presented + 1; i < sequence; ++i)
+      dirty_rows |= published_rows_[i % published_rows_.size()];
+  }
+
+  auto& frame = frames_.back();
+  frame.display = shown.display;
+  frame.hires = shown.hires;
+  frame.dirty_rows = dirty_rows;
+  frame.sequence = sequence;
+  frame.inputs = inputs_;
+  frame.input_time = input_time_;
+  frames_.Publish();
+
+  // Wakes up the main thread
+  SDL_Event event = {};
+  event.type = SDL_USEREVENT;
+  SDL_PushEvent(&event);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Audio thread
+
+void Engine::OnAudio(void* userdata, Uint8* stream, int len) {
+  auto audio = static_cast<chip8::Audio*>(userdata);
+  audio->Render(reinterpret_cast<int16_t*>(stream), len / sizeof(int16_t));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Main thread
+
+Uint32 Engine::GetWaitTime() {
+  // The emulation thread sends an event whenever a frame is ready
+  return 100;
+}
+
 void Engine::OnKeyEvent(SDL_KeyboardEvent key_event) {
   if (key_event.repeat != 0)
     return;
 
+  Message message;
+  message.time = Clock::now();
+
   switch (key_event.keysym.sym) {
     case SDLK_ESCAPE:
       running_ = false;
       return;
     case SDLK_F5:
-      emulator.Restart();
+      if (key_event.state == SDL_PRESSED) {
+        message.type = Message::Type::kRestart;
+        Send(message);
+      }
+      return;
+    case SDLK_BACKSPACE:
+      message.type = Message::Type::kRewind;
+      message.pressed = key_event.state == SDL_PRESSED;
+      Send(message);
       return;
   }
 
@@ -101,65 +457,118 @@ void Engine::OnKeyEvent(SDL_KeyboardEvent key_event) {
     {SDLK_z, 0xA}, {SDLK_x, 0x0}, {SDLK_c, 0xB}, {SDLK_v, 0xF},  // A|0|B|F
   };
   auto it = key_map.find(key_event.keysym.sym);
-  if (it != key_map.end())
-    emulator.SetKey(it->second, key_event.state == SDL_PRESSED);
+  if (it != key_map.end()) {
+    message.key = it->second;
+    message.pressed = key_event.state == SDL_PRESSED;
+    Send(message);
+  }
 }
 
-void Engine::OnLoop() {
-  static sdl::Timer timer(500);
-
-  if (!timer.Check())
-    return;
-
-  emulator.Cycle();
-  emulator.UpdateTimers();
-
-  if (emulator.processor.st > 0) {
-    Beep(emulator.processor.st * kToneDuration);
-    emulator.processor.st = 0;
+void Engine::OnWindowEvent(SDL_WindowEvent window_event) {
+  switch (window_event.event) {
+    case SDL_WINDOWEVENT_EXPOSED:
+    case SDL_WINDOWEVENT_SIZE_CHANGED:
+      redraw_ = true;
+      break;
   }
 }
 
 void Engine::OnRender() {
-  static sdl::Timer timer(60);
+  uint64_t dirty_rows = 0;
+
+  // Frames that were published while the previous one was being presented
+  // are skipped, but their rows are included in the next one's. A mode
+  // change marks every row, as the core does.
+  if (frames_.Update()) {
+    const auto& frame = frames_.front();
+    dirty_rows = frame.dirty_rows;
+    if (dirty_rows)
+      UpdateTexture(dirty_rows, frame);
+    const uint64_t presented = presented_sequence_.load();
+    if (presented)
+      latency_.skipped += frame.sequence - presented - 1;
+    presented_sequence_.store(frame.sequence);
+  }
 
-  if (!timer.Check())
+  // The texture keeps the last frame, so there is nothing to present unless
+  // the display has changed or the window needs to be repainted
+  if (!dirty_rows && !redraw_)
     return;
+  redraw_ = false;
 
-  SDL_SetRenderDrawColor(renderer_, 0x00, 0x00, 0x00, 0xFF);
-  SDL_RenderClear(renderer_);
-
-  SDL_Rect rect = {0, 0, kDisplayMultiplier, kDisplayMultiplier};
+  SDL_RenderCopy(renderer_, texture_, nullptr, nullptr);
+  SDL_RenderPresent(renderer_);
 
-  for (uint8_t y = 0; y < chip8::kDisplayHeight; ++y) {
-    for (uint8_t x = 0; x < chip8::kDisplayWidth; ++x) {
-      if (emulator.GetPixel(x, y)) {
-        rect.x = x * kDisplayMultiplier;
-        rect.y = y * kDisplayMultiplier;
-        SDL_SetRenderDrawColor(renderer_, 0xFF, 0xFF, 0xFF, 0xFF);
-        SDL_RenderFillRect(renderer_, &rect);
-      }
-    }
+  const auto now = Clock::now();
+  if (latency_.frames++) {
+    const std::chrono::duration<double, std::milli> interval =
+        now - presented_time_;
+    latency_.interval_sum += interval.count();
+    latency_.interval_max = std::max(latency_.interval_max, interval.count());
   }
+  presented_time_ = now;
+
+  const auto& frame = frames_.front();
+  if (frame.inputs != presented_inputs_) {
+    const std::chrono::duration<double, std::milli> latency =
+        now - frame.input_time;
+    ++latency_.inputs;
+    latency_.input_sum += latency.count();
+    latency_.input_max = std::max(latency_.input_max, latency.count());
+    presented_inputs_ = frame.inputs;
+  }
+}
 
-  SDL_RenderPresent(renderer_);
+void Engine::Send(const Message& message) {
+  if (!messages_.Push(message))
+    std::cout << "Input queue is full, dropping a key event\n";
 }
 
-static bool ReadFile(const std::string& path, std::vector<uint8_t>& data) {
-  std::ifstream is;
-  is.open(path.c_str(), std::ios::binary);
+void Engine::UpdateTexture(uint64_t dirty_rows, const Frame& frame) {
+  // The texture is always hi-res, so lo-res pixels are drawn 2x2
+  const uint8_t scale = frame.hires ? 1 : 2;
+  const uint8_t height = chip8::kHiResHeight / scale;
+  const uint8_t width = chip8::kHiResWidth / scale;
+  dirty_rows &= ~uint64_t{0} >> (64 - height);
+  if (!dirty_rows)
+    return;
 
-  is.seekg(0, std::ios::end);
-  size_t len = static_cast<size_t>(is.tellg());
+  uint8_t first = 0;
+  while (!(dirty_rows & (uint64_t{1} << first)))
+    ++first;
+  uint8_t last = height - 1;
+  while (!(dirty_rows & (uint64_t{1} << last)))
+    --last;
+
+  // Locked pixels are write-only, so every row in the span is rewritten
+  const SDL_Rect rect = {0, first * scale, chip8::kHiResWidth,
+                         (last - first + 1) * scale};
+  void* pixels = nullptr;
+  int pitch = 0;
+  if (SDL_LockTexture(texture_, &rect, &pixels, &pitch) != 0)
+    return;
 
-  if (len != -1) {
-    data.resize(len);
-    is.seekg(0, std::ios::beg);
-    is.read((char*)data.data(), data.size());
+  for (uint8_t y = first; y <= last; ++y) {
+    auto line = reinterpret_cast<Uint32*>(static_cast<uint8_t*>(pixels) +
+                                          (y - first) * scale * pitch);
+    for (uint8_t x = 0; x < width; ++x) {
+      uint8_t pixel = 0;
+      for (uint8_t plane = 0; plane < chip8::kPlanes; ++plane) {
+        const auto row =
+            frame.display[chip8::GetDisplayIndex(plane, x / 64, y)];
+        pixel |= ((row >> (63 - x % 64)) & 1) << plane;
+      }
+      for (uint8_t i = 0; i < scale; ++i)
+        line[x * scale + i] = kPalette[pixel];
+    }
+    if (scale > 1) {
+      std::copy(line, line + chip8::kHiResWidth,
+                reinterpret_cast<Uint32*>(reinterpret_cast<uint8_t*>(line) +
+                                          pitch));
+    }
   }
 
-  is.close();
-  return len != -1;
+  SDL_UnlockTexture(texture_);
 }
 
 int main(int argc, char const *argv[]) {
@@ -172,22 +581,101 @@ int main(int argc, char const *argv[]) {
     return 1;
 
   std::vector<uint8_t> data;
-  if (!ReadFile(path, data))
+  if (!chip8::ReadProgram(path, data))
     return 1;
 
-  emulator.Reset();
-  emulator.Load(data);
-
   Engine engine;
+  engine.emulator().Seed(std::random_device()());
+
+  // --audio-buffer=N sets the audio device buffer, in samples.
+  // --run-ahead=N shows the display N frames ahead, or as many as the program
+  // is measured to lag with --run-ahead=auto. --record=path saves the input
+  // as a movie when the window is closed. --cycles-per-frame=N sets the speed.
+  // --quirks=chip8, cosmac, schip or xochip picks the interpreter behaviour.
+  uint16_t audio_buffer_samples = kAudioBufferSamples;
+  std::string record_path;
+  for (int i = 2; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const std::string audio_buffer = "--audio-buffer=";
+    const std::string cycles_per_frame = "--cycles-per-frame=";
+    const std::string quirks = "--quirks=";
+    const std::string record = "--record=";
+    const std::string run_ahead = "--run-ahead=";
+    if (arg.compare(0, audio_buffer.size(), audio_buffer) == 0) {
+      const auto value = arg.substr(audio_buffer.size());
+      audio_buffer_samples = std::strtoul(value.c_str(), nullptr, 10);
+    } else if (arg.compare(0, cycles_per_frame.size(), cycles_per_frame) == 0) {
+      const auto value = arg.substr(cycles_per_frame.size());
+      engine.emulator().set_cycles_per_frame(
+          std::strtoul(value.c_str(), nullptr, 10));
+    } else if (arg.compare(0, quirks.size(), quirks) == 0) {
+      chip8::QuirkProfile profile;
+      if (chip8::ParseQuirkProfile(arg.substr(quirks.size()), profile))
+        engine.emulator().set_quirks(profile);
+    } else if (arg.compare(0, record.size(), record) == 0) {
+      record_path = arg.substr(record.size());
+    } else if (arg.compare(0, run_ahead.size(), run_ahead) == 0) {
+      const auto value = arg.substr(run_ahead.size());
+      if (value == "auto") {
+        engine.run_ahead().set_auto_tune(true);
+      } else {
+        engine.run_ahead().set_frames(std::strtoul(value.c_str(), nullptr, 10));
+      }
+    }
+  }
+
+  // The profile decides how large a program fits
+  engine.emulator().Reset();
+  if (!engine.emulator().Load(data))
+    return 1;
+
+  // Once the settings that the movie stores are known
+  if (!record_path.empty())
+    engine.StartRecording(record_path, data);
+
   if (!engine.Initialize() ||
       !engine.CreateWindow("CHIP-8 Emulator [" + filename + "]",
                            chip8::kDisplayWidth * kDisplayMultiplier,
                            chip8::kDisplayHeight * kDisplayMultiplier) ||
-      !engine.CreateRenderer()) {
+      !engine.CreateRenderer() ||
+      !engine.CreateTexture(chip8::kHiResWidth, chip8::kHiResHeight)) {
     return 1;
   }
-  engine.EnableAudio();
+  engine.EnableAudio(audio_buffer_samples);
+  engine.StartEmulation();
   engine.Loop();
+  engine.StopEmulation();
+
+  const auto stats = engine.scheduler().stats();
+  std::cout << "Frames: " << stats.frames << " run, " << stats.dropped
+            << " dropped, jitter " << stats.mean_jitter << " us on average ("
+            << stats.deviation << " us deviation, " << stats.max_jitter
+            << " us at most)\n";
+
+  const auto& latency = engine.latency();
+  if (latency.frames > 1) {
+    std::cout << "Presented: " << latency.frames << " frames, "
+              << latency.skipped << " skipped, "
+              << latency.interval_sum / (latency.frames - 1)
+              << " ms apart on average (" << latency.interval_max
+              << " ms at most)\n";
+  }
+  if (latency.inputs) {
+    std::cout << "Input to photon: " << latency.input_sum / latency.inputs
+              << " ms on average (" << latency.input_max << " ms at most)\n";
+  }
+
+  std::cout << "Audio: " << engine.audio().underruns() << " frames late, "
+            << engine.audio().skipped() << " dropped\n";
+
+  if (engine.StopRecording())
+    std::cout << "Movie saved\n";
+
+  const auto& rewind = engine.rewind();
+  std::cout << "Rewind: " << rewind.frames() << " frames in "
+            << rewind.size() / 1024 << " KiB (" << rewind.footprint() / 1024
+            << " KiB total), " << rewind.average_record_time()
+            << " us per frame\n";
 
   return 0;
 }
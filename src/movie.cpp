@@ -0,0 +1,141 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#include "movie.h"
+
+namespace chip8 {
+
+constexpr char kMovieMagic[4] = {'C', '8', 'M', 'V'};
+
+template <typename T>
+static void Put(std::vector<uint8_t>& data, T value) {
+  for (size_t i = 0; i < sizeof(T); ++i)
+    data.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+template <typename T>
+static bool Get(const std::vector<uint8_t>& data, size_t& position, T& value) {
+  if (data.size() - position < sizeof(T))
+    return false;
+  value = 0;
+  for (size_t i = 0; i < sizeof(T); ++i)
+    value |= static_cast<T>(data[position++]) << (8 * i);
+  return true;
+}
+
+bool ReadMovie(const std::string& path, Movie& movie) {
+  std::ifstream is(path, std::ios::binary);
+  if (!is)
+    return false;
+
+  const std::vector<uint8_t> data{std::istreambuf_iterator<char>(is),
+                                  std::istreambuf_iterator<char>()};
+  if (data.size() < sizeof(kMovieMagic) ||
+      !std::equal(kMovieMagic, kMovieMagic + sizeof(kMovieMagic),
+                  data.begin())) {
+    return false;
+  }
+
+  size_t position = sizeof(kMovieMagic);
+  uint32_t version = 0;
+  uint32_t quirks = 0;
+  uint32_t count = 0;
+  if (!Get(data, position, version) || version != kMovieVersion ||
+      !Get(data, position, movie.seed) ||
+      !Get(data, position, movie.program_hash) ||
+      !Get(data, position, movie.cycles_per_frame) ||
+      !Get(data, position, quirks) ||
+      quirks > static_cast<uint32_t>(QuirkProfile::kXoChip) ||
+      !Get(data, position, movie.cycles) ||
+      !Get(data, position, movie.display_hash) ||
+      !Get(data, position, count)) {
+    return false;
+  }
+  movie.quirks = static_cast<QuirkProfile>(quirks);
+
+  movie.input.clear();
+  movie.input.reserve(count);
+
+  uint64_t cycle = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint64_t delta = 0;
+    for (int shift = 0; ; shift += 7) {
+      if (position >= data.size() || shift > 63)
+        return false;
+      const uint8_t byte = data[position++];
+      delta |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80))
+        break;
+    }
+    if (position >= data.size())
+      return false;
+    const uint8_t key = data[position++];
+
+    cycle += delta;
+    movie.input.push_back({cycle, static_cast<uint8_t>(key & 0x0F),
+                           (key & 0x80) != 0});
+  }
+
+  return true;
+}
+
+bool WriteMovie(const std::string& path, const Movie& movie) {
+  std::vector<uint8_t> data(kMovieMagic, kMovieMagic + sizeof(kMovieMagic));
+  Put(data, kMovieVersion);
+  Put(data, movie.seed);
+  Put(data, movie.program_hash);
+  Put(data, movie.cycles_per_frame);
+  Put(data, static_cast<uint32_t>(movie.quirks));
+  Put(data, movie.cycles);
+  Put(data, movie.display_hash);
+  Put(data, static_cast<uint32_t>(movie.input.size()));
+
+  uint64_t cycle = 0;
+  for (const auto& event : movie.input) {
+    uint64_t delta = event.cycle - cycle;
+    while (delta >= 0x80) {
+      data.push_back(static_cast<uint8_t>(delta | 0x80));
+      delta >>= 7;
+    }
+    data.push_back(static_cast<uint8_t>(delta));
+    data.push_back((event.key & 0x0F) | (event.pressed ? 0x80 : 0x00));
+    cycle = event.cycle;
+  }
+
+  std::ofstream os(path, std::ios::binary);
+  os.write(reinterpret_cast<const char*>(data.data()), data.size());
+  return static_cast<bool>(os);
+}
+
+StopReason PlayMovie(Emulator& emulator, const Movie& movie) {
+  emulator.set_cycles_per_frame(movie.cycles_per_frame);
+  emulator.set_quirks(movie.quirks);
+  return RunScript(emulator, movie.input, movie.cycles);
+}
+
+}  // namespace chip8
@@ -0,0 +1,60 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "runner.h"
+
+namespace chip8 {
+
+constexpr uint32_t kMovieVersion = 1;
+
+// A recorded session: the input, and everything else that a replay needs to
+// end up in the same state. Replaying the input with RunScript() for
+// `cycles` instructions must reproduce `display_hash`.
+struct Movie {
+  uint64_t seed = kDefaultSeed;
+  uint64_t program_hash = 0;
+  uint32_t cycles_per_frame = kDefaultCyclesPerFrame;
+  QuirkProfile quirks = QuirkProfile::kChip8;
+  uint64_t cycles = 0;        // instructions executed while recording
+  uint64_t display_hash = 0;  // of the display when recording ended
+  std::vector<InputEvent> input;  // sorted by cycle
+};
+
+// Files start with a fixed little-endian header, followed by one event per
+// key change: the cycles since the previous event as 7-bit groups, then the
+// key with the pressed state in the highest bit.
+bool ReadMovie(const std::string& path, Movie& movie);
+bool WriteMovie(const std::string& path, const Movie& movie);
+
+// Emulator must be reset with the movie's seed and have the program loaded
+StopReason PlayMovie(Emulator& emulator, const Movie& movie);
+
+}  // namespace chip8
@@ -0,0 +1,178 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <iomanip>
+
+#include "chip8.h"
+#include "profile.h"
+
+namespace chip8 {
+
+// In the order of Opcode
+static const char* const kOpcodeNames[] = {
+  "none", "00E0", "00EE", "1nnn", "2nnn", "3xkk", "4xkk", "5xy0", "6xkk",
+  "7xkk", "8xy0", "8xy1", "8xy2", "8xy3", "8xy4", "8xy5", "8xy6", "8xy7",
+  "8xyE", "9xy0", "Annn", "Bnnn", "Cxkk", "Dxyn", "Ex9E", "ExA1", "Fx07",
+  "Fx0A", "Fx15", "Fx18", "Fx1E", "Fx29", "Fx33", "Fx55", "Fx65", "00Cn",
+  "00FB", "00FC", "00FD", "00FE", "00FF", "Fx30", "Fx75", "Fx85", "00Dn",
+  "5xy2", "5xy3", "F000", "Fx01", "unknown",
+};
+
+static_assert(sizeof(kOpcodeNames) / sizeof(*kOpcodeNames) ==
+                  static_cast<size_t>(Opcode::kUnknown) + 1,
+              "Opcode names are out of date");
+
+static const char* GetOpcodeName(uint8_t op) {
+  return op <= static_cast<uint8_t>(Opcode::kUnknown) ? kOpcodeNames[op]
+                                                      : "?";
+}
+
+void Profile::Count(uint16_t pc, uint8_t op, const uint16_t* stack,
+                    uint8_t sp, const uint8_t* memory, uint16_t address_mask) {
+  ++instructions_;
+  ++opcodes_[op % kOpcodes];
+  ++addresses_[pc & address_mask];
+
+  uint64_t hash = 0xCBF29CE484222325;  // FNV-1a
+  uint16_t frames[16];
+  const uint8_t depth = std::min<uint8_t>(sp, 16);
+  for (uint8_t i = 0; i < depth; ++i) {
+    const uint16_t call = (stack[i] - 2) & address_mask;
+    frames[i] = (memory[call] << 8 | memory[(call + 1) & address_mask]) &
+                0x0FFF;
+    hash = (hash ^ frames[i]) * 0x100000001B3;
+  }
+  hash = (hash ^ (0x10000 | op)) * 0x100000001B3;
+
+  auto& bucket = stacks_[hash];
+  auto entry = std::find_if(bucket.begin(), bucket.end(),
+                            [&](const Stack& stack) {
+    return stack.op == op && std::equal(stack.frames.begin(),
+                                        stack.frames.end(), frames,
+                                        frames + depth);
+  });
+  if (entry == bucket.end()) {
+    bucket.push_back({std::vector<uint16_t>(frames, frames + depth), op, 0});
+    entry = bucket.end() - 1;
+  }
+  ++entry->count;
+}
+
+void Profile::AddTime(uint8_t op, uint64_t nanoseconds) {
+  times_[op % kOpcodes] += nanoseconds;
+}
+
+void Profile::Clear() {
+  instructions_ = 0;
+  opcodes_.fill(0);
+  times_.fill(0);
+  std::fill(addresses_.begin(), addresses_.end(), 0);
+  stacks_.clear();
+}
+
+uint64_t Profile::instructions() const {
+  return instructions_;
+}
+
+uint64_t Profile::opcode_count(uint8_t op) const {
+  return opcodes_[op % kOpcodes];
+}
+
+uint64_t Profile::address_count(uint16_t address) const {
+  return addresses_[address & kXoChipAddressMask];
+}
+
+uint64_t Profile::opcode_time(uint8_t op) const {
+  return times_[op % kOpcodes];
+}
+
+void Profile::WriteReport(std::ostream& os, size_t top) const {
+  const auto flags = os.flags();
+  const auto total = std::max<uint64_t>(1, instructions_);
+  os << std::fixed << std::setprecision(2);
+
+  std::vector<uint8_t> ops;
+  for (uint8_t op = 0; op < kOpcodes; ++op) {
+    if (opcodes_[op])
+      ops.push_back(op);
+  }
+  std::sort(ops.begin(), ops.end(), [this](uint8_t a, uint8_t b) {
+    return opcodes_[a] > opcodes_[b];
+  });
+
+  os << "Instructions: " << instructions_ << "\n\n"
+     << "opcode         count       %     total ms   ns/call\n";
+  for (const auto op : ops) {
+    os << std::left << std::setw(8) << GetOpcodeName(op) << std::right
+       << std::setw(12) << opcodes_[op] << std::setw(8)
+       << 100.0 * opcodes_[op] / total;
+    if (times_[op]) {
+      os << std::setw(13) << times_[op] / 1e6 << std::setw(10)
+         << static_cast<double>(times_[op]) / opcodes_[op];
+    }
+    os << "\n";
+  }
+
+  std::vector<uint16_t> addresses;
+  for (uint32_t address = 0; address < addresses_.size(); ++address) {
+    if (addresses_[address])
+      addresses.push_back(address);
+  }
+  top = std::min(top, addresses.size());
+  std::partial_sort(addresses.begin(), addresses.begin() + top,
+                    addresses.end(), [this](uint16_t a, uint16_t b) {
+    return addresses_[a] > addresses_[b];
+  });
+
+  os << "\naddress        count       %\n";
+  for (size_t i = 0; i < top; ++i) {
+    const auto address = addresses[i];
+    os << "0x" << std::hex << std::uppercase << std::setw(3)
+       << std::setfill('0') << address << std::dec << std::nouppercase
+       << std::setfill(' ') << std::setw(15) << addresses_[address]
+       << std::setw(8) << 100.0 * addresses_[address] / total << "\n";
+  }
+
+  os.flags(flags);
+}
+
+void Profile::WriteFoldedStacks(std::ostream& os) const {
+  const auto flags = os.flags();
+  os << std::hex << std::uppercase;
+
+  for (const auto& pair : stacks_) {
+    for (const auto& stack : pair.second) {
+      os << "main";
+      for (const auto frame : stack.frames)
+        os << ";sub_" << frame;
+      os << ';' << GetOpcodeName(stack.op) << ' ' << std::dec << stack.count
+         << std::hex << '\n';
+    }
+  }
+
+  os.flags(flags);
+}
+
+}  // namespace chip8
@@ -0,0 +1,76 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+namespace chip8 {
+
+// Execution counts and handler timings, collected by emulators when the core
+// is built with CHIP8_PROFILE defined. Otherwise no emulator has one, and the
+// hot paths are left untouched.
+class Profile {
+public:
+  static constexpr size_t kOpcodes = 64;  // more than there are Opcode values
+
+  // Called before every instruction. The call stack is resolved to the
+  // subroutines that were called, by reading the CALL instructions that the
+  // return addresses point after, wrapped by `address_mask`.
+  void Count(uint16_t pc, uint8_t op, const uint16_t* stack, uint8_t sp,
+             const uint8_t* memory, uint16_t address_mask);
+  void AddTime(uint8_t op, uint64_t nanoseconds);
+  void Clear();
+
+  uint64_t instructions() const;
+  uint64_t opcode_count(uint8_t op) const;
+  uint64_t address_count(uint16_t address) const;
+  uint64_t opcode_time(uint8_t op) const;  // in nanoseconds
+
+  // Instruction mix, timed handlers and the hottest `top` addresses
+  void WriteReport(std::ostream& os, size_t top = 20) const;
+  // One line per call stack and instruction, e.g. "main;sub_2A4;Dxyn 1200",
+  // as expected by flame graph tools
+  void WriteFoldedStacks(std::ostream& os) const;
+
+private:
+  struct Stack {
+    std::vector<uint16_t> frames;  // subroutine addresses, outermost first
+    uint8_t op = 0;
+    uint64_t count = 0;
+  };
+
+  uint64_t instructions_ = 0;
+  std::array<uint64_t, kOpcodes> opcodes_{};
+  std::array<uint64_t, kOpcodes> times_{};
+  std::vector<uint64_t> addresses_ = std::vector<uint64_t>(0x10000);
+  // By hash of frames and op. Stacks whose hashes collide share a bucket.
+  std::unordered_map<uint64_t, std::vector<Stack>> stacks_;
+};
+
+}  // namespace chip8
@@ -0,0 +1,395 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Translates a program into C++ that runs with Executor::kAot once it is
+// compiled and linked into an executable along with the core.
+//
+// Usage: recompile <program> <output.cpp> [--cache=DIR]
+//   --cache=DIR  reuse the analysis stored in DIR, or store it there
+//
+// Each basic block found by the analysis becomes one function.
+// Register, timer, flow and RND instructions are translated inline, with the
+// quirks of 8xy6, 8xyE and Bnnn checked at run time, while drawing, memory
+// stores and the rest call the emulator's own handlers. Blocks are only
+// entered through the program counter, so indirect jumps and returns find
+// them at run time as well.
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "analysis.h"
+#include "chip8.h"
+
+namespace {
+
+// Indexed by Opcode
+const char* const kOpcodeNames[] = {
+  "kNone",
+  "k00E0", "k00EE", "k1nnn", "k2nnn", "k3xkk", "k4xkk", "k5xy0", "k6xkk",
+  "k7xkk", "k8xy0", "k8xy1", "k8xy2", "k8xy3", "k8xy4", "k8xy5", "k8xy6",
+  "k8xy7", "k8xyE", "k9xy0", "kAnnn", "kBnnn", "kCxkk", "kDxyn", "kEx9E",
+  "kExA1", "kFx07", "kFx0A", "kFx15", "kFx18", "kFx1E", "kFx29", "kFx33",
+  "kFx55", "kFx65", "k00Cn", "k00FB", "k00FC", "k00FD", "k00FE", "k00FF",
+  "kFx30", "kFx75", "kFx85", "k00Dn", "k5xy2", "k5xy3", "kF000", "kFx01",
+  "kUnknown",
+};
+static_assert(sizeof(kOpcodeNames) / sizeof(kOpcodeNames[0]) ==
+              static_cast<size_t>(chip8::Opcode::kUnknown) + 1,
+              "Name table must match Opcode");
+
+// Whether an instruction is translated to C++ without ever calling a handler.
+// Calls and returns do, but only when the stack faults.
+bool IsInline(chip8::Opcode op) {
+  switch (op) {
+    case chip8::Opcode::k1nnn:
+    case chip8::Opcode::k3xkk:
+    case chip8::Opcode::k4xkk:
+    case chip8::Opcode::k5xy0:
+    case chip8::Opcode::k6xkk:
+    case chip8::Opcode::k7xkk:
+    case chip8::Opcode::k8xy0:
+    case chip8::Opcode::k8xy1:
+    case chip8::Opcode::k8xy2:
+    case chip8::Opcode::k8xy3:
+    case chip8::Opcode::k8xy4:
+    case chip8::Opcode::k8xy5:
+    case chip8::Opcode::k8xy6:
+    case chip8::Opcode::k8xy7:
+    case chip8::Opcode::k8xyE:
+    case chip8::Opcode::k9xy0:
+    case chip8::Opcode::kAnnn:
+    case chip8::Opcode::kBnnn:
+    case chip8::Opcode::kCxkk:
+    case chip8::Opcode::kEx9E:
+    case chip8::Opcode::kExA1:
+    case chip8::Opcode::kFx07:
+    case chip8::Opcode::kFx15:
+    case chip8::Opcode::kFx1E:
+    case chip8::Opcode::kFx29:
+    case chip8::Opcode::kFx30:
+      return true;
+    default:
+      return false;
+  }
+}
+
+std::string Hex(unsigned value, int digits) {
+  char buffer[16];
+  std::snprintf(buffer, sizeof(buffer), "0x%0*X", digits, value);
+  return buffer;
+}
+
+class Recompiler {
+public:
+  Recompiler(const std::vector<uint8_t>& program,
+             const chip8::Analysis& analysis)
+      : program_(program), analysis_(analysis) {}
+
+  void Write(std::ostream& os, const std::string& name) const;
+
+private:
+  chip8::Instruction Decode(uint16_t address) const;
+  void WriteBlock(std::ostream& os, const chip8::BasicBlock& block) const;
+
+  const std::vector<uint8_t>& program_;
+  const chip8::Analysis& analysis_;
+};
+
+chip8::Instruction Recompiler::Decode(uint16_t address) const {
+  const size_t offset = address - chip8::kProgramOffset;
+  return chip8::Decode(program_[offset] << 8 | program_[offset + 1]);
+}
+
+void Recompiler::WriteBlock(std::ostream& os,
+                            const chip8::BasicBlock& block) const {
+  uint16_t address = block.address;
+  const auto name = "b_" + Hex(address, 4).substr(2);
+  std::ostringstream body;
+  bool uses_emulator = false;
+  bool shifts_vy = false;  // whether a shift depends on the quirk
+  bool jumped = false;
+
+  for (uint16_t j = 0; j < block.length; ++j) {
+    const auto instruction = Decode(address);
+    const auto x = "p.v[" + Hex(instruction.x, 1) + "]";
+    const auto y = "p.v[" + Hex(instruction.y, 1) + "]";
+    const auto kk = Hex(instruction.kk, 2);
+    // The program counter wraps at the end of the address space, as in the
+    // core, rather than reaching 0x10000
+    const auto next = Hex((address + 2) & chip8::kXoChipAddressMask, 4);
+    const auto skip = "Aot::Skip(e, " + next + ")";
+    const auto i = "i_" + Hex(address, 4).substr(2);
+    // Shifted by 8xy6 and 8xyE, which only depends on the quirk if x != y
+    const auto shifted = instruction.x == instruction.y ? x :
+        "(shift_vy ? " + y + " : " + x + ")";
+    std::string line;
+
+    switch (instruction.op) {
+      case chip8::Opcode::k1nnn:
+        line = "p.pc = " + Hex(instruction.nnn, 4) + ";";
+        jumped = true;
+        break;
+      case chip8::Opcode::k3xkk:
+        line = "p.pc = " + x + " == " + kk + " ? " + skip + " : " + next + ";";
+        uses_emulator = true;
+        jumped = true;
+        break;
+      case chip8::Opcode::k4xkk:
+        line = "p.pc = " + x + " != " + kk + " ? " + skip + " : " + next + ";";
+        uses_emulator = true;
+        jumped = true;
+        break;
+      case chip8::Opcode::k5xy0:
+        line = "p.pc = " + x + " == " + y + " ? " + skip + " : " + next + ";";
+        uses_emulator = true;
+        jumped = true;
+        break;
+      case chip8::Opcode::k9xy0:
+        line = "p.pc = " + x + " != " + y + " ? " + skip + " : " + next + ";";
+        uses_emulator = true;
+        jumped = true;
+        break;
+      case chip8::Opcode::kEx9E:
+        line = "p.pc = " + x + " < 16 && e.input[" + x + "] ? " + skip +
+               " : " + next + ";";
+        uses_emulator = true;
+        jumped = true;
+        break;
+      case chip8::Opcode::kExA1:
+        line = "p.pc = " + x + " < 16 && e.input[" + x + "] ? " + next +
+               " : " + skip + ";";
+        uses_emulator = true;
+        jumped = true;
+        break;
+      case chip8::Opcode::k6xkk: line = x + " = " + kk + ";"; break;
+      case chip8::Opcode::k7xkk: line = x + " += " + kk + ";"; break;
+      case chip8::Opcode::k8xy0: line = x + " = " + y + ";"; break;
+      case chip8::Opcode::k8xy1: line = x + " |= " + y + ";"; break;
+      case chip8::Opcode::k8xy2: line = x + " &= " + y + ";"; break;
+      case chip8::Opcode::k8xy3: line = x + " ^= " + y + ";"; break;
+      // The flag is written last, as in the handlers, in case x is F
+      case chip8::Opcode::k8xy4:
+        line = "{ const unsigned sum = " + x + " + " + y + "; " + x +
+               " = static_cast<uint8_t>(sum); p.v[0xF] = sum >> 8; }";
+        break;
+      case chip8::Opcode::k8xy5:
+        line = "{ const bool flag = " + x + " > " + y + "; " + x + " -= " +
+               y + "; p.v[0xF] = flag; }";
+        break;
+      case chip8::Opcode::k8xy6:
+        line = "{ const uint8_t value = " + shifted + "; " + x +
+               " = value >> 1; p.v[0xF] = value & 1; }";
+        shifts_vy |= instruction.x != instruction.y;
+        break;
+      case chip8::Opcode::k8xy7:
+        line = "{ const bool flag = " + y + " > " + x + "; " + x + " = " + y +
+               " - " + x + "; p.v[0xF] = flag; }";
+        break;
+      case chip8::Opcode::k8xyE:
+        line = "{ const uint8_t value = " + shifted + "; " + x +
+               " = value << 1; p.v[0xF] = value >> 7; }";
+        shifts_vy |= instruction.x != instruction.y;
+        break;
+      case chip8::Opcode::kAnnn:
+        line = "p.i = " + Hex(instruction.nnn, 3) + ";";
+        break;
+      case chip8::Opcode::kBnnn:
+        if (instruction.x == 0) {
+          line = "p.pc = " + Hex(instruction.nnn, 4) + " + p.v[0x0];";
+        } else {
+          line = "p.pc = " + Hex(instruction.nnn, 4) +
+                 " + p.v[Aot::JumpsVx(e) ? " + Hex(instruction.x, 1) +
+                 " : 0x0];";
+          uses_emulator = true;
+        }
+        jumped = true;
+        break;
+      case chip8::Opcode::kCxkk:
+        line = x + " = Aot::Random(e) & " + kk + ";";
+        uses_emulator = true;
+        break;
+      case chip8::Opcode::kFx07: line = x + " = p.dt;"; break;
+      case chip8::Opcode::kFx15: line = "p.dt = " + x + ";"; break;
+      case chip8::Opcode::kFx1E: line = "p.i += " + x + ";"; break;
+      case chip8::Opcode::kFx29:
+        line = "p.i = " + x + " * " +
+               std::to_string(chip8::kDefaultSpriteHeight) + ";";
+        break;
+      case chip8::Opcode::kFx30:
+        line = "p.i = " + Hex(chip8::kBigFontOffset, 3) + " + (" + x +
+               " & 0xF) * " + std::to_string(chip8::kBigSpriteHeight) + ";";
+        break;
+      // The handlers only run to report a stack fault
+      case chip8::Opcode::k2nnn:
+        line = "if (p.sp < p.stack.size()) { p.stack[p.sp++] = " + next +
+               "; p.pc = " + Hex(instruction.nnn, 4) + "; } else { p.pc = " +
+               next + "; Aot::Call(e, " + i + "); }";
+        uses_emulator = true;
+        jumped = true;
+        break;
+      case chip8::Opcode::k00EE:
+        line = "if (p.sp > 0) { p.pc = p.stack[--p.sp]; } else { p.pc = " +
+               next + "; Aot::Call(e, " + i + "); }";
+        uses_emulator = true;
+        jumped = true;
+        break;
+      default:
+        // Handlers that may change the program counter expect it to point
+        // at the next instruction already
+        if (chip8::IsBlockEnd(instruction.op)) {
+          line = "p.pc = " + next + "; ";
+          jumped = true;
+        }
+        line += "Aot::Call(e, " + i + ");";
+        uses_emulator = true;
+        break;
+    }
+
+    body << "  " << line << "  // " << Hex(address, 4).substr(2) << ": "
+         << Hex(instruction.code, 4).substr(2) << " "
+         << chip8::Disassemble(instruction) << "\n";
+    address += 2;
+  }
+
+  if (!jumped)
+    body << "  p.pc = " << Hex(address, 4) << ";\n";
+
+  // The profile cannot change while a block runs
+  os << "void " << name << "(Processor& p, Emulator&"
+     << (uses_emulator || shifts_vy ? " e" : "") << ") {\n";
+  if (shifts_vy)
+    os << "  const bool shift_vy = Aot::ShiftsVy(e);\n";
+  os << body.str() << "}\n\n";
+}
+
+void Recompiler::Write(std::ostream& os, const std::string& name) const {
+  os << "// Generated by chip8-recompile from " << name << ", do not edit.\n"
+     << "\n"
+     << "#include \"aot.h\"\n"
+     << "\n"
+     << "namespace {\n"
+     << "\n"
+     << "using chip8::Aot;\n"
+     << "using chip8::Emulator;\n"
+     << "using chip8::Instruction;\n"
+     << "using chip8::Opcode;\n"
+     << "using chip8::Processor;\n"
+     << "\n";
+
+  // Instructions that are executed by the emulator's handlers
+  std::set<uint16_t> calls;
+  for (const auto& block : analysis_.blocks) {
+    uint16_t address = block.address;
+    for (uint16_t j = 0; j < block.length; ++j) {
+      const auto instruction = Decode(address);
+      if (!IsInline(instruction.op) && calls.insert(address).second) {
+        os << "const Instruction i_" << Hex(address, 4).substr(2)
+           << " = {" << Hex(instruction.code, 4) << ", "
+           << Hex(instruction.nnn, 3) << ", " << Hex(instruction.kk, 2)
+           << ", " << Hex(instruction.n, 1) << ", "
+           << Hex(instruction.x, 1) << ", " << Hex(instruction.y, 1)
+           << ", Opcode::"
+           << kOpcodeNames[static_cast<size_t>(instruction.op)] << "};\n";
+      }
+      address += 2;
+    }
+  }
+  if (!calls.empty())
+    os << "\n";
+
+  for (const auto& block : analysis_.blocks)
+    WriteBlock(os, block);
+
+  os << "const chip8::AotBlock kBlocks[] = {\n";
+  for (const auto& block : analysis_.blocks) {
+    os << "  {" << Hex(block.address, 4) << ", " << block.length << ", &b_"
+       << Hex(block.address, 4).substr(2) << "},\n";
+  }
+  os << "};\n"
+     << "\n"
+     << "const chip8::AotProgram kProgram = {\n"
+     << "  0x" << std::hex << analysis_.program_hash << std::dec
+     << ", kBlocks, sizeof(kBlocks) / sizeof(kBlocks[0]),\n"
+     << "};\n"
+     << "\n"
+     << "const chip8::AotRegistration registration(kProgram);\n"
+     << "\n"
+     << "}  // namespace\n";
+}
+
+}  // namespace
+
+int main(int argc, char const *argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0]
+              << " <program> <output.cpp> [--cache=DIR]\n";
+    return 1;
+  }
+
+  const std::string path = argv[1];
+  std::vector<uint8_t> program;
+  if (!chip8::ReadProgram(path, program)) {
+    std::cerr << "Cannot read program: " << path << "\n";
+    return 1;
+  }
+
+  chip8::Analysis analysis;
+  const std::string cache = "--cache=";
+  if (argc > 3 && std::string(argv[3]).compare(0, cache.size(), cache) == 0) {
+    chip8::AnalyzeCached(program, argv[3] + cache.size(), analysis);
+  } else {
+    chip8::Analyze(program, analysis);
+  }
+  if (analysis.blocks.empty()) {
+    std::cerr << "No code found\n";
+    return 1;
+  }
+
+  std::ofstream os(argv[2]);
+  Recompiler(program, analysis)
+      .Write(os, path.substr(path.find_last_of("/\\") + 1));
+  if (!os) {
+    std::cerr << "Cannot write: " << argv[2] << "\n";
+    return 1;
+  }
+
+  size_t instructions = 0;
+  for (size_t offset = 0; offset < analysis.flags.size(); ++offset) {
+    if (analysis.flags[offset] & chip8::kFlagCode)
+      ++instructions;
+  }
+  std::cout << analysis.blocks.size() << " blocks, " << instructions
+            << " instructions reached out of " << program.size() / 2
+            << " words\n";
+  if (analysis.self_modifying()) {
+    std::cout << "The program may modify its own code, which is then "
+              << "interpreted\n";
+  }
+  return 0;
+}
@@ -0,0 +1,105 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Replays a movie without a display, as fast as possible. Exits with a
+// non-zero status if the replay does not end in the recorded state.
+//
+// Usage: replay <program> <movie> [interpreter|threaded|jit|aot] [repeat]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "chip8.h"
+#include "movie.h"
+#include "runner.h"
+
+int main(int argc, char const *argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0]
+              << " <program> <movie> [interpreter|threaded|jit|aot] [repeat]\n";
+    return 1;
+  }
+
+  std::vector<uint8_t> program;
+  if (!chip8::ReadProgram(argv[1], program)) {
+    std::cerr << "Cannot read program: " << argv[1] << "\n";
+    return 1;
+  }
+
+  chip8::Movie movie;
+  if (!chip8::ReadMovie(argv[2], movie)) {
+    std::cerr << "Cannot read movie: " << argv[2] << "\n";
+    return 1;
+  }
+  if (chip8::HashProgram(program) != movie.program_hash) {
+    std::cerr << "Movie was recorded with a different program\n";
+    return 1;
+  }
+
+  auto executor = chip8::Executor::kThreaded;
+  if (argc > 3) {
+    const std::string name = argv[3];
+    if (name == "interpreter") {
+      executor = chip8::Executor::kInterpreter;
+    } else if (name == "threaded") {
+      executor = chip8::Executor::kThreaded;
+    } else if (name == "jit") {
+      executor = chip8::Executor::kJit;
+    } else if (name == "aot") {
+      executor = chip8::Executor::kAot;
+    } else {
+      std::cerr << "Unknown executor: " << name << "\n";
+      return 1;
+    }
+  }
+  const int repeat = argc > 4 ? std::max(1, std::atoi(argv[4])) : 1;
+
+  chip8::Emulator emulator(executor, movie.quirks);
+  emulator.Seed(movie.seed);
+
+  bool matched = true;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < repeat; ++i) {
+    emulator.Reset();
+    emulator.Load(program);
+    chip8::PlayMovie(emulator, movie);
+    matched &= emulator.cycles() == movie.cycles &&
+               chip8::HashDisplay(emulator.display) == movie.display_hash;
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  const double cycles = static_cast<double>(movie.cycles) * repeat;
+  std::cout << movie.input.size() << " events, " << movie.cycles
+            << " instructions, " << repeat << " run(s) in " << elapsed.count()
+            << " s, " << cycles / elapsed.count() / 1000000.0 << " MIPS\n"
+            << "Display hash: " << std::hex
+            << chip8::HashDisplay(emulator.display) << std::dec
+            << (matched ? " (matches)\n" : " (MISMATCH)\n");
+
+  return matched ? 0 : 2;
+}
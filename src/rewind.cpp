@@ -0,0 +1,312 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "rewind.h"
+
+namespace chip8 {
+
+// Records are a sequence of (skip, count, count bytes) runs, where skip is the
+// number of unchanged bytes and the bytes are XORed into the reference. Both
+// lengths are stored as 7-bit groups, least significant first.
+
+static size_t PutLength(size_t length, uint8_t* out) {
+  size_t size = 0;
+  while (length >= 0x80) {
+    out[size++] = static_cast<uint8_t>(length | 0x80);
+    length >>= 7;
+  }
+  out[size++] = static_cast<uint8_t>(length);
+  return size;
+}
+
+static size_t GetLength(const uint8_t* in, size_t& length) {
+  size_t size = 0;
+  length = 0;
+  for (int shift = 0; ; shift += 7) {
+    const uint8_t byte = in[size++];
+    length |= static_cast<size_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      break;
+  }
+  return size;
+}
+
+// A null reference is treated as all zeros
+static size_t Encode(const uint8_t* data, const uint8_t* reference,
+                     size_t size, uint8_t* out) {
+  auto equal = [&](size_t position) {
+    return reference ? data[position] == reference[position]
+                     : data[position] == 0;
+  };
+
+  static const uint8_t kZeros[1024] = {};
+
+  size_t position = 0;
+  size_t out_size = 0;
+
+  while (position < size) {
+    // Most of a state is unchanged, so it is skipped a chunk at a time
+    size_t skip = position;
+    while (skip + sizeof(kZeros) <= size &&
+           !std::memcmp(data + skip, reference ? reference + skip : kZeros,
+                        sizeof(kZeros))) {
+      skip += sizeof(kZeros);
+    }
+    if (reference) {
+      while (skip + 8 <= size) {
+        uint64_t a, b;
+        std::memcpy(&a, data + skip, 8);
+        std::memcpy(&b, reference + skip, 8);
+        if (a != b)
+          break;
+        skip += 8;
+      }
+    }
+    while (skip < size && equal(skip))
+      ++skip;
+
+    // Short unchanged gaps are cheaper to store than to start a new run
+    size_t end = skip;
+    while (end < size) {
+      size_t gap = end;
+      while (gap < size && gap < end + 3 && equal(gap))
+        ++gap;
+      if (gap == size || gap == end + 3)
+        break;
+      end = gap + 1;
+    }
+
+    out_size += PutLength(skip - position, out + out_size);
+    out_size += PutLength(end - skip, out + out_size);
+    for (size_t i = skip; i < end; ++i)
+      out[out_size++] = reference ? data[i] ^ reference[i] : data[i];
+
+    position = end;
+  }
+
+  return out_size;
+}
+
+static void Apply(const uint8_t* in, size_t in_size, uint8_t* data) {
+  size_t position = 0;
+  for (size_t i = 0; i < in_size; ) {
+    size_t skip, count;
+    i += GetLength(in + i, skip);
+    i += GetLength(in + i, count);
+    position += skip;
+    for (size_t end = position + count; position < end; ++position)
+      data[position] ^= in[i++];
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Rewind::Rewind(size_t capacity, uint32_t keyframe_interval)
+    : capacity_(capacity),
+      keyframe_interval_(keyframe_interval ? keyframe_interval : 1),
+      state_(new State),
+      keyframe_(new State) {
+  Select(false);
+}
+
+void Rewind::Record(const Emulator& emulator) {
+  const auto start = std::chrono::steady_clock::now();
+
+  const bool xo_chip = emulator.memory.size() > kMemorySize;
+  if (xo_chip != xo_chip_) {
+    Clear();
+    Select(xo_chip);
+  }
+  if (xo_chip_) {
+    emulator.SaveState(*xo_chip_state_);
+  } else {
+    emulator.SaveState(*state_);
+  }
+  const uint8_t* data = state_data_;
+
+  auto keyframe_present = [this]() {
+    return !entries_.empty() && entries_.front().index <= keyframe_index_;
+  };
+
+  bool key = !has_keyframe_ || !keyframe_present() ||
+             next_index_ - keyframe_index_ >= keyframe_interval_;
+  size_t size = 0;
+
+  if (!key) {
+    size = Encode(data, keyframe_data_, state_size_, scratch_.data());
+    Reserve(size);
+    // The buffer is too small to keep a whole keyframe interval
+    key = !keyframe_present();
+  }
+  if (key) {
+    size = Encode(data, nullptr, state_size_, scratch_.data());
+    Reserve(size);
+    std::memcpy(keyframe_data_, data, state_size_);
+    keyframe_index_ = next_index_;
+    has_keyframe_ = true;
+  }
+
+  std::memcpy(&buffer_[head_], scratch_.data(), size);
+  entries_.push_back({next_index_++, keyframe_index_, head_, size});
+  head_ += size;
+  size_ += size;
+
+  const std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  record_time_ += elapsed.count();
+  ++record_count_;
+}
+
+bool Rewind::Seek(Emulator& emulator, size_t frames) {
+  if (entries_.empty())
+    return false;
+
+  // At least one record is kept, so that seeking past the start of the
+  // history keeps returning the oldest frame
+  while (frames-- && entries_.size() > 1) {
+    const auto& entry = entries_.back();
+    head_ = entry.offset;
+    size_ -= entry.size;
+    entries_.pop_back();
+  }
+
+  const auto& entry = entries_.back();
+  if (entry.keyframe == entry.index) {
+    Decode(entry, keyframe_data_);
+    keyframe_index_ = entry.index;
+    has_keyframe_ = true;
+    std::memcpy(state_data_, keyframe_data_, state_size_);
+  } else {
+    LoadKeyframe(entry.keyframe);
+    Decode(entry, state_data_);
+  }
+  next_index_ = entry.index + 1;
+
+  return xo_chip_ ? emulator.LoadState(*xo_chip_state_)
+                  : emulator.LoadState(*state_);
+}
+
+bool Rewind::Step(Emulator& emulator) {
+  return Seek(emulator, 1);
+}
+
+void Rewind::Clear() {
+  entries_.clear();
+  head_ = 0;
+  size_ = 0;
+  next_index_ = 0;
+  has_keyframe_ = false;
+}
+
+size_t Rewind::frames() const {
+  return entries_.size();
+}
+
+size_t Rewind::size() const {
+  return size_;
+}
+
+size_t Rewind::capacity() const {
+  return buffer_.size();
+}
+
+size_t Rewind::footprint() const {
+  return buffer_.size() + scratch_.size() + sizeof(State) * 2 +
+         (xo_chip_state_ ? sizeof(XoChipState) * 2 : 0) +
+         entries_.size() * sizeof(Entry);
+}
+
+double Rewind::average_record_time() const {
+  return record_count_ ? record_time_ / record_count_ : 0.0;
+}
+
+void Rewind::Select(bool xo_chip) {
+  xo_chip_ = xo_chip;
+  if (xo_chip_ && !xo_chip_state_) {
+    xo_chip_state_.reset(new XoChipState);
+    xo_chip_keyframe_.reset(new XoChipState);
+  }
+  state_data_ = xo_chip_ ? reinterpret_cast<uint8_t*>(xo_chip_state_.get())
+                         : reinterpret_cast<uint8_t*>(state_.get());
+  keyframe_data_ =
+      xo_chip_ ? reinterpret_cast<uint8_t*>(xo_chip_keyframe_.get())
+               : reinterpret_cast<uint8_t*>(keyframe_.get());
+  state_size_ = xo_chip_ ? sizeof(XoChipState) : sizeof(State);
+
+  // Worst case is every other byte changed, at three bytes per run
+  const size_t max_record_size = state_size_ / 2 * 3 + 16;
+  scratch_.resize(max_record_size);
+  buffer_.resize(std::max(capacity_, max_record_size * 2));
+}
+
+void Rewind::Reserve(size_t size) {
+  // Records that the new one would not fit after are dropped, and writing
+  // continues from the start of the buffer
+  if (head_ + size > buffer_.size()) {
+    while (!entries_.empty() && entries_.front().offset >= head_)
+      Evict();
+    head_ = 0;
+  }
+  while (!entries_.empty() && entries_.front().offset >= head_ &&
+         entries_.front().offset < head_ + size) {
+    Evict();
+  }
+}
+
+void Rewind::Evict() {
+  const auto index = entries_.front().index;
+  size_ -= entries_.front().size;
+  entries_.pop_front();
+
+  // Records cannot be decoded without their keyframe
+  while (!entries_.empty() && entries_.front().keyframe == index) {
+    size_ -= entries_.front().size;
+    entries_.pop_front();
+  }
+}
+
+void Rewind::Decode(const Entry& entry, uint8_t* state) const {
+  if (entry.keyframe == entry.index) {
+    std::memset(state, 0, state_size_);
+  } else {
+    std::memcpy(state, keyframe_data_, state_size_);
+  }
+  Apply(&buffer_[entry.offset], entry.size, state);
+}
+
+void Rewind::LoadKeyframe(uint64_t index) {
+  if (has_keyframe_ && keyframe_index_ == index)
+    return;
+
+  const auto& entry = entries_[index - entries_.front().index];
+  Decode(entry, keyframe_data_);
+  keyframe_index_ = index;
+  has_keyframe_ = true;
+}
+
+}  // namespace chip8
@@ -0,0 +1,104 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "chip8.h"
+
+namespace chip8 {
+
+constexpr size_t kDefaultRewindCapacity = 4 * 1024 * 1024;  // in bytes
+constexpr uint32_t kDefaultKeyframeInterval = 60;            // in frames
+
+// Keeps a bounded history of emulator states, one per recorded frame. Every
+// state is stored as the run-length encoded XOR against the last keyframe, so
+// restoring any of them decodes at most two records. The oldest frames are
+// dropped when the buffer is full. XO-CHIP programs are recorded as the larger
+// XoChipState, and switching to or from one clears the history.
+class Rewind {
+public:
+  explicit Rewind(size_t capacity = kDefaultRewindCapacity,
+                  uint32_t keyframe_interval = kDefaultKeyframeInterval);
+
+  void Record(const Emulator& emulator);
+
+  // Drops the latest `frames` records and restores the one before them.
+  // Returns false if there is nothing to restore.
+  bool Seek(Emulator& emulator, size_t frames);
+  bool Step(Emulator& emulator);  // same as Seek(emulator, 1)
+
+  void Clear();
+
+  size_t frames() const;
+  size_t size() const;       // bytes used by records
+  size_t capacity() const;   // bytes reserved for records
+  size_t footprint() const;  // total bytes, including working states
+  double average_record_time() const;  // in microseconds
+
+private:
+  struct Entry {
+    uint64_t index = 0;     // frame number
+    uint64_t keyframe = 0;  // frame number of the keyframe it depends on
+    size_t offset = 0;      // position in buffer_
+    size_t size = 0;
+  };
+
+  void Select(bool xo_chip);  // the states that records are made of
+  void Reserve(size_t size);
+  void Evict();
+  void Decode(const Entry& entry, uint8_t* state) const;
+  void LoadKeyframe(uint64_t index);
+
+  std::vector<uint8_t> buffer_;
+  std::vector<uint8_t> scratch_;  // encoded record before it is stored
+  std::deque<Entry> entries_;
+  size_t head_ = 0;  // where the next record is written in buffer_
+  size_t size_ = 0;
+  uint64_t next_index_ = 0;
+  size_t capacity_;
+  uint32_t keyframe_interval_;
+
+  std::unique_ptr<State> state_;     // current state being recorded
+  std::unique_ptr<State> keyframe_;  // decoded keyframe
+  // Likewise, allocated once an XO-CHIP program is recorded
+  std::unique_ptr<XoChipState> xo_chip_state_;
+  std::unique_ptr<XoChipState> xo_chip_keyframe_;
+  bool xo_chip_ = false;  // whether records are made of the larger states
+  // The states in use, as bytes
+  uint8_t* state_data_ = nullptr;
+  uint8_t* keyframe_data_ = nullptr;
+  size_t state_size_ = 0;
+  uint64_t keyframe_index_ = 0;
+  bool has_keyframe_ = false;
+
+  uint64_t record_count_ = 0;
+  double record_time_ = 0.0;  // in microseconds
+};
+
+}  // namespace chip8
@@ -0,0 +1,118 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+
+#include "runahead.h"
+
+namespace chip8 {
+
+RunAhead::RunAhead(uint32_t frames)
+    : state_(new State), frames_(std::min(frames, kMaxRunAhead)) {
+}
+
+Emulator& RunAhead::RunFrame(Emulator& emulator) {
+  emulator.RunFrame();
+
+  if (!frames_)
+    return emulator;
+
+  return Speculate(emulator);
+}
+
+Emulator& RunAhead::Speculate(const Emulator& emulator) {
+  // Restoring only touches memory that differs, so the decode cache of the
+  // second emulator stays warm from one frame to the next
+  Copy(emulator, false);
+  for (uint32_t frame = 0; frame < frames_; ++frame)
+    ahead_.RunFrame();
+
+  return ahead_;
+}
+
+void RunAhead::OnKey(const Emulator& emulator, uint8_t key, bool pressed) {
+  if (!auto_tune_ || key > 0xF || emulator.input[key] == pressed)
+    return;
+
+  Copy(emulator, true);
+  probe_.SetKey(key, pressed);
+
+  // The first frame shows the change without any lag. Keys that the program
+  // ignores tell nothing about its lag.
+  for (uint32_t frame = 0; frame <= kMaxRunAhead; ++frame) {
+    ahead_.RunFrame();
+    probe_.RunFrame();
+    if (ahead_.display != probe_.display) {
+      lags_[lag_count_++ % kLagSamples] = frame;
+      const auto count = std::min(lag_count_, kLagSamples);
+      frames_ = *std::min_element(lags_.begin(), lags_.begin() + count);
+      break;
+    }
+  }
+}
+
+uint32_t RunAhead::frames() const {
+  return frames_;
+}
+
+void RunAhead::set_frames(uint32_t frames) {
+  frames_ = std::min(frames, kMaxRunAhead);
+}
+
+bool RunAhead::auto_tune() const {
+  return auto_tune_;
+}
+
+void RunAhead::set_auto_tune(bool enabled) {
+  auto_tune_ = enabled;
+  lag_count_ = 0;
+}
+
+template <typename S>
+void RunAhead::Restore(const S& state, bool probe) {
+  ahead_.LoadState(state);
+  if (probe)
+    probe_.LoadState(state);
+}
+
+void RunAhead::Copy(const Emulator& emulator, bool probe) {
+  // First, as the profile decides how much memory a state can restore
+  ahead_.set_quirks(emulator.quirks());
+  ahead_.set_cycles_per_frame(emulator.cycles_per_frame());
+  if (probe) {
+    probe_.set_quirks(emulator.quirks());
+    probe_.set_cycles_per_frame(emulator.cycles_per_frame());
+  }
+
+  if (emulator.SaveState(*state_)) {
+    Restore(*state_, probe);
+    return;
+  }
+  if (!xo_chip_state_)
+    xo_chip_state_.reset(new XoChipState);
+  emulator.SaveState(*xo_chip_state_);
+  Restore(*xo_chip_state_, probe);
+}
+
+}  // namespace chip8
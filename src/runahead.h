@@ -0,0 +1,78 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+
+#include "chip8.h"
+
+namespace chip8 {
+
+constexpr uint32_t kMaxRunAhead = 6;  // in frames
+
+// Hides input lag by showing the display a few frames into the future. Each
+// frame, the machine is copied into a second emulator that runs ahead with
+// the current input, while the real one only advances by a single frame.
+class RunAhead {
+public:
+  explicit RunAhead(uint32_t frames = 0);
+
+  // Runs a frame, then returns the emulator whose display should be shown
+  Emulator& RunFrame(Emulator& emulator);
+  // Same, for an emulator that has just finished its frame
+  Emulator& Speculate(const Emulator& emulator);
+
+  // Must be called before a key change is applied to the emulator. Measures
+  // how many frames pass before the change affects the display; the number of
+  // frames to run ahead is tuned to the smallest recent measurement.
+  void OnKey(const Emulator& emulator, uint8_t key, bool pressed);
+
+  uint32_t frames() const;
+  void set_frames(uint32_t frames);
+  bool auto_tune() const;
+  void set_auto_tune(bool enabled);
+
+private:
+  static constexpr size_t kLagSamples = 8;
+
+  // Copies the emulator into ahead_, and into probe_ as well if asked to
+  void Copy(const Emulator& emulator, bool probe);
+  template <typename S> void Restore(const S& state, bool probe);
+
+  Emulator ahead_{Executor::kThreaded};
+  Emulator probe_{Executor::kThreaded};
+  std::unique_ptr<State> state_;
+  // Allocated once an XO-CHIP program does not fit into state_
+  std::unique_ptr<XoChipState> xo_chip_state_;
+
+  uint32_t frames_ = 0;
+  bool auto_tune_ = false;
+  std::array<uint32_t, kLagSamples> lags_;
+  size_t lag_count_ = 0;
+};
+
+}  // namespace chip8
@@ -0,0 +1,225 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include "runner.h"
+
+namespace chip8 {
+
+StopReason RunScript(Emulator& emulator, const std::vector<InputEvent>& input,
+                     uint64_t cycles) {
+  auto event = input.begin();
+  uint64_t frame_end = emulator.cycles() + emulator.cycles_per_frame();
+
+  while (emulator.cycles() < cycles) {
+    for (; event != input.end() && event->cycle <= emulator.cycles(); ++event)
+      emulator.SetKey(event->key, event->pressed);
+
+    uint64_t target = std::min(frame_end, cycles);
+    if (event != input.end())
+      target = std::min(target, event->cycle);
+
+    const auto reason =
+        emulator.RunCycles(static_cast<uint32_t>(target - emulator.cycles()));
+
+    // Waiting for a key uses up the cycles, so a key pressed later in the
+    // frame is seen at the same cycle as in a run without skipping
+    if (reason != StopReason::kBudget &&
+        reason != StopReason::kWaitingForKey) {
+      return reason;
+    }
+    if (emulator.cycles() < frame_end)
+      continue;
+
+    emulator.UpdateTimers();
+    frame_end = emulator.cycles() + emulator.cycles_per_frame();
+  }
+
+  return StopReason::kBudget;
+}
+
+uint64_t HashDisplay(const display_t& display) {
+  uint64_t hash = 0xCBF29CE484222325;  // FNV-1a
+  for (const uint64_t row : display) {
+    for (size_t j = 0; j < sizeof(row); ++j) {
+      hash ^= (row >> (8 * j)) & 0xFF;
+      hash *= 0x100000001B3;
+    }
+  }
+  return hash;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+// Chase-Lev work-stealing deque. The owner pushes and pops at the bottom
+// without taking a lock; thieves take from the top, and only race the owner
+// for the last job. Jobs are all pushed before the workers start, so the
+// buffer is sized once and never grows.
+class Queue {
+public:
+  explicit Queue(size_t capacity = 0) : jobs_(capacity) {}
+
+  void Push(size_t job) {
+    const int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    jobs_[bottom].store(job, std::memory_order_relaxed);
+    bottom_.store(bottom + 1, std::memory_order_release);
+  }
+
+  bool Pop(size_t& job) {
+    const int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_relaxed);
+
+    if (top > bottom) {  // empty
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return false;
+    }
+    job = jobs_[bottom].load(std::memory_order_relaxed);
+    if (top == bottom) {  // the last job, which a thief may be taking
+      const bool won = top_.compare_exchange_strong(
+          top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  // Retries when it loses a race, so false always means the queue was empty
+  bool Steal(size_t& job) {
+    for (;;) {
+      int64_t top = top_.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      const int64_t bottom = bottom_.load(std::memory_order_acquire);
+      if (top >= bottom)
+        return false;
+      job = jobs_[top].load(std::memory_order_relaxed);
+      if (top_.compare_exchange_strong(top, top + 1,
+                                       std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+  }
+
+private:
+  std::vector<std::atomic<size_t>> jobs_;
+  std::atomic<int64_t> top_{0};
+  std::atomic<int64_t> bottom_{0};
+};
+
+}  // namespace
+
+Runner::Runner(size_t threads) : threads_(threads) {
+  if (!threads_)
+    threads_ = std::max(1u, std::thread::hardware_concurrency());
+}
+
+Summary Runner::Run(const std::vector<Job>& jobs,
+                    std::vector<Result>& results) {
+  results.assign(jobs.size(), Result());
+
+  const size_t thread_count =
+      std::min(threads_, std::max<size_t>(1, jobs.size()));
+  std::vector<std::unique_ptr<Queue>> queues;
+  for (size_t index = 0; index < thread_count; ++index) {
+    queues.emplace_back(new Queue(jobs.size() / thread_count + 1));
+  }
+  for (size_t job = 0; job < jobs.size(); ++job) {
+    queues[job % thread_count]->Push(job);
+  }
+
+  // Jobs never create other jobs, so a worker that finds every queue empty
+  // can simply exit.
+  auto worker = [&](size_t index) {
+    std::map<Executor, std::unique_ptr<Emulator>> emulators;
+    size_t job;
+
+    for (;;) {
+      bool found = queues[index]->Pop(job);
+      for (size_t j = 1; !found && j < thread_count; ++j) {
+        found = queues[(index + j) % thread_count]->Steal(job);
+      }
+      if (!found)
+        return;
+
+      const auto& task = jobs[job];
+      auto& emulator = emulators[task.executor];
+      if (!emulator)
+        emulator.reset(new Emulator(task.executor));
+
+      auto& result = results[job];
+      emulator->Reset();
+      emulator->Seed(task.seed);  // emulators are reused across jobs
+      emulator->set_cycles_per_frame(task.cycles_per_frame);
+      emulator->set_quirks(task.quirks);
+      result.loaded = emulator->Load(task.program);
+      if (!result.loaded)
+        continue;
+
+      result.reason = RunScript(*emulator, task.input, task.cycles);
+      result.cycles = emulator->cycles();
+      result.idle_cycles = emulator->idle_cycles();
+      result.display_hash = HashDisplay(emulator->display);
+    }
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> threads;
+  for (size_t index = 1; index < thread_count; ++index) {
+    threads.emplace_back(worker, index);
+  }
+  worker(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  Summary summary;
+  summary.jobs = jobs.size();
+  for (const auto& result : results) {
+    summary.cycles += result.cycles;
+    summary.idle_cycles += result.idle_cycles;
+  }
+  summary.seconds = elapsed.count();
+  if (summary.seconds > 0.0) {
+    summary.mips =
+        (summary.cycles - summary.idle_cycles) / summary.seconds / 1000000.0;
+  }
+
+  return summary;
+}
+
+}  // namespace chip8
@@ -0,0 +1,88 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "chip8.h"
+
+namespace chip8 {
+
+struct InputEvent {
+  uint64_t cycle = 0;  // instruction count at which the event is applied
+  uint8_t key = 0;
+  bool pressed = false;
+};
+
+struct Job {
+  std::vector<uint8_t> program;
+  std::vector<InputEvent> input;  // sorted by cycle
+  uint64_t cycles = 0;            // instruction budget
+  Executor executor = Executor::kThreaded;
+  QuirkProfile quirks = QuirkProfile::kChip8;
+  uint64_t seed = kDefaultSeed;   // for RND
+  uint32_t cycles_per_frame = kDefaultCyclesPerFrame;
+};
+
+struct Result {
+  bool loaded = false;
+  StopReason reason = StopReason::kBudget;
+  uint64_t cycles = 0;
+  uint64_t idle_cycles = 0;  // of `cycles`, skipped rather than executed
+  uint64_t display_hash = 0;
+};
+
+struct Summary {
+  size_t jobs = 0;
+  uint64_t cycles = 0;
+  uint64_t idle_cycles = 0;
+  double seconds = 0.0;
+  // Million instructions executed per second across all threads, so not
+  // counting those skipped
+  double mips = 0.0;
+};
+
+// Runs the emulator for `cycles` instructions in total, applying input events
+// at their exact instruction counts and updating the timers once per frame.
+// Stops early on faults; waiting for a key does not stop it.
+StopReason RunScript(Emulator& emulator, const std::vector<InputEvent>& input,
+                     uint64_t cycles);
+
+uint64_t HashDisplay(const display_t& display);
+
+// Runs independent jobs on a work-stealing thread pool. Each worker thread
+// reuses its own emulators, so no state is shared between threads.
+class Runner {
+public:
+  explicit Runner(size_t threads = 0);  // 0 for one per hardware thread
+
+  Summary Run(const std::vector<Job>& jobs, std::vector<Result>& results);
+
+private:
+  size_t threads_;
+};
+
+}  // namespace chip8
@@ -0,0 +1,110 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#include "scheduler.h"
+
+namespace chip8 {
+
+Scheduler::Scheduler(double rate, uint32_t max_catch_up)
+    : rate_(rate > 0.0 ? rate : kFrameRate),
+      max_catch_up_(std::max(1u, max_catch_up)) {
+  Start();
+}
+
+void Scheduler::Start() {
+  start_ = Clock::now();
+  frame_ = 0;
+  deadline_ = start_;
+}
+
+uint32_t Scheduler::Due() {
+  const auto now = Clock::now();
+  if (now < deadline_)
+    return 0;
+
+  const std::chrono::duration<double, std::micro> late = now - deadline_;
+  ++samples_;
+  jitter_sum_ += late.count();
+  jitter_square_sum_ += late.count() * late.count();
+  jitter_max_ = std::max(jitter_max_, late.count());
+
+  // Every deadline that has passed is consumed, whether it is run or dropped
+  const std::chrono::duration<double> elapsed = now - start_;
+  uint64_t next = std::max(frame_ + 1,
+                           static_cast<uint64_t>(elapsed.count() * rate_));
+  while (Deadline(next) <= now)
+    ++next;
+  const uint64_t due = next - frame_;
+  frame_ = next;
+  deadline_ = Deadline(frame_);
+
+  const uint32_t run = static_cast<uint32_t>(
+      std::min<uint64_t>(due, max_catch_up_));
+  frames_ += run;
+  dropped_ += due - run;
+  return run;
+}
+
+Scheduler::Clock::time_point Scheduler::deadline() const {
+  return deadline_;
+}
+
+Scheduler::Clock::duration Scheduler::remaining() const {
+  return std::max(deadline_ - Clock::now(), Clock::duration::zero());
+}
+
+void Scheduler::SleepUntilDeadline(Clock::duration spin) const {
+  if (spin <= Clock::duration::zero()) {
+    std::this_thread::sleep_until(deadline_);
+    return;
+  }
+  if (deadline_ - Clock::now() > spin)
+    std::this_thread::sleep_until(deadline_ - spin);
+  while (Clock::now() < deadline_)
+    std::this_thread::yield();
+}
+
+SchedulerStats Scheduler::stats() const {
+  SchedulerStats stats;
+  stats.frames = frames_;
+  stats.dropped = dropped_;
+  if (samples_) {
+    stats.mean_jitter = jitter_sum_ / samples_;
+    stats.max_jitter = jitter_max_;
+    stats.deviation = std::sqrt(std::max(0.0,
+        jitter_square_sum_ / samples_ - stats.mean_jitter * stats.mean_jitter));
+  }
+  return stats;
+}
+
+Scheduler::Clock::time_point Scheduler::Deadline(uint64_t frame) const {
+  const std::chrono::duration<double> offset(frame / rate_);
+  return start_ + std::chrono::duration_cast<Clock::duration>(offset);
+}
+
+}  // namespace chip8
@@ -0,0 +1,86 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace chip8 {
+
+constexpr double kFrameRate = 60.0;  // timers count down at 60 Hz
+constexpr uint32_t kMaxCatchUpFrames = 4;
+
+struct SchedulerStats {
+  uint64_t frames = 0;   // frames that were run
+  uint64_t dropped = 0;  // frames skipped to catch up
+  double mean_jitter = 0.0;  // lateness past each deadline, in microseconds
+  double max_jitter = 0.0;
+  double deviation = 0.0;    // standard deviation of the lateness
+};
+
+// Paces frames against absolute deadlines on a monotonic clock. Deadline n
+// is computed from the start time rather than from the previous deadline, so
+// rounding errors do not add up.
+class Scheduler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit Scheduler(double rate = kFrameRate,
+                     uint32_t max_catch_up = kMaxCatchUpFrames);
+
+  void Start();
+
+  // Returns how many frames are due and moves to the next deadline. When more
+  // than `max_catch_up` frames are late, the rest are dropped.
+  uint32_t Due();
+
+  Clock::time_point deadline() const;
+  Clock::duration remaining() const;  // until the next deadline, at least 0
+
+  // Sleeps until the next deadline. A nonzero `spin` yields in a loop for the
+  // last part of the wait instead, which burns a core to be less late where
+  // timers are coarse; stats() tells whether that is needed.
+  void SleepUntilDeadline(Clock::duration spin = Clock::duration::zero()) const;
+
+  SchedulerStats stats() const;
+
+private:
+  Clock::time_point Deadline(uint64_t frame) const;
+
+  double rate_;
+  uint32_t max_catch_up_;
+  Clock::time_point start_;
+  uint64_t frame_ = 0;  // index of the next deadline
+  Clock::time_point deadline_;
+
+  uint64_t frames_ = 0;
+  uint64_t dropped_ = 0;
+  uint64_t samples_ = 0;
+  double jitter_sum_ = 0.0;
+  double jitter_square_sum_ = 0.0;
+  double jitter_max_ = 0.0;
+};
+
+}  // namespace chip8
@@ -27,10 +27,11 @@ SOFTWARE.
 namespace sdl {
 
 Engine::~Engine() {
-  if (audio_device_) {
-    SDL_ClearQueuedAudio(audio_device_);
-    SDL_CloseAudioDevice(audio_device_);
-    audio_device_ = 0;
+  CloseAudioDevice();
+
+  if (texture_) {
+    SDL_DestroyTexture(texture_);
+    texture_ = nullptr;
   }
 
   if (renderer_) {
@@ -54,6 +55,10 @@ const SDL_Renderer* Engine::renderer() const {
   return renderer_;
 }
 
+const SDL_Texture* Engine::texture() const {
+  return texture_;
+}
+
 bool Engine::Initialize() {
   const Uint32 flags = SDL_INIT_AUDIO | SDL_INIT_VIDEO | SDL_INIT_EVENTS;
   return SDL_Init(flags) == 0;
@@ -73,27 +78,41 @@ bool Engine::CreateRenderer() {
   return renderer_ != nullptr;
 }
 
+bool Engine::CreateTexture(int width, int height) {
+  texture_ = SDL_CreateTexture(renderer_, SDL_PIXELFORMAT_ARGB8888,
+                               SDL_TEXTUREACCESS_STREAMING, width, height);
+  return texture_ != nullptr;
+}
+
 void Engine::Loop() {
   SDL_Event e;
   running_ = true;
 
   while (running_) {
-    while (SDL_PollEvent(&e)) {
-      switch (e.type) {
-        case SDL_QUIT:
-          running_ = false;
-          break;
-        case SDL_KEYDOWN:
-        case SDL_KEYUP:
-          OnKeyEvent(e.key);
-          break;
-      }
+    // Sleeps until an event arrives or the next update is due
+    if (SDL_WaitEventTimeout(&e, GetWaitTime())) {
+      do {
+        OnEvent(e);
+      } while (SDL_PollEvent(&e));
     }
 
     OnLoop();
     OnRender();
+  }
+}
 
-    SDL_Delay(1);
+void Engine::OnEvent(const SDL_Event& e) {
+  switch (e.type) {
+    case SDL_QUIT:
+      running_ = false;
+      break;
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+      OnKeyEvent(e.key);
+      break;
+    case SDL_WINDOWEVENT:
+      OnWindowEvent(e.window);
+      break;
   }
 }
 
@@ -106,27 +125,10 @@ void Engine::PauseAudioDevice(int pause_on) const {
   SDL_PauseAudioDevice(audio_device_, pause_on);
 }
 
-bool Engine::QueueAudio(const void* data, Uint32 len) const {
-  return SDL_QueueAudio(audio_device_, data, len) == 0;
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-Timer::Timer(Uint32 target)
-    : counter_(SDL_GetPerformanceCounter()),
-      frequency_(SDL_GetPerformanceFrequency()),
-      target_(target) {
-}
-
-bool Timer::Check() {
-  const auto now = SDL_GetPerformanceCounter();
-  const auto delta = ((now - counter_) * 1000.0f) / frequency_;
-
-  if (delta >= 1000.0f / target_) {
-    counter_ = now;
-    return true;
-  } else {
-    return false;
+void Engine::CloseAudioDevice() {
+  if (audio_device_) {
+    SDL_CloseAudioDevice(audio_device_);
+    audio_device_ = 0;
   }
 }
 
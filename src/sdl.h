@@ -37,38 +37,35 @@ public:
 
   const SDL_Window* window() const;
   const SDL_Renderer* renderer() const;
+  const SDL_Texture* texture() const;
 
   bool Initialize();
   bool CreateWindow(const std::string& title, int width, int height);
   bool CreateRenderer();
+  bool CreateTexture(int width, int height);
 
   bool OpenAudioDevice(const SDL_AudioSpec& audio_spec);
   void PauseAudioDevice(int pause_on) const;
-  bool QueueAudio(const void* data, Uint32 len) const;
+  void CloseAudioDevice();
 
   void Loop();
 
+  // Milliseconds that the loop can wait for events before calling OnLoop()
+  virtual Uint32 GetWaitTime() { return 1; }
+
   virtual void OnKeyEvent(SDL_KeyboardEvent key_event) {}
+  virtual void OnWindowEvent(SDL_WindowEvent window_event) {}
   virtual void OnLoop() {}
   virtual void OnRender() {}
 
 protected:
+  void OnEvent(const SDL_Event& e);
+
   SDL_AudioDeviceID audio_device_ = 0;
   SDL_Window* window_ = nullptr;
   SDL_Renderer* renderer_ = nullptr;
+  SDL_Texture* texture_ = nullptr;
   bool running_ = false;
 };
 
-class Timer {
-public:
-  Timer(Uint32 target);
-
-  bool Check();
-
-private:
-  Uint64 counter_ = 0;
-  Uint64 frequency_ = 0;
-  Uint32 target_ = 0;
-};
-
 }  // namespace sdl
@@ -0,0 +1,997 @@
+/*
+MIT License
+
+Copyright (c) 2016 Eren Okka
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Differential tests of the core: every executor against the interpreter on
+// generated programs for each quirk profile, recompiled programs against the
+// interpreter, Batch against emulators, save states and movies. Prints each
+// failure to standard error and exits with 1 if there was any.
+//
+// Usage: test [options]
+//   --programs=N  generated programs per quirk profile (default 200)
+//   --seed=N      of the first program (default 1)
+//   --roms=DIR    programs that were recompiled into the test (default test)
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "analysis.h"
+#include "aot.h"
+#include "audio.h"
+#include "batch.h"
+#include "chip8.h"
+#include "movie.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "runner.h"
+#include "scheduler.h"
+
+namespace {
+
+constexpr uint32_t kFrames = 60;
+constexpr uint32_t kCyclesPerFrame = 100;  // enough for the JIT to compile
+constexpr size_t kProgramInstructions = 128;
+constexpr size_t kLanes = 11;  // not a multiple of any vector width
+
+struct Options {
+  size_t programs = 200;
+  uint64_t seed = 1;
+  std::string roms = "test";
+};
+
+const std::pair<const char*, chip8::QuirkProfile> kProfiles[] = {
+  {"chip8", chip8::QuirkProfile::kChip8},
+  {"cosmac", chip8::QuirkProfile::kCosmac},
+  {"schip", chip8::QuirkProfile::kSuperChip},
+  {"xochip", chip8::QuirkProfile::kXoChip},
+};
+
+const std::pair<const char*, chip8::Executor> kExecutors[] = {
+  {"threaded", chip8::Executor::kThreaded},
+  {"jit", chip8::Executor::kJit},
+  {"aot", chip8::Executor::kAot},
+};
+
+size_t failures = 0;
+
+void Fail(const std::string& test, uint64_t seed, const std::string& what) {
+  std::cerr << test << " (seed " << seed << "): " << what << "\n";
+  ++failures;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Generated programs
+
+// Random instructions of the profile's instruction set. Jumps and calls stay
+// within the program, while I may point anywhere, so that programs also draw
+// and store over their own code.
+std::vector<uint8_t> Generate(chip8::QuirkProfile quirks,
+                              std::mt19937_64& rng) {
+  const bool schip = quirks == chip8::QuirkProfile::kSuperChip ||
+                     quirks == chip8::QuirkProfile::kXoChip;
+  const bool xochip = quirks == chip8::QuirkProfile::kXoChip;
+
+  const auto pick = [&rng](const std::vector<uint16_t>& choices) {
+    return choices[rng() % choices.size()];
+  };
+  const auto target = [&rng]() {
+    return static_cast<uint16_t>(chip8::kProgramOffset +
+                                 2 * (rng() % kProgramInstructions));
+  };
+
+  std::vector<uint16_t> code;
+  while (code.size() < kProgramInstructions) {
+    const uint16_t x = (rng() % 16) << 8;
+    const uint16_t y = (rng() % 16) << 4;
+    const uint16_t kk = rng() % 256;
+    uint16_t instruction = 0x0000;
+
+    switch (rng() % 16) {
+      case 0x0: {
+        std::vector<uint16_t> choices = {0x00E0, 0x00EE};
+        if (schip) {
+          choices.insert(choices.end(), {
+              static_cast<uint16_t>(0x00C0 | (rng() % 16)),
+              0x00FB, 0x00FC, 0x00FE, 0x00FF});
+        }
+        if (xochip)
+          choices.push_back(0x00D0 | (rng() % 16));
+        instruction = pick(choices);
+        break;
+      }
+      case 0x1: instruction = 0x1000 | (target() & 0xFFF); break;
+      case 0x2:  // as many calls as returns, so that fewer runs fault
+        instruction = (rng() % 2 ? 0x2000 : 0x1000) | (target() & 0xFFF);
+        break;
+      case 0x3: instruction = 0x3000 | x | kk; break;
+      case 0x4: instruction = 0x4000 | x | kk; break;
+      case 0x5:
+        instruction = 0x5000 | x | y | (xochip ? pick({0, 2, 3}) : 0);
+        break;
+      case 0x6: instruction = 0x6000 | x | kk; break;
+      case 0x7: instruction = 0x7000 | x | kk; break;
+      case 0x8:
+        instruction = 0x8000 | x | y | pick({0, 1, 2, 3, 4, 5, 6, 7, 0xE});
+        break;
+      case 0x9: instruction = 0x9000 | x | y; break;
+      case 0xA: instruction = 0xA000 | (rng() % 0x1000); break;
+      case 0xB: instruction = 0xB000 | (target() & 0xFFF); break;
+      case 0xC: instruction = 0xC000 | x | kk; break;
+      case 0xD: instruction = 0xD000 | x | y | (rng() % 16); break;
+      case 0xE: instruction = 0xE000 | x | pick({0x9E, 0xA1}); break;
+      case 0xF: {
+        std::vector<uint16_t> choices = {0x07, 0x0A, 0x15, 0x18, 0x1E,
+                                         0x29, 0x33, 0x55, 0x65};
+        if (schip)
+          choices.insert(choices.end(), {0x30, 0x75, 0x85});
+        if (xochip)
+          choices.push_back(0x01);
+        instruction = 0xF000 | x | pick(choices);
+        // F000 nnnn loads a 16-bit address from the next two bytes
+        if (xochip && code.size() + 2 <= kProgramInstructions &&
+            rng() % 8 == 0) {
+          code.push_back(0xF000);
+          instruction = rng() % 0x10000;
+        }
+        break;
+      }
+    }
+    code.push_back(instruction);
+  }
+  // Unless they are skipped, programs do not run off into empty memory
+  code.back() = 0x1000 | chip8::kProgramOffset;
+
+  std::vector<uint8_t> program;
+  for (const uint16_t instruction : code) {
+    program.push_back(instruction >> 8);
+    program.push_back(instruction & 0xFF);
+  }
+  return program;
+}
+
+// Loops that wait for the delay timer, for a key to be pressed or released,
+// and for Fx0A, with random operands and drawing between them
+std::vector<uint8_t> GenerateIdle(std::mt19937_64& rng) {
+  const uint16_t x = rng() % 64;
+  const uint16_t y = rng() % 32;
+  const std::vector<uint16_t> code = {
+    static_cast<uint16_t>(0x6A00 | (1 + rng() % 16)),  // LD VA, byte
+    0xFA15,                                            // LD DT, VA
+    0xFB07,                                            // LD VB, DT
+    0x3B00,                                            // SE VB, 0
+    0x1204,                                            // JP 0x204
+    static_cast<uint16_t>(0x6C00 | x),                 // LD VC, x
+    static_cast<uint16_t>(0x6D00 | y),                 // LD VD, y
+    static_cast<uint16_t>(0x6E00 | (rng() % 16)),      // LD VE, digit
+    0xFE29,                                            // LD F, VE
+    0xDCD5,                                            // DRW VC, VD, 5
+    static_cast<uint16_t>(0x6200 | (rng() % 16)),      // LD V2, key
+    static_cast<uint16_t>(rng() % 2 ? 0xE29E : 0xE2A1),  // SKP or SKNP V2
+    0x1216,                                            // JP 0x216
+    0xF30A,                                            // LD V3, K
+    0x7E01,                                            // ADD VE, 1
+    0x1200,                                            // JP 0x200
+  };
+
+  std::vector<uint8_t> program;
+  for (const uint16_t instruction : code) {
+    program.push_back(instruction >> 8);
+    program.push_back(instruction & 0xFF);
+  }
+  return program;
+}
+
+// Jumps to a skip in the last word of 4 KB memory, which must read the next
+// instruction from the start of memory, where the program counter wraps to
+std::vector<uint8_t> GenerateEdge() {
+  std::vector<uint8_t> program(chip8::kMaxProgramSize);
+  program[0] = 0x1F;  // JP 0xFFE
+  program[1] = 0xFE;
+  program[program.size() - 2] = 0x30;  // SE V0, 0
+  program[program.size() - 1] = 0x00;
+  return program;
+}
+
+// Random key presses and releases, sorted by cycle
+std::vector<chip8::InputEvent> GenerateInput(std::mt19937_64& rng,
+                                             uint64_t cycles) {
+  std::vector<chip8::InputEvent> input(rng() % 16);
+  for (auto& event : input) {
+    event.cycle = rng() % cycles;
+    event.key = rng() % 16;
+    event.pressed = rng() % 2 == 0;
+  }
+  std::stable_sort(input.begin(), input.end(),
+                   [](const chip8::InputEvent& a, const chip8::InputEvent& b) {
+                     return a.cycle < b.cycle;
+                   });
+  return input;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A stand-in for chip8-recompile
+
+// Generated code is linked into the executable, so the blocks of programs
+// that are only generated at run time are executed by a fixed set of
+// functions, each one reading the instructions of its block from a table.
+// Like recompiled code, they run every instruction through Aot::Call() and
+// leave the program counter at the next block.
+constexpr size_t kMaxAotBlocks = 256;
+
+struct AotTranslation {
+  std::vector<std::vector<std::pair<uint16_t, chip8::Instruction>>> code;
+  std::vector<chip8::AotBlock> blocks;
+  chip8::AotProgram program;
+};
+
+// Registered programs must outlive every emulator
+std::deque<AotTranslation> aot_translations;
+const AotTranslation* aot_current = nullptr;
+
+template <size_t N>
+void RunAotBlock(chip8::Processor& processor, chip8::Emulator& emulator) {
+  uint16_t address = 0;
+  for (const auto& entry : aot_current->code[N]) {
+    address = entry.first + 2;
+    if (chip8::IsBlockEnd(entry.second.op)) {
+      processor.pc = address;
+      chip8::Aot::Call(emulator, entry.second);
+      return;
+    }
+    chip8::Aot::Call(emulator, entry.second);
+  }
+  processor.pc = address;
+}
+
+template <size_t... N>
+constexpr std::array<chip8::aot_code_t, sizeof...(N)> MakeAotSlots(
+    std::index_sequence<N...>) {
+  return {{&RunAotBlock<N>...}};
+}
+
+constexpr auto kAotSlots =
+    MakeAotSlots(std::make_index_sequence<kMaxAotBlocks>());
+
+// Translates the program the first time it is seen, and makes its blocks the
+// ones that the slots run
+void RecompileProgram(const std::vector<uint8_t>& program) {
+  chip8::Analysis analysis;
+  chip8::Analyze(program, analysis);
+
+  for (const auto& translation : aot_translations) {
+    if (translation.program.hash == analysis.program_hash) {
+      aot_current = &translation;
+      return;
+    }
+  }
+
+  aot_translations.emplace_back();
+  auto& translation = aot_translations.back();
+  for (const auto& block : analysis.blocks) {
+    if (translation.blocks.size() == kMaxAotBlocks)
+      break;
+    std::vector<std::pair<uint16_t, chip8::Instruction>> code;
+    uint16_t address = block.address;
+    for (uint16_t j = 0; j < block.length; ++j, address += 2) {
+      const size_t offset = address - chip8::kProgramOffset;
+      code.emplace_back(address, chip8::Decode(program[offset] << 8 |
+                                               program[offset + 1]));
+    }
+    translation.blocks.push_back(
+        {block.address, block.length, kAotSlots[translation.code.size()]});
+    translation.code.push_back(std::move(code));
+  }
+  translation.program = {analysis.program_hash, translation.blocks.data(),
+                         translation.blocks.size()};
+  chip8::Aot::Register(translation.program);
+  aot_current = &translation;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Comparisons, each returning what differs or an empty string
+
+std::string Compare(const chip8::Processor& a, const chip8::Processor& b) {
+  std::ostringstream os;
+  for (size_t x = 0; x < a.v.size(); ++x) {
+    if (a.v[x] != b.v[x])
+      os << "v" << x << " " << +a.v[x] << " != " << +b.v[x] << "; ";
+  }
+  if (a.i != b.i)
+    os << "i " << a.i << " != " << b.i << "; ";
+  if (a.pc != b.pc)
+    os << "pc " << a.pc << " != " << b.pc << "; ";
+  if (a.sp != b.sp)
+    os << "sp " << +a.sp << " != " << +b.sp << "; ";
+  if (a.stack != b.stack)
+    os << "stack; ";
+  if (a.dt != b.dt)
+    os << "dt " << +a.dt << " != " << +b.dt << "; ";
+  if (a.st != b.st)
+    os << "st " << +a.st << " != " << +b.st << "; ";
+  return os.str();
+}
+
+std::string Compare(const chip8::Emulator& a, const chip8::Emulator& b) {
+  std::string what = Compare(a.processor, b.processor);
+  if (a.memory != b.memory)
+    what += "memory; ";
+  if (a.display != b.display)
+    what += "display; ";
+  if (a.hires != b.hires || a.planes != b.planes)
+    what += "mode; ";
+  if (a.rpl != b.rpl)
+    what += "user flags; ";
+  if (a.cycles() != b.cycles()) {
+    what += "cycles " + std::to_string(a.cycles()) + " != " +
+            std::to_string(b.cycles()) + "; ";
+  }
+  return what;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Tests
+
+void Start(chip8::Emulator& emulator, const std::vector<uint8_t>& program,
+           uint64_t seed) {
+  emulator.set_cycles_per_frame(kCyclesPerFrame);
+  emulator.Seed(seed);
+  emulator.Reset();
+  emulator.Load(program);
+}
+
+// Every executor must end up where the interpreter does
+void TestExecutors(const char* profile, chip8::QuirkProfile quirks,
+                   const std::vector<uint8_t>& program,
+                   const std::vector<chip8::InputEvent>& input,
+                   uint64_t seed) {
+  constexpr uint64_t cycles = kFrames * kCyclesPerFrame;
+  RecompileProgram(program);
+
+  chip8::Emulator reference(chip8::Executor::kInterpreter, quirks);
+  Start(reference, program, seed);
+  const auto expected = chip8::RunScript(reference, input, cycles);
+
+  for (const auto& executor : kExecutors) {
+    const std::string test = std::string(profile) + "/" + executor.first;
+    chip8::Emulator emulator(executor.second, quirks);
+    Start(emulator, program, seed);
+    const auto reason = chip8::RunScript(emulator, input, cycles);
+    if (reason != expected) {
+      Fail(test, seed, "stopped for another reason");
+    } else if (const auto what = Compare(emulator, reference); !what.empty()) {
+      Fail(test, seed, what);
+    }
+  }
+}
+
+// Programs that chip8-recompile translated and that were linked into the test
+// must run like they do in the interpreter, in every profile, and must have
+// executed recompiled blocks rather than only falling back to it
+void TestRecompiled(const std::string& path, uint64_t seed) {
+  constexpr uint64_t cycles = kFrames * kCyclesPerFrame;
+
+  std::vector<uint8_t> program;
+  if (!chip8::ReadProgram(path, program)) {
+    Fail(path, seed, "could not read");
+    return;
+  }
+  if (!chip8::Aot::Find(chip8::HashProgram(program))) {
+    Fail(path, seed, "not recompiled");
+    return;
+  }
+
+  std::mt19937_64 rng(seed);
+  const auto input = GenerateInput(rng, cycles);
+
+  for (const auto& profile : kProfiles) {
+    const std::string test = path + "/" + profile.first;
+    chip8::Emulator reference(chip8::Executor::kInterpreter, profile.second);
+    Start(reference, program, seed);
+    const auto expected = chip8::RunScript(reference, input, cycles);
+
+    chip8::Emulator emulator(chip8::Executor::kAot, profile.second);
+    Start(emulator, program, seed);
+    const auto reason = chip8::RunScript(emulator, input, cycles);
+    if (reason != expected) {
+      Fail(test, seed, "stopped for another reason");
+    } else if (const auto what = Compare(emulator, reference); !what.empty()) {
+      Fail(test, seed, what);
+    } else if (emulator.aot()->interpreted() >= emulator.cycles()) {
+      Fail(test, seed, "ran no recompiled blocks");
+    }
+  }
+}
+
+// Skipping idle loops must not change where a run ends up, nor how many
+// cycles it counts. A breakpoint that is never reached keeps the reference
+// from skipping loops.
+void TestIdle(const char* profile, chip8::QuirkProfile quirks,
+              const std::vector<uint8_t>& program,
+              const std::vector<chip8::InputEvent>& input, uint64_t seed,
+              uint64_t& idle_cycles) {
+  constexpr uint64_t cycles = kFrames * kCyclesPerFrame;
+
+  chip8::Emulator reference(chip8::Executor::kInterpreter, quirks);
+  Start(reference, program, seed);
+  reference.SetBreakpoint(chip8::kMemorySize - 2);
+  const auto expected = chip8::RunScript(reference, input, cycles);
+
+  const std::pair<const char*, chip8::Executor> executors[] = {
+    {"interpreter", chip8::Executor::kInterpreter},
+    {"threaded", chip8::Executor::kThreaded},
+    {"jit", chip8::Executor::kJit},
+  };
+  for (const auto& executor : executors) {
+    const std::string test =
+        std::string(profile) + "/idle/" + executor.first;
+    chip8::Emulator emulator(executor.second, quirks);
+    Start(emulator, program, seed);
+    const auto reason = chip8::RunScript(emulator, input, cycles);
+    // Both count the cycles spent waiting for Fx0A
+    idle_cycles += emulator.idle_cycles() - reference.idle_cycles();
+    if (reason != expected) {
+      Fail(test, seed, "stopped for another reason");
+    } else if (const auto what = Compare(emulator, reference); !what.empty()) {
+      Fail(test, seed, what);
+    }
+  }
+}
+
+// The rows that the core marks dirty must include every row that changed
+// since they were last cleared, which is all the frontend redraws
+void TestDirtyRows(const char* profile, chip8::QuirkProfile quirks,
+                   const std::vector<uint8_t>& program, uint64_t seed) {
+  const std::string test = std::string(profile) + "/dirty rows";
+
+  chip8::Emulator emulator(chip8::Executor::kJit, quirks);
+  Start(emulator, program, seed);
+  emulator.ClearDirtyRows();
+  auto previous = emulator.display;
+  auto previous_hires = emulator.hires;
+
+  for (uint32_t frame = 0; frame < kFrames; ++frame) {
+    emulator.RunFrame();
+    uint64_t changed = 0;
+    if (emulator.hires != previous_hires) {
+      changed = ~uint64_t{0};
+    } else {
+      for (size_t j = 0; j < emulator.display.size(); ++j) {
+        if (emulator.display[j] != previous[j])
+          changed |= uint64_t{1} << (j % chip8::kHiResHeight);
+      }
+    }
+    if (changed & ~emulator.dirty_rows()) {
+      Fail(test, seed, "unmarked rows in frame " + std::to_string(frame));
+      return;
+    }
+    emulator.ClearDirtyRows();
+    previous = emulator.display;
+    previous_hires = emulator.hires;
+  }
+}
+
+// A state saved halfway must continue like the run it was saved from, with
+// another executor as well as after rewinding the same emulator
+template <typename State>
+void TestState(const char* profile, chip8::QuirkProfile quirks,
+               const std::vector<uint8_t>& program,
+               const std::vector<chip8::InputEvent>& input, uint64_t seed) {
+  constexpr uint64_t cycles = kFrames * kCyclesPerFrame;
+  const std::string test = std::string(profile) + "/state";
+
+  chip8::Emulator emulator(chip8::Executor::kJit, quirks);
+  Start(emulator, program, seed);
+  chip8::RunScript(emulator, input, cycles / 2);
+
+  auto state = std::make_unique<State>();
+  if (!emulator.SaveState(*state)) {
+    Fail(test, seed, "could not save");
+    return;
+  }
+  chip8::RunScript(emulator, input, cycles);
+
+  chip8::Emulator restored(chip8::Executor::kThreaded, quirks);
+  restored.set_cycles_per_frame(kCyclesPerFrame);
+  if (!restored.LoadState(*state)) {
+    Fail(test, seed, "could not load");
+    return;
+  }
+  chip8::RunScript(restored, input, cycles);
+  if (const auto what = Compare(restored, emulator); !what.empty())
+    Fail(test, seed, "loaded into another emulator: " + what);
+
+  chip8::Emulator rewound(chip8::Executor::kJit, quirks);
+  Start(rewound, program, seed);
+  chip8::RunScript(rewound, input, cycles);
+  if (!rewound.LoadState(*state)) {
+    Fail(test, seed, "could not rewind");
+    return;
+  }
+  chip8::RunScript(rewound, input, cycles);
+  if (const auto what = Compare(rewound, emulator); !what.empty())
+    Fail(test, seed, "rewound: " + what);
+
+  ++state->version;
+  if (restored.LoadState(*state))
+    Fail(test, seed, "loaded a state of another version");
+}
+
+// Seeking back n frames must restore the state saved n frames earlier, across
+// keyframes, after recording again from a restored frame, and past the start
+// of the history, which keeps the oldest frame
+template <typename State>
+void TestRewind(const char* profile, chip8::QuirkProfile quirks,
+                const std::vector<uint8_t>& program,
+                const std::vector<chip8::InputEvent>& input, uint64_t seed) {
+  const std::string test = std::string(profile) + "/rewind";
+
+  chip8::Emulator emulator(chip8::Executor::kThreaded, quirks);
+  Start(emulator, program, seed);
+  chip8::Rewind rewind(chip8::kDefaultRewindCapacity, 7);
+  std::vector<State> states(kFrames);
+  size_t event = 0;
+  size_t recorded = 0;  // frames, each one saved to states as well
+  const auto run = [&](size_t frames) {
+    for (; frames; --frames) {
+      for (; event < input.size() &&
+             input[event].cycle < emulator.cycles() + kCyclesPerFrame;
+           ++event) {
+        emulator.SetKey(input[event].key, input[event].pressed);
+      }
+      emulator.RunFrame();
+      emulator.SaveState(states[recorded++]);
+      rewind.Record(emulator);
+    }
+  };
+
+  chip8::Emulator expected(chip8::Executor::kInterpreter, quirks);
+  const auto seek = [&](size_t frames) {
+    if (!rewind.Seek(emulator, frames)) {
+      Fail(test, seed, "could not seek");
+      return false;
+    }
+    recorded -= std::min(frames, recorded - 1);
+    expected.LoadState(states[recorded - 1]);
+    if (rewind.frames() != recorded) {
+      Fail(test, seed, "kept " + std::to_string(rewind.frames()) +
+                           " frames rather than " + std::to_string(recorded));
+      return false;
+    }
+    if (const auto what = Compare(emulator, expected); !what.empty()) {
+      Fail(test, seed, "seeking " + std::to_string(frames) + " frames to " +
+                           std::to_string(recorded - 1) + ": " + what);
+      return false;
+    }
+    return true;
+  };
+
+  run(kFrames / 2);
+  for (const size_t frames : {size_t{1}, size_t{3}, size_t{9}}) {
+    if (!seek(frames))
+      return;
+  }
+  run(kFrames - recorded);
+  for (const size_t frames : {size_t{2}, size_t{8}, size_t{kFrames}}) {
+    if (!seek(frames))
+      return;
+  }
+}
+
+// The emulator shown while running ahead must be where a separate run is that
+// many frames later, while the real one goes on as if nothing ran ahead
+void TestRunAhead(const char* profile, chip8::QuirkProfile quirks,
+                  const std::vector<uint8_t>& program, uint64_t seed) {
+  constexpr uint32_t frames = 3;
+  const std::string test = std::string(profile) + "/run-ahead";
+
+  chip8::Emulator emulator(chip8::Executor::kThreaded, quirks);
+  chip8::Emulator behind(chip8::Executor::kThreaded, quirks);
+  chip8::Emulator ahead(chip8::Executor::kThreaded, quirks);
+  Start(emulator, program, seed);
+  Start(behind, program, seed);
+  Start(ahead, program, seed);
+  for (uint32_t frame = 0; frame < frames; ++frame)
+    ahead.RunFrame();
+
+  chip8::RunAhead run_ahead(frames);
+  for (uint32_t frame = 0; frame < kFrames; ++frame) {
+    const auto& shown = run_ahead.RunFrame(emulator);
+    behind.RunFrame();
+    ahead.RunFrame();
+    if (const auto what = Compare(emulator, behind); !what.empty()) {
+      Fail(test, seed, "ran ahead itself: " + what);
+      return;
+    }
+    if (const auto what = Compare(shown, ahead); !what.empty()) {
+      Fail(test, seed, "showed another frame: " + what);
+      return;
+    }
+  }
+}
+
+// Tuning must measure the frames between a key press and the display change,
+// here two, as the program waits for the delay timer after the key
+void TestRunAheadTuning() {
+  const std::string test = "chip8/run-ahead tuning";
+  const std::vector<uint8_t> program = {
+    0x60, 0x05,  // LD V0, 5
+    0xE0, 0x9E,  // SKP V0
+    0x12, 0x02,  // JP 0x202
+    0x61, 0x02,  // LD V1, 2
+    0xF1, 0x15,  // LD DT, V1
+    0xF2, 0x07,  // LD V2, DT
+    0x32, 0x00,  // SE V2, 0
+    0x12, 0x0A,  // JP 0x20A
+    0xD0, 0x05,  // DRW V0, V0, 5
+    0x12, 0x12,  // JP 0x212
+  };
+
+  chip8::Emulator emulator(chip8::Executor::kThreaded);
+  Start(emulator, program, 1);
+  chip8::RunAhead run_ahead;
+  run_ahead.set_auto_tune(true);
+  for (uint32_t frame = 0; frame < 4; ++frame)
+    run_ahead.RunFrame(emulator);
+
+  run_ahead.OnKey(emulator, 5, true);
+  if (run_ahead.frames() != 2) {
+    Fail(test, 1, "measured " + std::to_string(run_ahead.frames()) +
+                      " frames");
+  }
+}
+
+// A recorded movie must survive a round trip through a file, and replay to
+// the same display
+void TestMovie(const char* profile, chip8::QuirkProfile quirks,
+               const std::vector<uint8_t>& program,
+               const std::vector<chip8::InputEvent>& input, uint64_t seed) {
+  const std::string test = std::string(profile) + "/movie";
+
+  chip8::Emulator recorder(chip8::Executor::kThreaded, quirks);
+  Start(recorder, program, seed);
+  chip8::RunScript(recorder, input, kFrames * kCyclesPerFrame);
+
+  chip8::Movie movie;
+  movie.seed = seed;
+  movie.program_hash = chip8::HashProgram(program);
+  movie.cycles_per_frame = kCyclesPerFrame;
+  movie.quirks = quirks;
+  movie.cycles = recorder.cycles();
+  movie.display_hash = chip8::HashDisplay(recorder.display);
+  movie.input = input;
+
+  const auto path = (std::filesystem::temp_directory_path() /
+                     ("chip8-test-" + std::to_string(seed) + ".c8m"))
+                        .string();
+  chip8::Movie read;
+  const bool written = chip8::WriteMovie(path, movie);
+  const bool ok = written && chip8::ReadMovie(path, read);
+  std::remove(path.c_str());
+  if (!ok) {
+    Fail(test, seed, written ? "could not read" : "could not write");
+    return;
+  }
+
+  const auto same_event = [](const chip8::InputEvent& a,
+                             const chip8::InputEvent& b) {
+    return a.cycle == b.cycle && a.key == b.key && a.pressed == b.pressed;
+  };
+  if (read.seed != movie.seed || read.program_hash != movie.program_hash ||
+      read.cycles_per_frame != movie.cycles_per_frame ||
+      read.quirks != movie.quirks || read.cycles != movie.cycles ||
+      read.display_hash != movie.display_hash ||
+      read.input.size() != movie.input.size() ||
+      !std::equal(read.input.begin(), read.input.end(), movie.input.begin(),
+                  same_event)) {
+    Fail(test, seed, "read back differently");
+    return;
+  }
+
+  chip8::Emulator player(chip8::Executor::kInterpreter);
+  player.set_quirks(read.quirks);
+  player.Seed(read.seed);
+  player.Reset();
+  player.Load(program);
+  chip8::PlayMovie(player, read);
+  if (player.cycles() != read.cycles ||
+      chip8::HashDisplay(player.display) != read.display_hash) {
+    Fail(test, seed, "replayed to another display");
+  }
+}
+
+// Every lane must follow its own emulator, both according to the lockstep
+// mode of Batch and when compared here
+void TestBatch(const std::vector<uint8_t>& program, uint64_t seed) {
+  const std::string test = "chip8/batch";
+  std::mt19937_64 rng(seed);
+
+  chip8::Batch batch(kLanes);
+  batch.set_lockstep(true);
+  std::vector<std::unique_ptr<chip8::Emulator>> emulators;
+  for (size_t lane = 0; lane < kLanes; ++lane) {
+    batch.Seed(lane, seed + lane);
+    emulators.emplace_back(new chip8::Emulator(chip8::Executor::kInterpreter));
+    emulators.back()->Seed(seed + lane);
+    emulators.back()->Reset();
+    emulators.back()->Load(program);
+  }
+  batch.Reset();
+  batch.Load(program);
+
+  for (uint32_t frame = 0; frame < kFrames; ++frame) {
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      if (rng() % 4 != 0)
+        continue;
+      const uint8_t key = rng() % 16;
+      const bool pressed = rng() % 2 == 0;
+      batch.SetKey(lane, key, pressed);
+      emulators[lane]->SetKey(key, pressed);
+    }
+
+    batch.RunCycles(kCyclesPerFrame);
+    batch.UpdateTimers();
+    for (auto& emulator : emulators) {
+      for (uint32_t cycle = 0; cycle < kCyclesPerFrame; ++cycle)
+        emulator->Cycle();
+      emulator->UpdateTimers();
+    }
+
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      const auto& emulator = *emulators[lane];
+      std::string what = Compare(batch.processor(lane), emulator.processor);
+      if (batch.display(lane) != emulator.display)
+        what += "display; ";
+      const auto& memory = batch.memory(lane);
+      if (!std::equal(memory.begin(), memory.end(), emulator.memory.begin()))
+        what += "memory; ";
+      if (!what.empty()) {
+        Fail(test, seed, "lane " + std::to_string(lane) + " in frame " +
+                             std::to_string(frame) + ": " + what);
+        return;
+      }
+    }
+  }
+
+  if (batch.divergences())
+    Fail(test, seed, std::to_string(batch.divergences()) + " divergences");
+}
+
+// Fx18 must start and stop the tone at the samples where its cycles fall
+// within the frame, and frames that were not pushed in time only count as
+// underruns while the tone should be sounding
+void TestAudio() {
+  constexpr uint32_t sample_rate = 6000;  // a sample per cycle
+  constexpr uint32_t samples = sample_rate / chip8::kTimerRate;
+  constexpr uint32_t start = 20;  // cycles, including Fx18 itself
+  constexpr uint32_t stop = 70;
+  const std::string test = "audio";
+
+  std::vector<uint8_t> program = {0x6A, 0x0A, 0x6B, 0x00};  // LD VA/VB
+  while (program.size() / 2 < stop) {
+    const size_t cycle = program.size() / 2 + 1;
+    if (cycle == start) {
+      program.insert(program.end(), {0xFA, 0x18});  // LD ST, VA
+    } else if (cycle == stop) {
+      program.insert(program.end(), {0xFB, 0x18});  // LD ST, VB
+    } else {
+      program.insert(program.end(), {0x7C, 0x01});  // ADD VC, 1
+    }
+  }
+  const uint16_t end = static_cast<uint16_t>(chip8::kProgramOffset +
+                                             program.size());
+  program.insert(program.end(), {static_cast<uint8_t>(0x10 | end >> 8),
+                                 static_cast<uint8_t>(end & 0xFF)});
+
+  // The tone from its first sample, for a whole frame
+  chip8::Audio reference(sample_rate);
+  std::vector<int16_t> tone(samples);
+  reference.Push(10);
+  reference.Render(tone.data(), tone.size());
+
+  chip8::Audio audio(sample_rate);
+  chip8::Emulator emulator(chip8::Executor::kThreaded);
+  emulator.set_cycles_per_frame(samples);
+  emulator.Reset();
+  emulator.Load(program);
+  std::vector<int16_t> rendered(samples);
+  for (uint32_t frame = 0; frame < 2; ++frame) {
+    emulator.RunCycles(emulator.cycles_per_frame());
+    audio.Push(emulator);
+    emulator.UpdateTimers();
+    audio.Render(rendered.data(), rendered.size());
+    for (uint32_t sample = 0; sample < samples; ++sample) {
+      const bool sounding = frame == 0 && sample >= start && sample < stop;
+      const int16_t expected = sounding ? tone[sample - start] : 0;
+      if (rendered[sample] != expected) {
+        Fail(test, 0, "sample " + std::to_string(sample) + " of frame " +
+                          std::to_string(frame) + " is " +
+                          std::to_string(rendered[sample]));
+        return;
+      }
+    }
+  }
+
+  audio.Render(rendered.data(), rendered.size());
+  if (audio.underruns())
+    Fail(test, 0, "a silent frame was late");
+  audio.Push(5);
+  audio.Render(rendered.data(), rendered.size());
+  audio.Render(rendered.data(), rendered.size());
+  if (audio.underruns() != 1)
+    Fail(test, 0, "a sounding frame was not late");
+}
+
+// Deadlines are counted from the start, so after any number of frames the
+// next one is exactly where the count puts it. Sleeping until a deadline must
+// always make a frame due, and sleeping far past it runs at most the catch-up
+// frames and drops the rest.
+void TestScheduler() {
+  using Clock = chip8::Scheduler::Clock;
+  constexpr double rate = 500.0;
+  constexpr uint32_t max_catch_up = 4;
+  const std::string test = "scheduler";
+
+  const auto before = Clock::now();
+  chip8::Scheduler scheduler(rate, max_catch_up);
+  const auto after = Clock::now();
+
+  for (int i = 0; i < 20; ++i) {
+    scheduler.SleepUntilDeadline();
+    const uint32_t due = scheduler.Due();
+    if (!due || due > max_catch_up) {
+      Fail(test, 0, std::to_string(due) + " frames due at a deadline");
+      return;
+    }
+  }
+
+  const auto dropped = scheduler.stats().dropped;
+  std::this_thread::sleep_for(std::chrono::milliseconds(25));  // 12.5 frames
+  const uint32_t due = scheduler.Due();
+  if (due != max_catch_up || scheduler.stats().dropped < dropped + 8) {
+    Fail(test, 0, "ran " + std::to_string(due) + " and dropped " +
+                      std::to_string(scheduler.stats().dropped - dropped) +
+                      " frames after sleeping");
+  }
+
+  const auto stats = scheduler.stats();
+  const std::chrono::duration<double> offset((stats.frames + stats.dropped) /
+                                             rate);
+  const auto duration = std::chrono::duration_cast<Clock::duration>(offset);
+  if (scheduler.deadline() < before + duration ||
+      scheduler.deadline() > after + duration) {
+    Fail(test, 0, "the deadline drifted from the start");
+  }
+}
+
+bool GetOption(const std::string& arg, const std::string& name,
+               std::string& value) {
+  const std::string prefix = "--" + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  value = arg.substr(prefix.size());
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char const *argv[]) {
+  Options options;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    std::string value;
+    if (GetOption(arg, "programs", value)) {
+      options.programs = std::strtoul(value.c_str(), nullptr, 10);
+    } else if (GetOption(arg, "seed", value)) {
+      options.seed = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (GetOption(arg, "roms", value)) {
+      options.roms = value;
+    } else {
+      std::cerr << "Unknown option: " << arg << "\n";
+      return 1;
+    }
+  }
+
+  std::error_code error;
+  std::vector<std::string> roms;
+  for (const auto& entry :
+       std::filesystem::directory_iterator(options.roms, error)) {
+    if (entry.path().extension() == ".ch8")
+      roms.push_back(entry.path().string());
+  }
+  if (error)
+    Fail("recompiled", options.seed, "could not list " + options.roms);
+  std::sort(roms.begin(), roms.end());
+  for (const auto& path : roms)
+    TestRecompiled(path, options.seed);
+
+  TestRunAheadTuning();
+  TestScheduler();
+  TestAudio();
+
+  const auto edge = GenerateEdge();
+  for (const auto& profile : kProfiles)
+    TestExecutors(profile.first, profile.second, edge, {}, options.seed);
+  TestBatch(edge, options.seed);
+
+  uint64_t idle_cycles = 0;
+  for (const auto& profile : kProfiles) {
+    const bool xochip = profile.second == chip8::QuirkProfile::kXoChip;
+    for (size_t j = 0; j < options.programs; ++j) {
+      const uint64_t seed = options.seed + j;
+      std::mt19937_64 rng(seed * 4 + static_cast<uint64_t>(profile.second));
+      const auto program = Generate(profile.second, rng);
+      const auto input = GenerateInput(rng, kFrames * kCyclesPerFrame);
+
+      TestExecutors(profile.first, profile.second, program, input, seed);
+      TestDirtyRows(profile.first, profile.second, program, seed);
+      if (xochip) {
+        TestState<chip8::XoChipState>(profile.first, profile.second, program,
+                                      input, seed);
+      } else {
+        TestState<chip8::State>(profile.first, profile.second, program,
+                                input, seed);
+      }
+      if (xochip) {
+        TestRewind<chip8::XoChipState>(profile.first, profile.second, program,
+                                       input, seed);
+      } else {
+        TestRewind<chip8::State>(profile.first, profile.second, program,
+                                 input, seed);
+      }
+      TestRunAhead(profile.first, profile.second, program, seed);
+      TestMovie(profile.first, profile.second, program, input, seed);
+      if (profile.second == chip8::QuirkProfile::kChip8)
+        TestBatch(program, seed);
+
+      const auto idle = GenerateIdle(rng);
+      const auto idle_input = GenerateInput(rng, kFrames * kCyclesPerFrame);
+      TestIdle(profile.first, profile.second, idle, idle_input, seed,
+               idle_cycles);
+    }
+  }
+
+  // Otherwise the idle tests compared nothing but two ordinary runs
+  if (options.programs && !idle_cycles)
+    Fail("idle", options.seed, "no cycles were skipped");
+
+  if (failures) {
+    std::cout << failures << " failures\n";
+    return 1;
+  }
+  std::cout << "All tests passed\n";
+  return 0;
+}